@@ -0,0 +1,393 @@
+#include <cstring>
+#include <algorithm>
+#include "AsyncIO.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace job {
+	//Biggest single read, both ReadFile and read cap out somewhere around here
+	constexpr uint64_t MAX_READ_CHUNK = 1ull << 30;
+
+	void free_file_data(FileRead& read) {
+		delete[] read.data;
+		read.data = nullptr;
+		read.size = 0;
+	}
+
+	AsyncIO::~AsyncIO() {
+		shutdown();
+	}
+
+	void AsyncIO::init(JobSystem& jobSystem, uint32_t queueDepth, uint32_t fallbackThreadCount) {
+		system = &jobSystem;
+		stopping = false;
+		ringBroken = false;
+		if (queueDepth > 0 && init_ring(queueDepth)) {
+			reaperThread = std::thread([this]() { reaper_func(); });
+		}
+		for (uint32_t i = 0; i < std::max(fallbackThreadCount, 1u); i++) {
+			fallbackThreads.emplace_back([this]() { fallback_func(); });
+		}
+	}
+
+	void AsyncIO::shutdown() {
+		if (!system) {
+			return;
+		}
+		//The reaper goes first, it can still hand reads over to the fallback threads on its way out
+		if (reaperThread.joinable()) {
+			//A null read is a nop that tells the reaper to stop. If the ring broke the reaper is already gone.
+			while (!ringBroken && !submit(nullptr)) {
+				std::this_thread::yield();
+			}
+			reaperThread.join();
+		}
+		{
+			std::lock_guard<std::mutex> lock(fallbackMutex);
+			stopping = true;
+		}
+		fallbackCondition.notify_all();
+		for (std::thread& thread : fallbackThreads) {
+			thread.join();
+		}
+		fallbackThreads.clear();
+		close_ring();
+		system = nullptr;
+	}
+
+	bool AsyncIO::using_io_uring() {
+		return ringFd >= 0 && !ringBroken;
+	}
+
+	bool AsyncIO::read_file_and_wait(const std::wstring& path, FileRead& read) {
+		JobHandle handle = read_file(path, read);
+		system->wait_for(handle);
+		return read.ok;
+	}
+
+	void AsyncIO::finish(FileRead* read, bool ok) {
+		if (read->fd >= 0) {
+#ifdef __linux__
+			close(read->fd);
+#endif
+			read->fd = -1;
+		}
+		if (!ok) {
+			free_file_data(*read);
+		}
+		read->ok = ok;
+		//Completing can wake the waiter, which is free to destroy the read, so it's the last thing touched
+		JobHandle handle = read->handle;
+		system->complete(handle);
+	}
+
+	void AsyncIO::queue_fallback(FileRead* read) {
+		{
+			std::lock_guard<std::mutex> lock(fallbackMutex);
+			fallbackQueue.push_back(read);
+		}
+		fallbackCondition.notify_one();
+	}
+
+	void AsyncIO::fallback_func() {
+		while (true) {
+			FileRead* read;
+			{
+				std::unique_lock<std::mutex> lock(fallbackMutex);
+				fallbackCondition.wait(lock, [this]() { return stopping || !fallbackQueue.empty(); });
+				if (fallbackQueue.empty()) {
+					return;
+				}
+				read = fallbackQueue.front();
+				fallbackQueue.erase(fallbackQueue.begin());
+			}
+#ifdef _WIN32
+			HANDLE file = CreateFileW(read->path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file == INVALID_HANDLE_VALUE) {
+				finish(read, false);
+				continue;
+			}
+			LARGE_INTEGER fileSize;
+			bool ok = GetFileSizeEx(file, &fileSize) != 0;
+			if (ok) {
+				read->size = static_cast<uint64_t>(fileSize.QuadPart);
+				read->data = new char[read->size];
+				for (read->offset = 0; ok && read->offset < read->size;) {
+					DWORD bytesRead = 0;
+					DWORD toRead = static_cast<DWORD>(std::min(read->size - read->offset, MAX_READ_CHUNK));
+					ok = ReadFile(file, read->data + read->offset, toRead, &bytesRead, nullptr) != 0 && bytesRead > 0;
+					read->offset += bytesRead;
+				}
+			}
+			CloseHandle(file);
+			finish(read, ok);
+#elif __linux__
+			//The file was already opened by read_file, this only takes over the reading part
+			bool ok = true;
+			while (ok && read->offset < read->size) {
+				ssize_t bytesRead = pread(read->fd, read->data + read->offset, std::min(read->size - read->offset, MAX_READ_CHUNK), static_cast<off_t>(read->offset));
+				if (bytesRead < 0 && errno == EINTR) {
+					continue;
+				}
+				ok = bytesRead > 0;
+				if (ok) {
+					read->offset += static_cast<uint64_t>(bytesRead);
+				}
+			}
+			finish(read, ok);
+#else
+			finish(read, false);
+#endif
+		}
+	}
+
+#ifdef __linux__
+	static std::string utf8_path(const std::wstring& path) {
+		std::string result;
+		for (wchar_t wc : path) {
+			uint32_t c = static_cast<uint32_t>(wc);
+			if (c < 0x80) {
+				result += static_cast<char>(c);
+			} else if (c < 0x800) {
+				result += static_cast<char>(0xC0 | (c >> 6));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			} else if (c < 0x10000) {
+				result += static_cast<char>(0xE0 | (c >> 12));
+				result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			} else {
+				result += static_cast<char>(0xF0 | (c >> 18));
+				result += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+				result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+		}
+		return result;
+	}
+
+	//No liburing, the three syscalls are all we need
+	static int32_t io_uring_setup(uint32_t entries, io_uring_params* params) {
+		return static_cast<int32_t>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	static int32_t io_uring_enter(int32_t fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) {
+		return static_cast<int32_t>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	template<typename T>
+	static T* ring_field(void* ring, uint32_t offset) {
+		return reinterpret_cast<T*>(reinterpret_cast<char*>(ring) + offset);
+	}
+
+	bool AsyncIO::init_ring(uint32_t queueDepth) {
+		io_uring_params params{};
+		ringFd = io_uring_setup(std::max(queueDepth, 1u), &params);
+		if (ringFd < 0) {
+			//Old kernel, or io_uring is disabled (seccomp in containers does that a lot)
+			ringFd = -1;
+			return false;
+		}
+		sqEntries = params.sq_entries;
+		cqEntries = params.cq_entries;
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMap) {
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		}
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		cqRing = singleMap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+			close_ring();
+			return false;
+		}
+		sqHead = ring_field<uint32_t>(sqRing, params.sq_off.head);
+		sqTail = ring_field<uint32_t>(sqRing, params.sq_off.tail);
+		sqMask = ring_field<uint32_t>(sqRing, params.sq_off.ring_mask);
+		sqArray = ring_field<uint32_t>(sqRing, params.sq_off.array);
+		cqHead = ring_field<uint32_t>(cqRing, params.cq_off.head);
+		cqTail = ring_field<uint32_t>(cqRing, params.cq_off.tail);
+		cqMask = ring_field<uint32_t>(cqRing, params.cq_off.ring_mask);
+		cqes = ring_field<void>(cqRing, params.cq_off.cqes);
+		//Never grows past this, so submit doesn't allocate under the spin lock
+		inFlight.clear();
+		inFlight.reserve(cqEntries);
+		return true;
+	}
+
+	void AsyncIO::close_ring() {
+		if (ringFd < 0) {
+			return;
+		}
+		if (sqes && sqes != MAP_FAILED) {
+			munmap(sqes, sqesSize);
+		}
+		if (cqRing && cqRing != MAP_FAILED && cqRing != sqRing) {
+			munmap(cqRing, cqRingSize);
+		}
+		if (sqRing && sqRing != MAP_FAILED) {
+			munmap(sqRing, sqRingSize);
+		}
+		sqRing = cqRing = sqes = nullptr;
+		close(ringFd);
+		ringFd = -1;
+	}
+
+	bool AsyncIO::submit(FileRead* read) {
+		SPIN_LOCK(submitLock);
+		if (ringBroken) {
+			return false;
+		}
+		uint32_t tail = *sqTail;
+		uint32_t head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		//Keeping in flight under the completion queue size means it can never overflow and drop completions
+		if (tail - head >= sqEntries || (read && inFlight.size() >= cqEntries)) {
+			return false;
+		}
+		uint32_t index = tail & *sqMask;
+		io_uring_sqe* sqe = reinterpret_cast<io_uring_sqe*>(sqes) + index;
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		if (read) {
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = read->fd;
+			sqe->addr = reinterpret_cast<uint64_t>(read->data + read->offset);
+			sqe->len = static_cast<uint32_t>(std::min(read->size - read->offset, MAX_READ_CHUNK));
+			sqe->off = read->offset;
+			inFlight.push_back(read);
+		} else {
+			sqe->opcode = IORING_OP_NOP;
+		}
+		sqe->user_data = reinterpret_cast<uint64_t>(read);
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		//Once the tail is published the kernel owns the entry, so keep trying rather than handing the read to someone else too
+		while (io_uring_enter(ringFd, 1, 0, 0) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	void AsyncIO::reaper_func() {
+		bool stop = false;
+		while (!stop) {
+			int32_t result = io_uring_enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+			if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				//Nothing more is coming out of the ring. Stop new submissions and let the fallback threads redo whatever was still in it.
+				std::vector<FileRead*> stranded;
+				{
+					SPIN_LOCK(submitLock);
+					ringBroken = true;
+					stranded.swap(inFlight);
+				}
+				for (FileRead* read : stranded) {
+					queue_fallback(read);
+				}
+				return;
+			}
+			uint32_t head = *cqHead;
+			uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++) {
+				io_uring_cqe* cqe = reinterpret_cast<io_uring_cqe*>(cqes) + (head & *cqMask);
+				FileRead* read = reinterpret_cast<FileRead*>(cqe->user_data);
+				int32_t res = cqe->res;
+				//Hand the slot back before doing anything that might submit again
+				__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+				if (!read) {
+					//Shutting down, but finish off this batch first
+					stop = true;
+					continue;
+				}
+				{
+					SPIN_LOCK(submitLock);
+					std::vector<FileRead*>::iterator itr = std::find(inFlight.begin(), inFlight.end(), read);
+					*itr = inFlight.back();
+					inFlight.pop_back();
+				}
+				if (res == -EAGAIN || res == -EINTR) {
+					if (!submit(read)) {
+						queue_fallback(read);
+					}
+				} else if (res == -EINVAL || res == -EOPNOTSUPP) {
+					//Kernel has io_uring but not IORING_OP_READ (that came in 5.6)
+					queue_fallback(read);
+				} else if (res <= 0) {
+					finish(read, false);
+				} else {
+					read->offset += static_cast<uint64_t>(res);
+					//Short read, go again for the rest
+					if (read->offset < read->size) {
+						if (!submit(read)) {
+							queue_fallback(read);
+						}
+					} else {
+						finish(read, true);
+					}
+				}
+			}
+		}
+	}
+
+	JobHandle AsyncIO::read_file(const std::wstring& path, FileRead& read) {
+		read.data = nullptr;
+		read.size = 0;
+		read.offset = 0;
+		read.ok = false;
+		read.path = path;
+		read.handle = system->make_handle(1);
+		JobHandle handle = read.handle;
+		//Opening and the size lookup are quick metadata calls, only the read itself goes async
+		read.fd = open(utf8_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info;
+		if (read.fd < 0 || fstat(read.fd, &info) != 0) {
+			finish(&read, false);
+			return handle;
+		}
+		read.size = static_cast<uint64_t>(info.st_size);
+		read.data = new char[std::max<uint64_t>(read.size, 1)];
+		if (read.size == 0) {
+			finish(&read, true);
+		} else if (ringFd < 0 || !submit(&read)) {
+			queue_fallback(&read);
+		}
+		return handle;
+	}
+#else
+	bool AsyncIO::init_ring(uint32_t queueDepth) {
+		return false;
+	}
+
+	void AsyncIO::close_ring() {
+	}
+
+	bool AsyncIO::submit(FileRead* read) {
+		return false;
+	}
+
+	void AsyncIO::reaper_func() {
+	}
+
+	JobHandle AsyncIO::read_file(const std::wstring& path, FileRead& read) {
+		read.data = nullptr;
+		read.size = 0;
+		read.offset = 0;
+		read.ok = false;
+		read.path = path;
+		read.handle = system->make_handle(1);
+		JobHandle handle = read.handle;
+		queue_fallback(&read);
+		return handle;
+	}
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "JobSystem.h"
+
+namespace job {
+	class AsyncIO;
+
+	//One whole file read. Has to stay alive until its handle completes.
+	struct FileRead {
+		//new[]'d buffer holding the whole file, hand it to free_file_data when done
+		char* data = nullptr;
+		uint64_t size = 0;
+		bool ok = false;
+
+		//Everything below belongs to AsyncIO while the read is in flight
+		std::wstring path;
+		JobHandle handle{};
+		uint64_t offset = 0;
+		int32_t fd = -1;
+	};
+
+	void free_file_data(FileRead& read);
+
+	//Reads whole files without blocking a worker. On Linux reads go through io_uring with a thread reaping completions,
+	//otherwise (or if the kernel doesn't support it) a few threads do plain blocking reads. Either way the read finishes by
+	//completing its JobHandle, so a job waiting on it with wait_for is suspended and requeued just like on a JobCounter.
+	class AsyncIO {
+	private:
+		JobSystem* system = nullptr;
+		std::atomic<bool> stopping{ false };
+
+		std::mutex fallbackMutex;
+		std::condition_variable fallbackCondition;
+		std::vector<FileRead*> fallbackQueue;
+		std::vector<std::thread> fallbackThreads;
+
+		int32_t ringFd = -1;
+		std::thread reaperThread;
+		SpinLock submitLock{};
+		uint32_t sqEntries = 0;
+		uint32_t cqEntries = 0;
+		//Reads the kernel currently has, so they can be handed to the fallback threads if the ring stops working
+		std::vector<FileRead*> inFlight;
+		std::atomic<bool> ringBroken{ false };
+		void* sqRing = nullptr;
+		void* cqRing = nullptr;
+		size_t sqRingSize = 0;
+		size_t cqRingSize = 0;
+		void* sqes = nullptr;
+		size_t sqesSize = 0;
+		uint32_t* sqHead = nullptr;
+		uint32_t* sqTail = nullptr;
+		uint32_t* sqMask = nullptr;
+		uint32_t* sqArray = nullptr;
+		uint32_t* cqHead = nullptr;
+		uint32_t* cqTail = nullptr;
+		uint32_t* cqMask = nullptr;
+		void* cqes = nullptr;
+
+		bool init_ring(uint32_t queueDepth);
+		void close_ring();
+		bool submit(FileRead* read);
+		void reaper_func();
+		void fallback_func();
+		void queue_fallback(FileRead* read);
+		void finish(FileRead* read, bool ok);
+	public:
+		AsyncIO() = default;
+		AsyncIO(const AsyncIO&) = delete;
+		AsyncIO& operator=(const AsyncIO&) = delete;
+		~AsyncIO();
+
+		//queueDepth is how many io_uring reads can be in flight before the rest spill over to the fallback threads. 0 skips io_uring entirely.
+		void init(JobSystem& jobSystem, uint32_t queueDepth = 64, uint32_t fallbackThreadCount = 2);
+		//Every read has to be finished by now, anything still in flight is dropped
+		void shutdown();
+		bool using_io_uring();
+
+		//Starts reading the whole file into read. wait_for the handle from a job to suspend until it's done, or co_await when_complete in a Task.
+		JobHandle read_file(const std::wstring& path, FileRead& read);
+		//Same thing, suspending the calling job until the read is done
+		bool read_file_and_wait(const std::wstring& path, FileRead& read);
+	};
+}
\ No newline at end of file
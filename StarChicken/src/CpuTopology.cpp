@@ -0,0 +1,213 @@
+#include <thread>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include "CpuTopology.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif __linux__
+#include <dirent.h>
+#endif
+
+namespace job {
+	TopologyDistance CpuTopology::distance(const LogicalCpu& a, const LogicalCpu& b) const {
+		if (a.core == b.core) {
+			return TOPOLOGY_SAME_CORE;
+		}
+		if (a.lastLevelCache == b.lastLevelCache) {
+			return TOPOLOGY_SHARED_CACHE;
+		}
+		if (a.package == b.package && a.numaNode == b.numaNode) {
+			return TOPOLOGY_SAME_NODE;
+		}
+		return TOPOLOGY_REMOTE;
+	}
+
+	static void fallback_topology(CpuTopology& topology) {
+		topology.cpus.clear();
+		uint32_t count = std::max(std::thread::hardware_concurrency(), 1u);
+		for (uint32_t i = 0; i < count; i++) {
+			topology.cpus.push_back(LogicalCpu{ i, i, 0, 0, 0 });
+		}
+	}
+
+#ifdef _WIN32
+	static uint32_t lowest_bit(KAFFINITY mask) {
+		for (uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+			if (mask & (static_cast<KAFFINITY>(1) << bit)) {
+				return bit;
+			}
+		}
+		return 0;
+	}
+
+	//Calls func(cpu, groupId) for every CPU in the mask, where groupId is the lowest CPU in the mask
+	template<typename Func>
+	static void for_each_in_mask(const GROUP_AFFINITY& affinity, Func&& func) {
+		if (affinity.Group != 0) {
+			return;
+		}
+		uint32_t groupId = lowest_bit(affinity.Mask);
+		for (uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+			if (affinity.Mask & (static_cast<KAFFINITY>(1) << bit)) {
+				func(bit, groupId);
+			}
+		}
+	}
+
+	CpuTopology read_cpu_topology() {
+		CpuTopology topology{};
+		DWORD length = 0;
+		GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+		std::vector<uint8_t> buffer(length);
+		if (length == 0 || !GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length)) {
+			fallback_topology(topology);
+			return topology;
+		}
+		//Indexed by CPU id, only the ones that show up as part of a core are real
+		std::vector<LogicalCpu> cpus(sizeof(KAFFINITY) * 8);
+		std::vector<bool> present(cpus.size());
+		uint32_t lastLevel = 0;
+		for (DWORD offset = 0; offset < length;) {
+			SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+			if (info->Relationship == RelationCache) {
+				lastLevel = std::max(lastLevel, static_cast<uint32_t>(info->Cache.Level));
+			}
+			offset += info->Size;
+		}
+		for (DWORD offset = 0; offset < length;) {
+			SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+			switch (info->Relationship) {
+			case RelationProcessorCore:
+				for_each_in_mask(info->Processor.GroupMask[0], [&](uint32_t cpu, uint32_t groupId) {
+					cpus[cpu].id = cpu;
+					cpus[cpu].core = groupId;
+					present[cpu] = true;
+				});
+				break;
+			case RelationCache:
+				if (info->Cache.Level == lastLevel) {
+					for_each_in_mask(info->Cache.GroupMask, [&](uint32_t cpu, uint32_t groupId) {
+						cpus[cpu].lastLevelCache = groupId;
+					});
+				}
+				break;
+			case RelationProcessorPackage:
+				for_each_in_mask(info->Processor.GroupMask[0], [&](uint32_t cpu, uint32_t groupId) {
+					cpus[cpu].package = groupId;
+				});
+				break;
+			case RelationNumaNode:
+				//Nodes have their own number, the lowest CPU isn't needed
+				for_each_in_mask(info->NumaNode.GroupMask, [&](uint32_t cpu, uint32_t) {
+					cpus[cpu].numaNode = info->NumaNode.NodeNumber;
+				});
+				break;
+			default:
+				break;
+			}
+			offset += info->Size;
+		}
+		for (uint32_t i = 0; i < cpus.size(); i++) {
+			if (present[i]) {
+				topology.cpus.push_back(cpus[i]);
+			}
+		}
+		if (topology.cpus.empty()) {
+			fallback_topology(topology);
+		}
+		return topology;
+	}
+#elif __linux__
+	//Lists look like "0-3,8-11" and are sorted, so the first number is the lowest
+	static std::vector<uint32_t> parse_cpu_list(const std::string& list) {
+		std::vector<uint32_t> cpus;
+		size_t pos = 0;
+		while (pos < list.size()) {
+			size_t end = list.find(',', pos);
+			if (end == std::string::npos) {
+				end = list.size();
+			}
+			std::string range = list.substr(pos, end - pos);
+			size_t dash = range.find('-');
+			try {
+				uint32_t first = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+				uint32_t last = dash == std::string::npos ? first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+				for (uint32_t cpu = first; cpu <= last; cpu++) {
+					cpus.push_back(cpu);
+				}
+			} catch (const std::exception&) {
+			}
+			pos = end + 1;
+		}
+		return cpus;
+	}
+
+	static bool read_line(const std::string& path, std::string& line) {
+		std::ifstream file(path);
+		return file && std::getline(file, line);
+	}
+
+	static uint32_t first_in_list(const std::string& path, uint32_t fallback) {
+		std::string line;
+		if (!read_line(path, line)) {
+			return fallback;
+		}
+		std::vector<uint32_t> cpus = parse_cpu_list(line);
+		return cpus.empty() ? fallback : cpus[0];
+	}
+
+	CpuTopology read_cpu_topology() {
+		CpuTopology topology{};
+		const std::string cpuPath = "/sys/devices/system/cpu/";
+		std::string online;
+		if (!read_line(cpuPath + "online", online)) {
+			fallback_topology(topology);
+			return topology;
+		}
+		for (uint32_t id : parse_cpu_list(online)) {
+			std::string dir = cpuPath + "cpu" + std::to_string(id) + "/";
+			LogicalCpu cpu{ id, id, 0, 0, 0 };
+			cpu.core = first_in_list(dir + "topology/thread_siblings_list", id);
+			std::string line;
+			if (read_line(dir + "topology/physical_package_id", line)) {
+				cpu.package = static_cast<uint32_t>(std::max(std::atoi(line.c_str()), 0));
+			}
+			//The highest numbered cache index is the last level
+			uint32_t lastLevel = 0;
+			for (uint32_t index = 0; read_line(dir + "cache/index" + std::to_string(index) + "/level", line); index++) {
+				uint32_t level = static_cast<uint32_t>(std::max(std::atoi(line.c_str()), 0));
+				if (level >= lastLevel) {
+					lastLevel = level;
+					cpu.lastLevelCache = first_in_list(dir + "cache/index" + std::to_string(index) + "/shared_cpu_list", 0);
+				}
+			}
+			//The NUMA node shows up as a nodeN link in the CPU's directory
+			if (DIR* cpuDir = opendir(dir.c_str())) {
+				while (dirent* entry = readdir(cpuDir)) {
+					if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+						cpu.numaNode = static_cast<uint32_t>(std::atoi(entry->d_name + 4));
+						break;
+					}
+				}
+				closedir(cpuDir);
+			}
+			topology.cpus.push_back(cpu);
+		}
+		if (topology.cpus.empty()) {
+			fallback_topology(topology);
+		}
+		return topology;
+	}
+#else
+	CpuTopology read_cpu_topology() {
+		CpuTopology topology{};
+		fallback_topology(topology);
+		return topology;
+	}
+#endif
+}
\ No newline at end of file
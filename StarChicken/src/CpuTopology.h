@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace job {
+	//How far apart two logical CPUs are, closest first. Stealing from a closer worker is more likely to find the data already in cache.
+	enum TopologyDistance : uint8_t {
+		//Hyperthreads on the same physical core
+		TOPOLOGY_SAME_CORE,
+		//Different cores sharing a last level cache
+		TOPOLOGY_SHARED_CACHE,
+		//Same package or NUMA node but nothing cached in common
+		TOPOLOGY_SAME_NODE,
+		//Another socket or NUMA node
+		TOPOLOGY_REMOTE,
+		TOPOLOGY_DISTANCE_COUNT
+	};
+
+	struct LogicalCpu {
+		//The id the OS uses for affinity
+		uint32_t id;
+		//Everything below is the lowest CPU id in the group, so two CPUs are in the same group if the ids match
+		uint32_t core;
+		uint32_t lastLevelCache;
+		uint32_t package;
+		uint32_t numaNode;
+	};
+
+	struct CpuTopology {
+		std::vector<LogicalCpu> cpus;
+
+		TopologyDistance distance(const LogicalCpu& a, const LogicalCpu& b) const;
+	};
+
+	//Reads /sys/devices/system/cpu on Linux and GetLogicalProcessorInformationEx on Windows (processor group 0 only).
+	//If that fails every CPU is treated as its own core with one shared cache.
+	CpuTopology read_cpu_topology();
+}
\ No newline at end of file
@@ -71,11 +71,13 @@ namespace engine {
 				std::cout << iterations << "\n";
 			}*/
 			++iterations;
+			job::advance_scratch_frame();
 			job::JobDecl decls[2];
 			decls[0] = job::JobDecl(update);
 			decls[1] = job::JobDecl(render);
 				
 			jobSystem.start_jobs_and_wait_for_counter(decls, 2);
+			jobSystem.emit_profile_counters();
 		}
 	}
 
@@ -174,6 +176,10 @@ namespace engine {
 		vku::cleanup_vulkan();
 	}
 
+	//Starting any entry point is what lets the workers out of their startup wait, this one has nothing else to do
+	void start_workers() {
+	}
+
 	//We're going to go with snake_case names to match the standard library. Feels a little weird coming from java, but I'll get over it.
 	//I wonder if I should have made this camelCase actually, to match glfw and vulkan
 	//Variable names should be camelCase to differentiate them from functions
@@ -193,8 +199,15 @@ int main() {
 
 	vku::recompile_modified_shaders(".\\resources\\shaders");
 	engine::init_window();
+	//Up before the engine so anything sized from the worker count, like the ECS lock and command buffers, sees the real one.
+	//The frame loop below still runs on this thread outside of any job.
+	uint32_t workerCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	engine::jobSystem.init_job_system(workerCount);
+	job::JobDecl startDecl{ engine::start_workers };
+	engine::jobSystem.start_entry_point(startDecl);
 	engine::init_engine();
 	while (!windowing::window_should_close(engine::window)) {
+		job::advance_scratch_frame();
 		engine::inputSystem.handle_input();
 		engine::WINDOW_WIDTH = windowing::width;
 		engine::WINDOW_HEIGHT = windowing::height;
@@ -208,6 +221,7 @@ int main() {
 	}
 	VKU_CHECK_RESULT(vkDeviceWaitIdle(vku::device), "Failed to wait idle!");
 	engine::cleanup();
+	engine::jobSystem.end_job_system();
 	engine::cleanup_window();
 	return 0;
 
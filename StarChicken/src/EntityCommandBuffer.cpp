@@ -0,0 +1,181 @@
+#include <algorithm>
+#include "EntityCommandBuffer.h"
+
+namespace ecs {
+	EntityCommandBuffer::EntityCommandBuffer(ComponentSystem& componentSystem, job::JobSystem& jobSystem) : system{ &componentSystem }, workerCount{ jobSystem.thread_count() } {
+		buffers = new Buffer[this->workerCount + 1];
+	}
+
+	EntityCommandBuffer::~EntityCommandBuffer() {
+		//Payloads that never got played back still have to be destroyed, their types may not be registered yet
+		for (uint32_t i = 0; i <= workerCount; i++) {
+			for (Command& command : buffers[i].commands) {
+				if (command.payload) {
+					command.info().destroy(command.payload);
+				}
+			}
+		}
+		delete[] buffers;
+	}
+
+	void* EntityCommandBuffer::record(Command command, size_t size, size_t alignment) {
+		uint32_t id = job::threadData ? job::threadData->threadId : workerCount;
+		if (id < workerCount) {
+			Buffer& buf = buffers[id];
+			if (size) {
+				command.payload = buf.payloads.alloc(size, alignment);
+			}
+			buf.commands.push_back(command);
+			return command.payload;
+		}
+		SPIN_LOCK(sharedLock);
+		Buffer& buf = buffers[workerCount];
+		if (size) {
+			command.payload = buf.payloads.alloc(size, alignment);
+		}
+		buf.commands.push_back(command);
+		return command.payload;
+	}
+
+	void EntityCommandBuffer::destroyPayload(Command& command) {
+		if (command.payload) {
+			system->componentTypes[command.componentType].destroy(command.payload);
+			command.payload = nullptr;
+		}
+	}
+
+	Entity EntityCommandBuffer::createEntity() {
+		Entity ent = system->reserveEntity();
+		record(Command{ ent, COMMAND_CREATE, 0, nullptr, nullptr });
+		return ent;
+	}
+
+	void EntityCommandBuffer::destroyEntity(Entity ent) {
+		record(Command{ ent, COMMAND_DESTROY, 0, nullptr, nullptr });
+	}
+
+	bool EntityCommandBuffer::empty() {
+		for (uint32_t i = 0; i <= workerCount; i++) {
+			if (!buffers[i].commands.empty()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void EntityCommandBuffer::playback() {
+		std::vector<Command> commands;
+		for (uint32_t i = 0; i <= workerCount; i++) {
+			commands.insert(commands.end(), buffers[i].commands.begin(), buffers[i].commands.end());
+		}
+		//Stable so each entity's commands stay in the order they were recorded
+		std::stable_sort(commands.begin(), commands.end(), [](const Command& a, const Command& b) {
+			return a.entity < b.entity;
+		});
+		//Types first seen in a job couldn't be registered while recording
+		for (Command& command : commands) {
+			if (command.info && (command.componentType >= MAX_COMPONENT_TYPES || !((system->registeredTypes >> command.componentType) & 1))) {
+				system->registerComponentType(command.componentType, command.info());
+			}
+		}
+
+		size_t highest = static_cast<size_t>(system->currentEntityId.load(std::memory_order_relaxed));
+		if (system->entityLocations.size() < highest) {
+			system->entityLocations.resize(highest, EntityLocation{ nullptr, 0, 0 });
+		}
+		//Work out where every entity ends up. Only the last add of each type keeps its payload, and destroys happen right away.
+		ComponentMask defaultMask = system->defaultMask();
+		std::vector<Resolved> resolved;
+		Command* latest[MAX_COMPONENT_TYPES]{};
+		for (uint32_t first = 0; first < commands.size();) {
+			Entity ent = commands[first].entity;
+			uint32_t last = first;
+			while (last < commands.size() && commands[last].entity == ent) {
+				last++;
+			}
+			EntityLocation* loc = system->location(ent);
+			ComponentMask mask = loc ? loc->chunk->archetype->mask : 0;
+			bool created = false;
+			bool destroyed = false;
+			for (uint32_t i = first; i < last; i++) {
+				Command& command = commands[i];
+				switch (command.type) {
+				case COMMAND_CREATE:
+					created = true;
+					mask = defaultMask;
+					break;
+				case COMMAND_DESTROY:
+					destroyed = true;
+					break;
+				case COMMAND_ADD:
+					if (latest[command.componentType]) {
+						destroyPayload(*latest[command.componentType]);
+					}
+					latest[command.componentType] = &command;
+					mask |= ComponentMask(1) << command.componentType;
+					break;
+				case COMMAND_REMOVE:
+					if (latest[command.componentType]) {
+						destroyPayload(*latest[command.componentType]);
+						latest[command.componentType] = nullptr;
+					}
+					mask &= ~(ComponentMask(1) << command.componentType);
+					break;
+				}
+			}
+			if (destroyed || (!loc && !created)) {
+				for (uint32_t i = first; i < last; i++) {
+					destroyPayload(commands[i]);
+				}
+				if (loc && destroyed) {
+					system->removeEntity(ent);
+				} else if (created) {
+					//Never made it into an archetype, the slot can go straight back
+					system->releaseEntity(ent);
+				}
+			} else {
+				resolved.push_back(Resolved{ mask, ent, created, first, last });
+			}
+			for (uint32_t i = first; i < last; i++) {
+				if (commands[i].type == COMMAND_ADD || commands[i].type == COMMAND_REMOVE) {
+					latest[commands[i].componentType] = nullptr;
+				}
+			}
+			first = last;
+		}
+
+		//Entities headed for the same archetype are next to each other, so the archetype is only looked up once per batch and its last chunk stays hot
+		std::sort(resolved.begin(), resolved.end(), [](const Resolved& a, const Resolved& b) {
+			return a.mask != b.mask ? a.mask < b.mask : a.entity < b.entity;
+		});
+		void* payloads[MAX_COMPONENT_TYPES]{};
+		Archetype* archetype = nullptr;
+		for (Resolved& entry : resolved) {
+			if (!archetype || archetype->mask != entry.mask) {
+				archetype = system->getArchetype(entry.mask);
+			}
+			for (uint32_t i = entry.first; i < entry.last; i++) {
+				if (commands[i].payload) {
+					payloads[commands[i].componentType] = commands[i].payload;
+				}
+			}
+			bool transformChanged = payloads[system->transformType] != nullptr;
+			if (entry.created) {
+				system->placeEntity(entry.entity, archetype, payloads);
+			} else {
+				system->moveEntity(entry.entity, archetype, payloads);
+			}
+			for (uint32_t i = entry.first; i < entry.last; i++) {
+				payloads[commands[i].componentType] = nullptr;
+			}
+			if (transformChanged) {
+				system->markTransformDirty(entry.entity);
+			}
+		}
+
+		for (uint32_t i = 0; i <= workerCount; i++) {
+			buffers[i].commands.clear();
+			buffers[i].payloads.reset();
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include "EntityComponentSystem.h"
+#include "ScratchAllocator.h"
+
+namespace ecs {
+	//Records structural changes (creating and destroying entities, adding and removing components) from any number of jobs at once
+	//and applies them all in playback, so systems running in parallel never move entities out from under each other.
+	//Every worker records into its own buffer, anything else goes through a locked shared one.
+	class EntityCommandBuffer {
+	private:
+		enum CommandType : uint8_t {
+			COMMAND_CREATE,
+			COMMAND_DESTROY,
+			COMMAND_ADD,
+			COMMAND_REMOVE
+		};
+
+		struct Command {
+			Entity entity;
+			CommandType type;
+			uint32_t componentType;
+			//Copy of the component for an add, lives in the recording buffer's arena
+			void* payload;
+			ComponentInfo (*info)();
+		};
+
+		struct alignas(64) Buffer {
+			std::vector<Command> commands;
+			job::LinearArena payloads;
+		};
+
+		//What an entity ends up as once all its commands are applied
+		struct Resolved {
+			ComponentMask mask;
+			Entity entity;
+			bool created;
+			//Range of the entity's commands in the sorted command list
+			uint32_t first;
+			uint32_t last;
+		};
+
+		ComponentSystem* system;
+		uint32_t workerCount;
+		//One per worker, the last one is shared by everything else
+		Buffer* buffers;
+		job::SpinLock sharedLock{};
+
+		//Returns the payload memory for the command if size isn't 0
+		void* record(Command command, size_t size = 0, size_t alignment = 0);
+		void destroyPayload(Command& command);
+	public:
+		//Buffers are per worker of jobSystem, so it has to be initialized already
+		EntityCommandBuffer(ComponentSystem& componentSystem, job::JobSystem& jobSystem);
+		~EntityCommandBuffer();
+		EntityCommandBuffer(const EntityCommandBuffer&) = delete;
+		EntityCommandBuffer& operator=(const EntityCommandBuffer&) = delete;
+
+		//The id is good right away for recording more commands, the entity itself shows up on playback.
+		//Freed slots are reused, so spawning through command buffers doesn't run through the id space.
+		Entity createEntity();
+		void destroyEntity(Entity ent);
+
+		//Replaces the component if the entity already has one by then
+		template<typename T>
+		void addComponent(Entity ent, const T& component) {
+			void* payload = record(Command{ ent, COMMAND_ADD, component_type_id<T>(), nullptr, &make_component_info<T> }, sizeof(T), alignof(T));
+			new (payload) T(component);
+		}
+
+		template<typename T>
+		void removeComponent(Entity ent) {
+			record(Command{ ent, COMMAND_REMOVE, component_type_id<T>(), nullptr, &make_component_info<T> });
+		}
+
+		bool empty();
+
+		//Applies everything in the order it was recorded per thread, then clears the buffers. Nothing else can be touching the component system or recording.
+		//Changes are grouped by the archetype each entity ends up in, so each entity moves at most once however many commands it had.
+		void playback();
+	};
+}
\ No newline at end of file
@@ -1,20 +1,818 @@
 #include <unordered_map>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
 #include "EntityComponentSystem.h"
 
 namespace ecs {
 
+	ComponentSystem::ComponentSystem(job::JobSystem& jobSystem) : lock{ jobSystem } {
+		removedEntityIdsLock.track_stats("ECS removed entity ids");
+		hierarchyType = componentType<HierarchyComponent>();
+		transformType = componentType<TransformComponent>();
+	}
+
+	ComponentSystem::~ComponentSystem() {
+		for (Archetype* archetype : archetypes) {
+			for (Chunk* chunk : archetype->chunks) {
+				for (uint32_t type : archetype->types) {
+					ComponentInfo& info = componentTypes[type];
+					char* components = reinterpret_cast<char*>(archetype->column(chunk, type));
+					for (uint32_t i = 0; i < chunk->count; i++) {
+						info.destroy(components + i * info.size);
+					}
+				}
+				if (!chunk->mapped) {
+					delete chunk;
+				}
+			}
+			delete archetype;
+		}
+		for (Chunk* chunk : freeChunks) {
+			if (!chunk->mapped) {
+				delete chunk;
+			}
+		}
+		for (util::FileMapping& mapping : snapshotMappings) {
+			util::unmap_file(mapping);
+		}
+	}
+
+	static std::atomic<uint32_t> componentTypeCount{ 0 };
+
+	uint32_t next_component_type_id() {
+		return componentTypeCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void ComponentSystem::registerComponentType(uint32_t type, const ComponentInfo& info) {
+		if (type >= MAX_COMPONENT_TYPES) {
+			throw std::runtime_error("Too many component types!");
+		}
+		assert(info.alignment <= alignof(Chunk));
+		if (type >= componentTypes.size()) {
+			componentTypes.resize(type + 1, ComponentInfo{});
+		}
+		componentTypes[type] = info;
+		registeredTypes |= ComponentMask(1) << type;
+	}
+
+	Archetype* ComponentSystem::getArchetype(ComponentMask mask) {
+		std::unordered_map<ComponentMask, Archetype*>::iterator itr = archetypesByMask.find(mask);
+		if (itr != archetypesByMask.end()) {
+			return itr->second;
+		}
+		Archetype* archetype = new Archetype{};
+		archetype->mask = mask;
+		uint32_t rowSize = sizeof(Entity);
+		for (uint32_t type = 0; type < componentTypes.size(); type++) {
+			if ((mask >> type) & 1) {
+				archetype->types.push_back(type);
+				rowSize += componentTypes[type].size;
+			}
+		}
+		//Start from the capacity without any padding and back off until every array still fits once it's aligned
+		uint32_t capacity = CHUNK_SIZE / rowSize;
+		while (true) {
+			uint32_t offset = sizeof(Entity) * capacity;
+			for (uint32_t type : archetype->types) {
+				ComponentInfo& info = componentTypes[type];
+				offset = (offset + info.alignment - 1) & ~(info.alignment - 1);
+				archetype->columnOffsets[type] = offset;
+				offset += info.size * capacity;
+			}
+			if (offset <= CHUNK_SIZE) {
+				break;
+			}
+			capacity--;
+		}
+		archetype->chunkCapacity = capacity;
+		archetypes.push_back(archetype);
+		archetypesByMask[mask] = archetype;
+		return archetype;
+	}
+
+	Archetype* ComponentSystem::archetypeWith(Archetype* archetype, uint32_t type) {
+		if (!archetype->addEdges[type]) {
+			archetype->addEdges[type] = getArchetype(archetype->mask | (ComponentMask(1) << type));
+		}
+		return archetype->addEdges[type];
+	}
+
+	Archetype* ComponentSystem::archetypeWithout(Archetype* archetype, uint32_t type) {
+		if (!archetype->removeEdges[type]) {
+			archetype->removeEdges[type] = getArchetype(archetype->mask & ~(ComponentMask(1) << type));
+		}
+		return archetype->removeEdges[type];
+	}
+
+	Chunk* ComponentSystem::addChunk(Archetype* archetype) {
+		Chunk* chunk = nullptr;
+		if (!freeChunks.empty()) {
+			chunk = freeChunks.back();
+			freeChunks.pop_back();
+		} else {
+			chunk = new Chunk;
+			chunk->mapped = false;
+		}
+		chunk->archetype = archetype;
+		chunk->count = 0;
+		for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+			chunk->versions[type].store(changeVersion, std::memory_order_relaxed);
+		}
+		archetype->chunks.push_back(chunk);
+		return chunk;
+	}
+
+	void ComponentSystem::touchAll(Chunk* chunk) {
+		for (uint32_t type : chunk->archetype->types) {
+			touch(chunk, type);
+		}
+	}
+
+	EntityLocation ComponentSystem::pushRow(Archetype* archetype, Entity ent) {
+		if (archetype->chunks.empty() || archetype->chunks.back()->count == archetype->chunkCapacity) {
+			addChunk(archetype);
+		}
+		Chunk* chunk = archetype->chunks.back();
+		touchAll(chunk);
+		uint32_t row = chunk->count++;
+		chunk->entities()[row] = ent;
+		archetype->entityCount++;
+		return EntityLocation{ chunk, row, entity_generation(ent) };
+	}
+
+	void ComponentSystem::removeRow(EntityLocation location) {
+		Archetype* archetype = location.chunk->archetype;
+		Chunk* last = archetype->chunks.back();
+		uint32_t lastRow = last->count - 1;
+		if (last != location.chunk || lastRow != location.row) {
+			Entity moved = last->entities()[lastRow];
+			for (uint32_t type : archetype->types) {
+				ComponentInfo& info = componentTypes[type];
+				char* dst = reinterpret_cast<char*>(archetype->column(location.chunk, type)) + location.row * info.size;
+				char* src = reinterpret_cast<char*>(archetype->column(last, type)) + lastRow * info.size;
+				if (info.trivial) {
+					memcpy(dst, src, info.size);
+				} else {
+					info.relocate(dst, src);
+				}
+			}
+			location.chunk->entities()[location.row] = moved;
+			touchAll(location.chunk);
+			EntityLocation& movedLoc = entityLocations[entity_index(moved)];
+			movedLoc.chunk = location.chunk;
+			movedLoc.row = location.row;
+		}
+		last->count--;
+		archetype->entityCount--;
+		if (last->count == 0) {
+			freeChunks.push_back(last);
+			archetype->chunks.pop_back();
+		}
+	}
+
+	void ComponentSystem::moveEntity(Entity ent, Archetype* to, void** payloads) {
+		EntityLocation from = entityLocations[entity_index(ent)];
+		Archetype* source = from.chunk->archetype;
+		if (source == to) {
+			//Nothing to move, just swap in the new values
+			if (payloads) {
+				for (uint32_t type : to->types) {
+					if (payloads[type]) {
+						touch(from.chunk, type);
+						ComponentInfo& info = componentTypes[type];
+						char* dst = reinterpret_cast<char*>(to->column(from.chunk, type)) + from.row * info.size;
+						info.destroy(dst);
+						info.relocate(dst, payloads[type]);
+					}
+				}
+			}
+			return;
+		}
+		EntityLocation dest = pushRow(to, ent);
+		for (uint32_t type : to->types) {
+			ComponentInfo& info = componentTypes[type];
+			char* dst = reinterpret_cast<char*>(to->column(dest.chunk, type)) + dest.row * info.size;
+			if (payloads && payloads[type]) {
+				info.relocate(dst, payloads[type]);
+				if (source->has(type)) {
+					info.destroy(reinterpret_cast<char*>(source->column(from.chunk, type)) + from.row * info.size);
+				}
+			} else if (source->has(type)) {
+				info.relocate(dst, reinterpret_cast<char*>(source->column(from.chunk, type)) + from.row * info.size);
+			} else {
+				info.construct(dst);
+			}
+		}
+		for (uint32_t type : source->types) {
+			if (!to->has(type)) {
+				ComponentInfo& info = componentTypes[type];
+				info.destroy(reinterpret_cast<char*>(source->column(from.chunk, type)) + from.row * info.size);
+			}
+		}
+		removeRow(from);
+		entityLocations[entity_index(ent)] = dest;
+	}
+
+	void ComponentSystem::placeEntity(Entity ent, Archetype* archetype, void** payloads) {
+		if (entity_index(ent) >= entityLocations.size()) {
+			entityLocations.resize(entity_index(ent) + 1, EntityLocation{ nullptr, 0, 0 });
+		}
+		EntityLocation loc = pushRow(archetype, ent);
+		for (uint32_t type : archetype->types) {
+			ComponentInfo& info = componentTypes[type];
+			char* dst = reinterpret_cast<char*>(archetype->column(loc.chunk, type)) + loc.row * info.size;
+			if (payloads && payloads[type]) {
+				info.relocate(dst, payloads[type]);
+			} else {
+				info.construct(dst);
+			}
+		}
+		entityLocations[entity_index(ent)] = loc;
+	}
 
+	Entity ComponentSystem::reserveEntity() {
+		{
+			SPIN_LOCK(removedEntityIdsLock);
+			if (!removedEntityIds.empty()) {
+				uint32_t index = removedEntityIds.back();
+				removedEntityIds.pop_back();
+				return make_entity(index, entityLocations[index].generation);
+			}
+		}
+		return reserveFreshEntities(1);
+	}
+
+	Entity ComponentSystem::reserveFreshEntities(uint32_t count) {
+		uint64_t index = currentEntityId.fetch_add(count, std::memory_order_relaxed);
+		if (index + count - 1 > ENTITY_MAX_INDEX) {
+			currentEntityId.fetch_sub(count, std::memory_order_relaxed);
+			throw std::runtime_error("Out of entity ids!");
+		}
+		return make_entity(static_cast<uint32_t>(index), 0);
+	}
+
+	void ComponentSystem::releaseEntity(Entity ent) {
+		EntityLocation& slot = entityLocations[entity_index(ent)];
+		slot.chunk = nullptr;
+		slot.generation++;
+		if (slot.generation != ENTITY_MAX_GENERATION) {
+			removedEntityIds.push_back(entity_index(ent));
+		}
+	}
+
+	ComponentMask ComponentSystem::defaultMask() {
+		return (ComponentMask(1) << hierarchyType) | (ComponentMask(1) << transformType);
+	}
+
+	void ComponentSystem::unlinkFromParent(Entity child) {
+		HierarchyComponent* cHier = hierarchy(child);
+		if (cHier->parent != NULL_ENTITY) {
+			if (cHier->prevSibling != NULL_ENTITY) {
+				hierarchy(cHier->prevSibling)->nextSibling = cHier->nextSibling;
+			} else {
+				hierarchy(cHier->parent)->firstChild = cHier->nextSibling;
+			}
+			if (cHier->nextSibling != NULL_ENTITY) {
+				hierarchy(cHier->nextSibling)->prevSibling = cHier->prevSibling;
+			}
+		}
+		cHier->parent = NULL_ENTITY;
+		cHier->nextSibling = NULL_ENTITY;
+		cHier->prevSibling = NULL_ENTITY;
+	}
+
+	void ComponentSystem::makeParent(Entity parent, Entity child) {
+		for (Entity ancestor = parent; ancestor != NULL_ENTITY; ancestor = hierarchy(ancestor)->parent) {
+			if (ancestor == child) {
+				throw std::runtime_error("Entity can't be parented to its own descendant!");
+			}
+		}
+		unlinkFromParent(child);
+		if (parent != NULL_ENTITY) {
+			HierarchyComponent* cHier = hierarchy(child);
+			HierarchyComponent* pHier = hierarchy(parent);
+			cHier->parent = parent;
+			cHier->nextSibling = pHier->firstChild;
+			if (pHier->firstChild != NULL_ENTITY) {
+				hierarchy(pHier->firstChild)->prevSibling = child;
+			}
+			pHier->firstChild = child;
+		}
+		markTransformDirty(child);
+	}
+
+	void ComponentSystem::markTransformDirty(Entity ent) {
+		HierarchyComponent* hier = hierarchy(ent);
+		if (!hier->dirty) {
+			hier->dirty = true;
+			dirtyTransforms.push_back(ent);
+		}
+	}
+
+	void ComponentSystem::updateWorldTransform(Entity ent) {
+		HierarchyComponent* hier = hierarchy(ent);
+		touch(entityLocations[entity_index(ent)].chunk, hierarchyType);
+		updateWorldTransform(hier, transform(ent), hier->parent == NULL_ENTITY ? nullptr : &hierarchy(hier->parent)->world_transform);
+	}
+
+	void ComponentSystem::updateWorldTransform(HierarchyComponent* hier, TransformComponent* local, mat4f* parentWorld) {
+		mat4f localMatrix = local->toMatrix();
+		if (parentWorld) {
+			parentWorld->mul(localMatrix, hier->world_transform);
+		} else {
+			hier->world_transform = localMatrix;
+		}
+		hier->dirty = false;
+	}
+
+	void ComponentSystem::updateSubtree(Entity root) {
+		struct PendingNode {
+			Entity ent;
+			mat4f* parentWorld;
+		};
+		job::ScopedScratch scratch{};
+		std::vector<PendingNode, job::ScratchAllocator<PendingNode>> stack{ job::ScratchAllocator<PendingNode>(scratch) };
+		HierarchyComponent* rootHier = hierarchy(root);
+		stack.push_back(PendingNode{ root, rootHier->parent == NULL_ENTITY ? nullptr : &hierarchy(rootHier->parent)->world_transform });
+		while (!stack.empty()) {
+			PendingNode node = stack.back();
+			stack.pop_back();
+			//Children only go on the stack once their parent is done, and carry its world transform so they don't have to look it up again
+			HierarchyComponent* hier = hierarchy(node.ent);
+			//Subtrees in other jobs can share the chunk, which is why the versions are atomic
+			touch(entityLocations[entity_index(node.ent)].chunk, hierarchyType);
+			updateWorldTransform(hier, transform(node.ent), node.parentWorld);
+			for (Entity child = hier->firstChild; child != NULL_ENTITY; child = hierarchy(child)->nextSibling) {
+				stack.push_back(PendingNode{ child, &hier->world_transform });
+			}
+		}
+	}
+
+	void ComponentSystem::propagateTransforms(job::JobSystem& jobSystem) {
+		if (dirtyTransforms.empty()) {
+			return;
+		}
+		job::ScopedScratch scratch{};
+		std::vector<Entity, job::ScratchAllocator<Entity>> roots{ job::ScratchAllocator<Entity>(scratch) };
+		//Only the topmost dirty entity of each branch, everything under it is redone along with it anyway
+		for (Entity ent : dirtyTransforms) {
+			if (!isAlive(ent) || !hierarchy(ent)->dirty) {
+				continue;
+			}
+			bool covered = false;
+			for (Entity ancestor = hierarchy(ent)->parent; ancestor != NULL_ENTITY; ancestor = hierarchy(ancestor)->parent) {
+				if (hierarchy(ancestor)->dirty) {
+					covered = true;
+					break;
+				}
+			}
+			if (!covered) {
+				roots.push_back(ent);
+			}
+		}
+		dirtyTransforms.clear();
+
+		//A few big subtrees would leave most workers idle, so split them up a level at a time until there's enough to go around.
+		//Each node on the way down is done right here, before its children are handed out.
+		std::vector<Entity, job::ScratchAllocator<Entity>> next{ job::ScratchAllocator<Entity>(scratch) };
+		uint32_t target = jobSystem.thread_count() * 4u;
+		while (!roots.empty() && roots.size() < target) {
+			next.clear();
+			for (Entity ent : roots) {
+				updateWorldTransform(ent);
+				for (Entity child = hierarchy(ent)->firstChild; child != NULL_ENTITY; child = hierarchy(child)->nextSibling) {
+					next.push_back(child);
+				}
+			}
+			roots.swap(next);
+		}
+		jobSystem.parallel_for(0, static_cast<uint32_t>(roots.size()), [&](uint32_t i) {
+			updateSubtree(roots[i]);
+		});
+	}
+
+	Entity ComponentSystem::createEntity() {
+		Entity ent = reserveEntity();
+		placeEntity(ent, getArchetype(defaultMask()), nullptr);
+		return ent;
+	}
 
 	void ComponentSystem::removeEntity(Entity ent) {
-		if (componentDeletes.find(ent) == componentDeletes.end()) {
+		EntityLocation* loc = location(ent);
+		if (!loc) {
 			throw std::runtime_error("Entity not found for remove!");
 		}
-		std::vector<IComponentManager*> types = componentDeletes[ent];
-		for (IComponentManager* type : types) {
-			type->deleteEntity(ent);
+		//Children are left as roots
+		unlinkFromParent(ent);
+		for (Entity child = hierarchy(ent)->firstChild; child != NULL_ENTITY;) {
+			Entity next = hierarchy(child)->nextSibling;
+			HierarchyComponent* cHier = hierarchy(child);
+			cHier->parent = NULL_ENTITY;
+			cHier->nextSibling = NULL_ENTITY;
+			cHier->prevSibling = NULL_ENTITY;
+			markTransformDirty(child);
+			child = next;
+		}
+		EntityLocation removed = *loc;
+		Archetype* archetype = removed.chunk->archetype;
+		for (uint32_t type : archetype->types) {
+			ComponentInfo& info = componentTypes[type];
+			if (!info.trivial) {
+				info.destroy(reinterpret_cast<char*>(archetype->column(removed.chunk, type)) + removed.row * info.size);
+			}
+		}
+		releaseEntity(ent);
+		removeRow(removed);
+	}
+
+	//Constructs count components in a row. Trivial ones are only constructed once and then copied in doubling runs.
+	static void fill_column(ComponentInfo& info, char* dst, uint32_t count) {
+		if (!info.trivial) {
+			for (uint32_t i = 0; i < count; i++) {
+				info.construct(dst + i * info.size);
+			}
+			return;
+		}
+		info.construct(dst);
+		for (uint32_t filled = 1; filled < count;) {
+			uint32_t copy = std::min(filled, count - filled);
+			memcpy(dst + filled * info.size, dst, copy * info.size);
+			filled += copy;
 		}
-		componentDeletes.erase(ent);
 	}
 
+	void ComponentSystem::createEntities(uint32_t count, Archetype* archetype, Entity* out) {
+		if (count == 0) {
+			return;
+		}
+		//Reused slots go first, the rest get one run of fresh ids
+		uint32_t reused = std::min(count, static_cast<uint32_t>(removedEntityIds.size()));
+		uint32_t firstFresh = count > reused ? entity_index(reserveFreshEntities(count - reused)) : 0;
+		size_t highest = static_cast<size_t>(currentEntityId.load(std::memory_order_relaxed));
+		if (entityLocations.size() < highest) {
+			entityLocations.resize(highest, EntityLocation{ nullptr, 0, 0 });
+		}
+		archetype->chunks.reserve(archetype->chunks.size() + count / archetype->chunkCapacity + 1);
+		size_t freeEnd = removedEntityIds.size();
+		for (uint32_t done = 0; done < count;) {
+			if (archetype->chunks.empty() || archetype->chunks.back()->count == archetype->chunkCapacity) {
+				addChunk(archetype);
+			}
+			Chunk* chunk = archetype->chunks.back();
+			touchAll(chunk);
+			uint32_t start = chunk->count;
+			uint32_t n = std::min(count - done, archetype->chunkCapacity - start);
+			Entity* entities = chunk->entities() + start;
+			for (uint32_t i = 0; i < n; i++) {
+				uint32_t created = done + i;
+				uint32_t index = created < reused ? removedEntityIds[freeEnd - 1 - created] : firstFresh + created - reused;
+				EntityLocation& slot = entityLocations[index];
+				slot.chunk = chunk;
+				slot.row = start + i;
+				entities[i] = make_entity(index, slot.generation);
+			}
+			if (out) {
+				memcpy(out + done, entities, n * sizeof(Entity));
+			}
+			for (uint32_t type : archetype->types) {
+				ComponentInfo& info = componentTypes[type];
+				fill_column(info, reinterpret_cast<char*>(archetype->column(chunk, type)) + start * info.size, n);
+			}
+			chunk->count += n;
+			archetype->entityCount += n;
+			done += n;
+		}
+		removedEntityIds.resize(freeEnd - reused);
+	}
+
+	void ComponentSystem::destroyEntities(std::span<const Entity> ents) {
+		removedEntityIds.reserve(removedEntityIds.size() + ents.size());
+		//Backwards, so a batch that was created together comes off the end of its chunks without anything having to be moved into the gaps
+		for (size_t i = ents.size(); i > 0; i--) {
+			if (location(ents[i - 1])) {
+				removeEntity(ents[i - 1]);
+			}
+		}
+	}
+
+	bool ComponentSystem::isAlive(Entity ent) {
+		return location(ent) != nullptr;
+	}
+
+	uint32_t ComponentSystem::entityCount() {
+		uint32_t count = 0;
+		for (Archetype* archetype : archetypes) {
+			count += archetype->entityCount;
+		}
+		return count;
+	}
+
+	//Snapshot layout: header, types, their names, archetypes, dirty transforms, entity table, free slots, then the chunks starting on a page boundary.
+	//Everything before the entity table is a multiple of 8 bytes, so the dirty transforms stay aligned.
+	const uint32_t SNAPSHOT_MAGIC = 0x53434553;
+	const uint32_t SNAPSHOT_VERSION = 2;
+	const uint32_t SNAPSHOT_CHUNK_ALIGNMENT = 4096;
+	const uint32_t SNAPSHOT_NO_CHUNK = 0xFFFFFFFF;
+
+	struct SnapshotHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t chunkSize;
+		uint32_t chunkStride;
+		uint32_t maxComponentTypes;
+		uint32_t typeCount;
+		uint32_t archetypeCount;
+		uint32_t chunkCount;
+		uint32_t entitySlots;
+		uint32_t freeCount;
+		uint32_t dirtyCount;
+		uint32_t nextEntity;
+		uint64_t namesSize;
+		uint64_t chunksOffset;
+	};
+
+	struct SnapshotType {
+		uint32_t id;
+		uint32_t size;
+		uint32_t alignment;
+		uint32_t nameOffset;
+	};
+
+	struct SnapshotArchetype {
+		ComponentMask mask;
+		uint32_t chunkCapacity;
+		uint32_t entityCount;
+		uint32_t firstChunk;
+		uint32_t chunkCount;
+		uint32_t columnOffsets[MAX_COMPONENT_TYPES];
+	};
+
+	//Same as EntityLocation with the chunk as an index into the snapshot's chunks
+	struct SnapshotEntity {
+		uint32_t chunk;
+		uint32_t row;
+		uint32_t generation;
+	};
+
+	void ComponentSystem::saveSnapshot(const std::wstring& path) {
+		std::vector<Archetype*> saved;
+		ComponentMask usedTypes = 0;
+		std::unordered_map<Chunk*, uint32_t> chunkIndices;
+		for (Archetype* archetype : archetypes) {
+			if (archetype->chunks.empty()) {
+				continue;
+			}
+			saved.push_back(archetype);
+			usedTypes |= archetype->mask;
+			for (Chunk* chunk : archetype->chunks) {
+				uint32_t index = static_cast<uint32_t>(chunkIndices.size());
+				chunkIndices[chunk] = index;
+			}
+		}
+
+		std::vector<SnapshotType> types;
+		std::string names;
+		for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+			if (!((usedTypes >> type) & 1)) {
+				continue;
+			}
+			ComponentInfo& info = componentTypes[type];
+			if (!info.trivial) {
+				throw std::runtime_error(std::string("Component can't be saved in a snapshot, it isn't trivially copyable: ") + info.name);
+			}
+			types.push_back(SnapshotType{ type, info.size, info.alignment, static_cast<uint32_t>(names.size()) });
+			names += info.name;
+			names += '\0';
+		}
+		//Keeps the archetype records after the names aligned
+		names.resize((names.size() + 7) / 8 * 8, '\0');
+
+		std::vector<SnapshotArchetype> archetypeRecords;
+		uint32_t firstChunk = 0;
+		for (Archetype* archetype : saved) {
+			SnapshotArchetype record{};
+			record.mask = archetype->mask;
+			record.chunkCapacity = archetype->chunkCapacity;
+			record.entityCount = archetype->entityCount;
+			record.firstChunk = firstChunk;
+			record.chunkCount = static_cast<uint32_t>(archetype->chunks.size());
+			memcpy(record.columnOffsets, archetype->columnOffsets, sizeof(record.columnOffsets));
+			archetypeRecords.push_back(record);
+			firstChunk += record.chunkCount;
+		}
+
+		std::vector<SnapshotEntity> entities(entityLocations.size());
+		for (uint32_t i = 0; i < entityLocations.size(); i++) {
+			EntityLocation& loc = entityLocations[i];
+			entities[i] = SnapshotEntity{ loc.chunk ? chunkIndices[loc.chunk] : SNAPSHOT_NO_CHUNK, loc.row, loc.generation };
+		}
+
+		SnapshotHeader header{ SNAPSHOT_MAGIC, SNAPSHOT_VERSION, CHUNK_SIZE, sizeof(Chunk), MAX_COMPONENT_TYPES,
+			static_cast<uint32_t>(types.size()), static_cast<uint32_t>(archetypeRecords.size()), firstChunk, static_cast<uint32_t>(entities.size()),
+			static_cast<uint32_t>(removedEntityIds.size()), static_cast<uint32_t>(dirtyTransforms.size()), static_cast<uint32_t>(currentEntityId.load(std::memory_order_relaxed)), names.size(), 0 };
+		uint64_t tableSize = sizeof(SnapshotHeader) + types.size() * sizeof(SnapshotType) + names.size() + archetypeRecords.size() * sizeof(SnapshotArchetype) +
+			dirtyTransforms.size() * sizeof(Entity) + entities.size() * sizeof(SnapshotEntity) + removedEntityIds.size() * sizeof(uint32_t);
+		header.chunksOffset = (tableSize + SNAPSHOT_CHUNK_ALIGNMENT - 1) / SNAPSHOT_CHUNK_ALIGNMENT * SNAPSHOT_CHUNK_ALIGNMENT;
+
+		std::ofstream file(std::filesystem::path(path), std::ios::binary | std::ios::trunc);
+		if (!file) {
+			throw std::runtime_error("Couldn't open snapshot for writing!");
+		}
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(types.data()), types.size() * sizeof(SnapshotType));
+		file.write(names.data(), names.size());
+		file.write(reinterpret_cast<const char*>(archetypeRecords.data()), archetypeRecords.size() * sizeof(SnapshotArchetype));
+		file.write(reinterpret_cast<const char*>(dirtyTransforms.data()), dirtyTransforms.size() * sizeof(Entity));
+		file.write(reinterpret_cast<const char*>(entities.data()), entities.size() * sizeof(SnapshotEntity));
+		file.write(reinterpret_cast<const char*>(removedEntityIds.data()), removedEntityIds.size() * sizeof(uint32_t));
+		std::vector<char> padding(header.chunksOffset - tableSize);
+		file.write(padding.data(), padding.size());
+		for (Archetype* archetype : saved) {
+			for (Chunk* chunk : archetype->chunks) {
+				file.write(reinterpret_cast<const char*>(chunk), sizeof(Chunk));
+			}
+		}
+		if (!file) {
+			throw std::runtime_error("Failed to write snapshot!");
+		}
+	}
+
+	void ComponentSystem::loadSnapshot(const std::wstring& path) {
+		//A system that ever handed out an id has stale slots and generations the snapshot's table can't account for
+		if (entityCount() != 0 || !entityLocations.empty() || currentEntityId.load(std::memory_order_relaxed) != 1) {
+			throw std::runtime_error("Snapshots can only be loaded into a component system that has never had entities!");
+		}
+		util::FileMapping mapping = util::map_file(path, true);
+		if (!mapping.mapping) {
+			throw std::runtime_error("Couldn't map snapshot!");
+		}
+		auto reject = [&mapping](const std::string& message) {
+			util::unmap_file(mapping);
+			throw std::runtime_error(message);
+		};
+		char* base = reinterpret_cast<char*>(mapping.mapping);
+		SnapshotHeader* header = reinterpret_cast<SnapshotHeader*>(base);
+		if (mapping.size < sizeof(SnapshotHeader) || header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || header->chunkSize != CHUNK_SIZE ||
+			header->chunkStride != sizeof(Chunk) || header->maxComponentTypes != MAX_COMPONENT_TYPES ||
+			mapping.size < header->chunksOffset + static_cast<uint64_t>(header->chunkCount) * sizeof(Chunk)) {
+			reject("Not a snapshot this build can load!");
+		}
+		//The tables have to end before the chunks start, otherwise the counts are garbage
+		uint64_t tableSize = sizeof(SnapshotHeader) + static_cast<uint64_t>(header->typeCount) * sizeof(SnapshotType) + header->namesSize +
+			static_cast<uint64_t>(header->archetypeCount) * sizeof(SnapshotArchetype) + static_cast<uint64_t>(header->dirtyCount) * sizeof(Entity) +
+			static_cast<uint64_t>(header->entitySlots) * sizeof(SnapshotEntity) + static_cast<uint64_t>(header->freeCount) * sizeof(uint32_t);
+		if (tableSize > header->chunksOffset || header->namesSize % 8 != 0 || header->entitySlots > header->nextEntity || header->nextEntity == 0 ||
+			static_cast<uint64_t>(header->nextEntity) - 1 > ENTITY_MAX_INDEX) {
+			reject("Snapshot is corrupt!");
+		}
+		SnapshotType* types = reinterpret_cast<SnapshotType*>(header + 1);
+		const char* names = reinterpret_cast<const char*>(types + header->typeCount);
+		SnapshotArchetype* archetypeRecords = reinterpret_cast<SnapshotArchetype*>(const_cast<char*>(names) + header->namesSize);
+		Entity* dirty = reinterpret_cast<Entity*>(archetypeRecords + header->archetypeCount);
+		SnapshotEntity* entities = reinterpret_cast<SnapshotEntity*>(dirty + header->dirtyCount);
+		uint32_t* freeSlots = reinterpret_cast<uint32_t*>(entities + header->entitySlots);
+		Chunk* chunks = reinterpret_cast<Chunk*>(base + header->chunksOffset);
+
+		//Everything is checked before anything is touched, so a bad file leaves the system as it was.
+		//Saved type ids are only good for the run that saved them, match them up with this run's by name
+		uint32_t remap[MAX_COMPONENT_TYPES];
+		ComponentMask savedTypes = 0;
+		ComponentMask foundTypes = 0;
+		for (uint32_t i = 0; i < header->typeCount; i++) {
+			SnapshotType& saved = types[i];
+			if (saved.nameOffset >= header->namesSize || !memchr(names + saved.nameOffset, '\0', header->namesSize - saved.nameOffset)) {
+				reject("Snapshot is corrupt!");
+			}
+			uint32_t found = MAX_COMPONENT_TYPES;
+			for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+				if (((registeredTypes >> type) & 1) && componentTypes[type].size == saved.size && componentTypes[type].alignment == saved.alignment &&
+					strcmp(componentTypes[type].name, names + saved.nameOffset) == 0) {
+					found = type;
+					break;
+				}
+			}
+			if (found == MAX_COMPONENT_TYPES || saved.id >= MAX_COMPONENT_TYPES) {
+				reject(std::string("Snapshot has a component type that isn't registered: ") + (names + saved.nameOffset));
+			}
+			if (((savedTypes >> saved.id) & 1) || ((foundTypes >> found) & 1)) {
+				reject("Snapshot is corrupt!");
+			}
+			savedTypes |= ComponentMask(1) << saved.id;
+			foundTypes |= ComponentMask(1) << found;
+			remap[saved.id] = found;
+		}
+
+		//Archetypes own consecutive runs of chunks in the order they were saved, every chunk is full except the last,
+		//and every column has to fit in a chunk the way this build lays it out
+		std::vector<ComponentMask> masks(header->archetypeCount);
+		uint64_t nextChunk = 0;
+		uint64_t totalEntities = 0;
+		for (uint32_t i = 0; i < header->archetypeCount; i++) {
+			SnapshotArchetype& record = archetypeRecords[i];
+			if ((record.mask & ~savedTypes) != 0 || record.firstChunk != nextChunk || record.chunkCount == 0 ||
+				record.firstChunk + static_cast<uint64_t>(record.chunkCount) > header->chunkCount ||
+				record.chunkCapacity == 0 || static_cast<uint64_t>(record.chunkCapacity) * sizeof(Entity) > CHUNK_SIZE) {
+				reject("Snapshot is corrupt!");
+			}
+			ComponentMask mask = 0;
+			for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+				if (!((record.mask >> type) & 1)) {
+					continue;
+				}
+				ComponentInfo& info = componentTypes[remap[type]];
+				uint64_t offset = record.columnOffsets[type];
+				if (offset % info.alignment != 0 || offset < static_cast<uint64_t>(record.chunkCapacity) * sizeof(Entity) ||
+					offset + static_cast<uint64_t>(info.size) * record.chunkCapacity > CHUNK_SIZE) {
+					reject("Snapshot is corrupt!");
+				}
+				mask |= ComponentMask(1) << remap[type];
+			}
+			if ((mask & defaultMask()) != defaultMask()) {
+				reject("Snapshot is corrupt!");
+			}
+			uint64_t entityTotal = 0;
+			for (uint32_t c = record.firstChunk; c < record.firstChunk + record.chunkCount; c++) {
+				uint32_t count = chunks[c].count;
+				if (count > record.chunkCapacity || (count != record.chunkCapacity && c != record.firstChunk + record.chunkCount - 1)) {
+					reject("Snapshot is corrupt!");
+				}
+				entityTotal += count;
+			}
+			if (entityTotal != record.entityCount) {
+				reject("Snapshot is corrupt!");
+			}
+			masks[i] = mask;
+			nextChunk += record.chunkCount;
+			totalEntities += entityTotal;
+		}
+		std::vector<ComponentMask> sortedMasks = masks;
+		std::sort(sortedMasks.begin(), sortedMasks.end());
+		if (nextChunk != header->chunkCount || std::adjacent_find(sortedMasks.begin(), sortedMasks.end()) != sortedMasks.end()) {
+			reject("Snapshot is corrupt!");
+		}
+
+		//Every live slot has to point at a row holding that same entity, and with the totals matching that means every row is owned by exactly one slot
+		uint64_t liveEntities = 0;
+		for (uint32_t i = 0; i < header->entitySlots; i++) {
+			SnapshotEntity& saved = entities[i];
+			if (saved.chunk == SNAPSHOT_NO_CHUNK) {
+				continue;
+			}
+			if (saved.chunk >= header->chunkCount || saved.row >= chunks[saved.chunk].count ||
+				chunks[saved.chunk].entities()[saved.row] != make_entity(i, saved.generation)) {
+				reject("Snapshot is corrupt!");
+			}
+			liveEntities++;
+		}
+		if (liveEntities != totalEntities) {
+			reject("Snapshot is corrupt!");
+		}
+		for (uint32_t i = 0; i < header->freeCount; i++) {
+			if (freeSlots[i] >= header->entitySlots || entities[freeSlots[i]].chunk != SNAPSHOT_NO_CHUNK ||
+				entities[freeSlots[i]].generation == ENTITY_MAX_GENERATION) {
+				reject("Snapshot is corrupt!");
+			}
+		}
+		for (uint32_t i = 0; i < header->dirtyCount; i++) {
+			if (entity_index(dirty[i]) >= header->entitySlots) {
+				reject("Snapshot is corrupt!");
+			}
+		}
+
+		for (uint32_t i = 0; i < header->archetypeCount; i++) {
+			SnapshotArchetype& record = archetypeRecords[i];
+			//The chunks are used as is, so the archetype has to lay them out the way the saving system did
+			Archetype* archetype = getArchetype(masks[i]);
+			archetype->chunkCapacity = record.chunkCapacity;
+			for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+				if ((record.mask >> type) & 1) {
+					archetype->columnOffsets[remap[type]] = record.columnOffsets[type];
+				}
+			}
+			archetype->chunks.reserve(record.chunkCount);
+			for (uint32_t c = record.firstChunk; c < record.firstChunk + record.chunkCount; c++) {
+				Chunk* chunk = &chunks[c];
+				chunk->archetype = archetype;
+				chunk->mapped = true;
+				for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++) {
+					chunk->versions[type].store(changeVersion, std::memory_order_relaxed);
+				}
+				archetype->chunks.push_back(chunk);
+			}
+			archetype->entityCount = record.entityCount;
+		}
+
+		entityLocations.resize(header->entitySlots);
+		for (uint32_t i = 0; i < header->entitySlots; i++) {
+			SnapshotEntity& saved = entities[i];
+			entityLocations[i] = EntityLocation{ saved.chunk == SNAPSHOT_NO_CHUNK ? nullptr : &chunks[saved.chunk], saved.row, saved.generation };
+		}
+		removedEntityIds.assign(freeSlots, freeSlots + header->freeCount);
+		dirtyTransforms.assign(dirty, dirty + header->dirtyCount);
+		currentEntityId.store(header->nextEntity, std::memory_order_relaxed);
+		snapshotMappings.push_back(mapping);
+	}
 }
\ No newline at end of file
@@ -2,17 +2,60 @@
 
 #include <unordered_map>
 #include <vector>
+#include <new>
+#include <typeinfo>
+#include <utility>
+#include <tuple>
+#include <span>
+#include <type_traits>
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
 #include "util/DrillMath.h"
+#include "util/Util.h"
 #include "JobSystem.h"
 
 namespace ecs {
-	using Entity = uint32_t;
+	//The low 32 bits are a slot in the entity table, the high 32 bits are how many times that slot has been reused.
+	//A handle kept around after its entity is removed won't match whatever gets the slot next.
+	using Entity = uint64_t;
 
 	const Entity NULL_ENTITY = 0;
-
+	const uint32_t ENTITY_INDEX_BITS = 32;
+	//Highest slot index that can be handed out
+	const uint32_t ENTITY_MAX_INDEX = 0xFFFFFFFE;
+	//A slot whose generation gets this high is retired instead of reused, so its handles can never wrap around and match again
+	const uint32_t ENTITY_MAX_GENERATION = 0xFFFFFFFF;
+
+	inline uint32_t entity_index(Entity e) {
+		return static_cast<uint32_t>(e);
+	}
+
+	inline uint32_t entity_generation(Entity e) {
+		return static_cast<uint32_t>(e >> ENTITY_INDEX_BITS);
+	}
+
+	inline Entity make_entity(uint32_t index, uint32_t generation) {
+		return Entity(index) | (Entity(generation) << ENTITY_INDEX_BITS);
+	}
+
+	//Entities with exactly the same set of components share an archetype. An archetype packs its entities into fixed size chunks,
+	//and each chunk is laid out as one array per component, so iterating a component is a straight walk through memory.
+	const uint32_t CHUNK_SIZE = 16 * 1024;
+	const uint32_t MAX_COMPONENT_TYPES = 64;
+	//Bit n set means the component type with id n is present
+	using ComponentMask = uint64_t;
+
+	//world_transform is only brought up to date by ComponentSystem::propagateTransforms
 	struct HierarchyComponent {
 		mat4f world_transform;
 		Entity parent = NULL_ENTITY;
+		//Children are linked through their siblings so a subtree can be walked without any lookups besides the entities themselves
+		Entity firstChild = NULL_ENTITY;
+		Entity nextSibling = NULL_ENTITY;
+		Entity prevSibling = NULL_ENTITY;
+		//Queued for the next propagateTransforms
+		bool dirty = false;
 	};
 
 	struct TransformComponent {
@@ -30,287 +73,426 @@ namespace ecs {
 		}
 	};
 
-	class ComponentSystem;
-
-	class IComponentManager {
-	public:
-		virtual void deleteEntity(Entity ent) = 0;
-		virtual void makeParent(Entity parent, Entity child) = 0;
-		//Need a method to delete from inside the class itself, since the type is unknown when called. May or may not be a hack, I don't know that much C++ yet.
-		virtual void delete_manager() = 0;
+	//What the storage needs to know to handle a component without knowing its type
+	struct ComponentInfo {
+		const char* name;
+		uint32_t size;
+		uint32_t alignment;
+		//Can be copied around with memcpy
+		bool trivial;
+		void (*construct)(void* dst);
+		//Move constructs into dst and destroys src
+		void (*relocate)(void* dst, void* src);
+		void (*destroy)(void* ptr);
 	};
 
 	template<typename T>
-	class ComponentManager : public IComponentManager {
-	private:
-		friend class ComponentSystem;
+	ComponentInfo make_component_info() {
+		return ComponentInfo{ typeid(T).name(), sizeof(T), alignof(T), std::is_trivially_copyable_v<T>,
+			[](void* dst) {
+				new (dst) T{};
+			},
+			[](void* dst, void* src) {
+				new (dst) T(std::move(*reinterpret_cast<T*>(src)));
+				reinterpret_cast<T*>(src)->~T();
+			},
+			[](void* ptr) {
+				reinterpret_cast<T*>(ptr)->~T();
+			}
+		};
+	}
 
-		ComponentSystem* sys;
-		std::unordered_map<Entity, uint16_t> componentsByEntity{};
-		std::unordered_map<uint16_t, Entity> entitiesByComponent{};
-		std::vector<T> components{};
-		bool ordered;
-	public:
+	uint32_t next_component_type_id();
 
-		ComponentManager(ComponentSystem* system, bool keepOrder) {
-			sys = system;
-			ordered = keepOrder;
+	//Dense id for a component type, handed out the first time the type is used anywhere. Every ComponentSystem shares the same ids.
+	template<typename T>
+	uint32_t component_type_id() {
+		static const uint32_t id = next_component_type_id();
+		return id;
+	}
+
+	struct Archetype;
+
+	struct alignas(64) Chunk {
+		//Entity ids first, then one array per component type at the offsets the archetype gives
+		char data[CHUNK_SIZE];
+		Archetype* archetype;
+		uint32_t count;
+		//Lives in a loaded snapshot's mapping rather than being allocated on its own
+		bool mapped;
+		//ComponentSystem::version() when each column was last written to, indexed by type id.
+		//Anything that hands out a mutable component bumps its column, so a chunk with an old version can be skipped wholesale.
+		std::atomic<uint32_t> versions[MAX_COMPONENT_TYPES];
+
+		Entity* entities() {
+			return reinterpret_cast<Entity*>(data);
 		}
+	};
 
-		void createEntity(Entity ent) {
-			T component{};
-			componentsByEntity[ent] = static_cast<uint16_t>(components.size());
-			entitiesByComponent[static_cast<uint16_t>(components.size())] = ent;
-			components.emplace_back(component);
+	struct Archetype {
+		ComponentMask mask;
+		//Component type ids in ascending order
+		std::vector<uint32_t> types;
+		//Where each type's array starts in a chunk, indexed by type id. Only meaningful for types in the mask.
+		uint32_t columnOffsets[MAX_COMPONENT_TYPES];
+		uint32_t chunkCapacity;
+		//Every chunk is full except the last one
+		std::vector<Chunk*> chunks;
+		uint32_t entityCount;
+		//Archetypes with one component added or removed, filled in the first time that move happens
+		Archetype* addEdges[MAX_COMPONENT_TYPES];
+		Archetype* removeEdges[MAX_COMPONENT_TYPES];
+
+		bool has(uint32_t type) {
+			return type < MAX_COMPONENT_TYPES && ((mask >> type) & 1);
 		}
-
-		void setComponent(Entity ent, T& component) {
-			if (componentsByEntity.find(ent) != componentsByEntity.end()) {
-				throw std::runtime_error("Component for provided entity already exists!");
-			}
-			componentsByEntity[ent] = static_cast<uint16_t>(components.size());
-			entitiesByComponent[static_cast<uint16_t>(components.size())] = ent;
-			components.emplace_back(component);
+		void* column(Chunk* chunk, uint32_t type) {
+			return chunk->data + columnOffsets[type];
 		}
+		template<typename T>
+		T* column(Chunk* chunk, uint32_t type) {
+			return reinterpret_cast<T*>(chunk->data + columnOffsets[type]);
+		}
+	};
 
-		void deleteEntity(Entity ent) override {
-			if (componentsByEntity.find(ent) != componentsByEntity.end()) {
-				uint16_t idx = componentsByEntity[ent];
-				uint16_t end = static_cast<uint16_t>(components.size()) - 1;
-				if (end == idx) {
-					components.pop_back();
-					componentsByEntity.erase(ent);
-					entitiesByComponent.erase(end);
-				} else {
-					componentsByEntity[entitiesByComponent[end]] = idx;
-					componentsByEntity.erase(ent);
-					entitiesByComponent[idx] = entitiesByComponent[end];
-					entitiesByComponent.erase(end);
-					components[idx] = components[end];
-					components.pop_back();
-				}
+	struct EntityLocation {
+		//Null if the entity doesn't exist
+		Chunk* chunk;
+		uint32_t row;
+		//Generation of the handle that owns this slot right now
+		uint32_t generation;
+	};
+
+	template<typename... Components>
+	class Query;
+
+	class ComponentSystem {
+	private:
+		template<typename... Components>
+		friend class Query;
+		friend class EntityCommandBuffer;
+
+		//Indexed by component type id, only filled in for types this system has seen
+		std::vector<ComponentInfo> componentTypes{};
+		ComponentMask registeredTypes = 0;
+		std::unordered_map<ComponentMask, Archetype*> archetypesByMask{};
+		std::vector<Archetype*> archetypes{};
+		//Emptied chunks are kept for the next archetype that needs one, so spawning after a despawn doesn't go back to the allocator
+		std::vector<Chunk*> freeChunks{};
+		//Snapshots whose chunks are in use, unmapped once nothing can point into them anymore
+		std::vector<util::FileMapping> snapshotMappings{};
+		//Indexed by entity_index
+		std::vector<EntityLocation> entityLocations{};
+		//Slots free to be reused
+		std::vector<uint32_t> removedEntityIds{};
+		//Only taken by reserveEntity, since command buffers pop free slots from jobs. Everything else that touches the free list is a structural change and runs alone.
+		job::SpinLock removedEntityIdsLock{};
+		//Next slot that's never been used. Atomic so command buffers can hand out ids from any job.
+		//64 bits so failed reservations past the last index can't wrap it back around to slots in use.
+		std::atomic<uint64_t> currentEntityId{ 1 };
+		//Default components present in every entity
+		uint32_t hierarchyType;
+		uint32_t transformType;
+		//Entities whose transform changed since the last propagateTransforms
+		std::vector<Entity> dirtyTransforms{};
+		//Stamped on every column that gets written to
+		uint32_t changeVersion = 1;
+
+		Archetype* getArchetype(ComponentMask mask);
+		Archetype* archetypeWith(Archetype* archetype, uint32_t type);
+		Archetype* archetypeWithout(Archetype* archetype, uint32_t type);
+		Chunk* addChunk(Archetype* archetype);
+		void touch(Chunk* chunk, uint32_t type) {
+			chunk->versions[type].store(changeVersion, std::memory_order_relaxed);
+		}
+		//Every column in the chunk, for when rows are added or moved around
+		void touchAll(Chunk* chunk);
+		//Claims a row at the end of the archetype. The components in it are left unconstructed.
+		EntityLocation pushRow(Archetype* archetype, Entity ent);
+		//Fills the row with the archetype's last entity. Whatever was in the row has to be destroyed or moved out already.
+		void removeRow(EntityLocation location);
+		//Default constructs components the entity didn't have and destroys the ones the new archetype doesn't have.
+		//Types with a payload (indexed by type id) get it relocated in instead, replacing any old value.
+		void moveEntity(Entity ent, Archetype* to, void** payloads = nullptr);
+		//Puts an entity that isn't anywhere yet into the archetype, same payload rules as moveEntity
+		void placeEntity(Entity ent, Archetype* archetype, void** payloads);
+		//A free slot if there is one, otherwise a fresh id. Safe from any thread while nothing structural is going on.
+		Entity reserveEntity();
+		//Fresh ids that have never been used, safe from any thread. Returns the first of count consecutive ones.
+		Entity reserveFreshEntities(uint32_t count);
+		//Bumps the slot's generation so every handle to it goes stale, then frees it up for reuse unless the generation has run out
+		void releaseEntity(Entity ent);
+		ComponentMask defaultMask();
+		void registerComponentType(uint32_t type, const ComponentInfo& info);
+
+		//Every entity has these, so they skip the type lookup
+		HierarchyComponent* hierarchy(Entity e) {
+			EntityLocation& loc = entityLocations[entity_index(e)];
+			return loc.chunk->archetype->column<HierarchyComponent>(loc.chunk, hierarchyType) + loc.row;
+		}
+		TransformComponent* transform(Entity e) {
+			EntityLocation& loc = entityLocations[entity_index(e)];
+			return loc.chunk->archetype->column<TransformComponent>(loc.chunk, transformType) + loc.row;
+		}
+		void unlinkFromParent(Entity child);
+		void updateWorldTransform(Entity ent);
+		void updateWorldTransform(HierarchyComponent* hier, TransformComponent* local, mat4f* parentWorld);
+		void updateSubtree(Entity root);
+
+		EntityLocation* location(Entity e) {
+			uint32_t index = entity_index(e);
+			if (index >= entityLocations.size()) {
+				return nullptr;
 			}
+			EntityLocation& loc = entityLocations[index];
+			if (!loc.chunk || loc.generation != entity_generation(e)) {
+				return nullptr;
+			}
+			return &loc;
 		}
+	public:
+		job::DistributedRWLock lock;
 
-		T* getComponent(Entity e) {
-			std::unordered_map<Entity, uint16_t>::iterator idx = componentsByEntity.find(e);
-			if (idx != componentsByEntity.end()) {
-				return &components[idx->second];
+		//Only used to size the lock, so jobSystem has to be initialized already
+		ComponentSystem(job::JobSystem& jobSystem);
+		~ComponentSystem();
+		ComponentSystem(const ComponentSystem&) = delete;
+		ComponentSystem& operator=(const ComponentSystem&) = delete;
+
+		//Registers T the first time it's seen
+		template<typename T>
+		uint32_t componentType() {
+			uint32_t type = component_type_id<T>();
+			if (type >= MAX_COMPONENT_TYPES || !((registeredTypes >> type) & 1)) {
+				registerComponentType(type, make_component_info<T>());
 			}
-			return nullptr;
+			return type;
 		}
 
-		bool hasComponent(Entity e) {
-			return getComponent(e) != nullptr;
+		template<typename T>
+		void addComponent(Entity e, T& component) {
+			EntityLocation* loc = location(e);
+			assert(loc);
+			uint32_t type = componentType<T>();
+			Archetype* archetype = loc->chunk->archetype;
+			if (archetype->has(type)) {
+				throw std::runtime_error("Component for provided entity already exists!");
+			}
+			moveEntity(e, archetypeWith(archetype, type));
+			*getComponent<T>(e) = component;
 		}
 
-		void makeParent(Entity parent, Entity child) override {
-			if (ordered) {
-
+		template<typename T>
+		void removeComponent(Entity e) {
+			EntityLocation* loc = location(e);
+			uint32_t type = component_type_id<T>();
+			if (loc && loc->chunk->archetype->has(type)) {
+				moveEntity(e, archetypeWithout(loc->chunk->archetype, type));
 			}
 		}
 
-		void moveItem(uint16_t from, uint16_t to) {
-			assert(from < components.size());
-			assert(to < components.size());
-			if (from == to){
-				return;
+		//Counts as a write unless T is const, same as in a Query
+		template<typename T>
+		T* getComponent(Entity e) {
+			using Component = std::remove_const_t<T>;
+			//A type this system has never seen can't be in any archetype's mask, so there's nothing to look up
+			EntityLocation* loc = location(e);
+			uint32_t type = component_type_id<Component>();
+			if (!loc || !loc->chunk->archetype->has(type)) {
+				return nullptr;
 			}
-			if (ordered) {
-				Entity tEnt = entitiesByComponent[to];
-				T tTo = std::move(components[to]);
-
-				uint8_t direction = from > to ? -1 : 1;
-				for (uint16_t i = from; i != to; i += direction) {
-					uint16_t next = i + direction;
-					components[i] = std::move(components[next]);
-					entitiesByComponent[i] = entitiesByComponent[next];
-					componentsByEntity[entitiesByComponent[i]] = i;
-				}
-
-				componentsByEntity[tEnt] = from;
-				entitiesByComponent[from] = tEnt;
-				components[from] = std::move(tTo);
-			} else {
-				Entity tEnt = entitiesByComponent[to];
-				T tTo = std::move(components[to]);
-
-				componentsByEntity[to] = componentsByEntity[from];
-				entitiesByComponent[to] = entitiesByComponent[from];
-				components[to] = std::move(components[from]);
-
-				componentsByEntity[tEnt] = from;
-				entitiesByComponent[from] = tEnt;
-				components[from] = std::move(tTo);
+			if constexpr (!std::is_const_v<T>) {
+				touch(loc->chunk, type);
 			}
+			return loc->chunk->archetype->column<Component>(loc->chunk, type) + loc->row;
 		}
 
-		uint32_t size() {
-			return components.size();
+		template<typename T>
+		bool hasComponent(Entity e) {
+			return getComponent<const T>(e) != nullptr;
 		}
 
-		void delete_manager() override {
-			delete this;
+		//What writes are being stamped with right now
+		uint32_t version() {
+			return changeVersion;
+		}
+		//Starts a new version and returns the old one. Grab it before going through the changes and pass it as since next time,
+		//then anything written while handling them (or any time after) shows up next time around.
+		uint32_t advanceVersion() {
+			return changeVersion++;
 		}
-	};
-
-	class ComponentSystem {
-	private:
-		//Default components present in every entity
-		ComponentManager<HierarchyComponent>* hierarchyManager = nullptr;
-		ComponentManager<TransformComponent>* transformManager = nullptr;
-
-		std::unordered_map<Entity, std::vector<IComponentManager*>> componentDeletes{};
-		std::unordered_map<uintptr_t, uintptr_t> componentMap{};
-		std::vector<IComponentManager*> allComponentManagers{};
-		std::vector<Entity> removedEntityIds{};
-		uint32_t currentEntityId = 1;
 
-	public:
-		job::RWSpinLock lock{};
+		//Pass NULL_ENTITY as the parent to make child a root. The world transform catches up on the next propagateTransforms.
+		void makeParent(Entity parent, Entity child);
+		//Call after changing an entity's TransformComponent so it and everything under it get recomputed
+		void markTransformDirty(Entity ent);
+		//Recomputes world transforms for every dirty entity and its descendants, parents always before their children.
+		//Separate subtrees are spread across jobs when called from a job, otherwise it all runs on the calling thread.
+		void propagateTransforms(job::JobSystem& jobSystem);
 
-		ComponentSystem() {
-			hierarchyManager = newComponentManager<HierarchyComponent>(true);
-			transformManager = newComponentManager<TransformComponent>(true);
+		//Every new entity starts with a hierarchy and a transform
+		Entity createEntity();
+		void removeEntity(Entity ent);
+		//False for handles to removed entities, even if their slot has been reused
+		bool isAlive(Entity ent);
+
+		//The archetype for entities with the default components plus these
+		template<typename... Components>
+		Archetype* archetypeOf() {
+			ComponentMask mask = defaultMask();
+			uint32_t types[] = { 0u, componentType<Components>()... };
+			for (uint32_t i = 1; i < sizeof...(Components) + 1; i++) {
+				mask |= ComponentMask(1) << types[i];
+			}
+			return getArchetype(mask);
 		}
-		~ComponentSystem() {
-			for (IComponentManager* man : allComponentManagers) {
-				man->delete_manager();
+		//Makes count entities in the archetype with every component default constructed, writing their handles to out if it's given.
+		//Rows are filled a chunk at a time, and components that can be are constructed once and copied down the column with memcpy.
+		void createEntities(uint32_t count, Archetype* archetype, Entity* out = nullptr);
+		//Handles that are already stale are skipped
+		void destroyEntities(std::span<const Entity> ents);
+
+		//Writes the whole world to a file: the entity table, then every chunk exactly as it is in memory, each one aligned so it can be used in place.
+		//Every component in use has to be trivially copyable. Entity handles stay valid across a save and load.
+		void saveSnapshot(const std::wstring& path);
+		//Maps a snapshot copy on write and uses its chunks right where they are, so the only work is fixing up pointers per chunk and filling in the entity table.
+		//Only works on a system that has never had any entities, and every component type in the snapshot has to have been registered with componentType already.
+		//Types are matched by name, so the snapshot has to come from the same build.
+		void loadSnapshot(const std::wstring& path);
+		uint32_t entityCount();
+
+		//Calls func(chunk, archetype) for every non empty chunk whose archetype has all the components in the mask
+		template<typename Func>
+		void forEachChunk(ComponentMask mask, Func&& func) {
+			for (Archetype* archetype : archetypes) {
+				if ((archetype->mask & mask) != mask) {
+					continue;
+				}
+				for (Chunk* chunk : archetype->chunks) {
+					func(chunk, archetype);
+				}
 			}
 		}
 
 		template<typename T>
-		ComponentManager<T>* newComponentManager(bool keepOrder) {
-			uintptr_t typeId = reinterpret_cast<uintptr_t>(&typeid(T));
-			assert(componentMap.find(typeId) == componentMap.end());
-			ComponentManager<T>* man = new ComponentManager<T>(this, keepOrder);
-			allComponentManagers.push_back(man);
-			componentMap[typeId] = reinterpret_cast<uintptr_t>(man);
-			return man;
+		void runSystem(void (*func)(T&)) {
+			Query<T>(*this).each(func);
 		}
 
+		//Each job gets whole chunks, minPerJob is rounded up to a number of chunks
 		template<typename T>
-		ComponentManager<T>* getComponentManager() {
-			uintptr_t typeId = reinterpret_cast<uintptr_t>(&typeid(T));
-			std::unordered_map<uintptr_t, uintptr_t>::iterator itr = componentMap.find(typeId);
-			if (itr == componentMap.end())
-				return nullptr;
-			return reinterpret_cast<ComponentManager<T>*>(itr->second);
+		void runSystemParallel(void (*func)(T&), job::JobSystem& jobSystem, uint32_t minPerJob = 16) {
+			Query<T>(*this).eachParallel(jobSystem, func, minPerJob);
 		}
+	};
 
-		//TODO keep order
-		template<typename T>
-		void addComponent(Entity e, T& component, bool keepOrdered) {
-			uintptr_t typeId = reinterpret_cast<uintptr_t>(&typeid(T));
-			uintptr_t manager = componentMap[typeId];
-			ComponentManager<T>* man = nullptr;
-			if (manager == 0) {
-				man = newComponentManager<T>(keepOrdered);
-				man->setComponent(e, component);
-			} else {
-				man = reinterpret_cast<ComponentManager<T>*>(manager);
-				man->setComponent(e, component);
-			}
-
-			if (componentDeletes.find(e) == componentDeletes.end()) {
-				componentDeletes[e] = std::vector<IComponentManager*>();
+	//Every entity that has all of the listed components. Mark a component const if the query only reads it, like Query<TransformComponent, const HierarchyComponent>.
+	//The matching archetypes are cached, and since archetypes are never removed the query only has to look at the ones created since it last ran.
+	template<typename... Components>
+	class Query {
+	private:
+		ComponentSystem* system;
+		uint32_t types[sizeof...(Components)];
+		ComponentMask mask = 0;
+		std::vector<Archetype*> matched{};
+		uint32_t archetypesChecked = 0;
+
+		void update() {
+			for (; archetypesChecked < system->archetypes.size(); archetypesChecked++) {
+				Archetype* archetype = system->archetypes[archetypesChecked];
+				if ((archetype->mask & mask) == mask) {
+					matched.push_back(archetype);
+				}
 			}
-			componentDeletes[e].push_back(man);
 		}
 
-		template<typename T>
-		T* getComponent(Entity e) {
-			uintptr_t typeId = reinterpret_cast<uintptr_t>(&typeid(T));
-			uintptr_t manager = componentMap[typeId];
-			if (manager != 0) {
-				ComponentManager<T>* man = reinterpret_cast<ComponentManager<T>*>(manager);
-				return man->getComponent(e);
-			} else {
-				return nullptr;
+		template<typename Func, size_t... I>
+		void eachInChunk(Func& func, Chunk* chunk, std::index_sequence<I...>) {
+			Archetype* archetype = chunk->archetype;
+			//Everything not const is assumed written
+			((std::is_const_v<Components> ? void() : system->touch(chunk, types[I])), ...);
+			std::tuple<Components*...> columns{ archetype->column<std::remove_const_t<Components>>(chunk, types[I])... };
+			Entity* entities = chunk->entities();
+			for (uint32_t row = 0; row < chunk->count; row++) {
+				if constexpr (std::is_invocable_v<Func&, Entity, Components&...>) {
+					func(entities[row], std::get<I>(columns)[row]...);
+				} else {
+					func(std::get<I>(columns)[row]...);
+				}
 			}
 		}
 
-		template<typename T>
-		bool hasComponent(Entity e) {
-			return getComponent<T>(e) != nullptr;
+		//Chunks where the column for changedType was written after version since. MAX_COMPONENT_TYPES lets every chunk through.
+		template<typename Func>
+		void eachFiltered(Func& func, uint32_t changedType, uint32_t since) {
+			update();
+			for (Archetype* archetype : matched) {
+				for (Chunk* chunk : archetype->chunks) {
+					if (changedType == MAX_COMPONENT_TYPES || chunk->versions[changedType].load(std::memory_order_relaxed) > since) {
+						eachInChunk(func, chunk, std::index_sequence_for<Components...>{});
+					}
+				}
+			}
 		}
 
-		void makeParent(Entity parent, Entity child) {
-			HierarchyComponent* cHier = getComponent<HierarchyComponent>(child);
-			TransformComponent* cTransform = getComponent<TransformComponent>(child);
-			cHier->parent = parent;
-			if (parent == NULL_ENTITY){
-				cHier->world_transform = cTransform->toMatrix();
-				return;
-			}
-			HierarchyComponent* pHier = getComponent<HierarchyComponent>(parent);
-			mat4f cmat =  cTransform->toMatrix();
-			pHier->world_transform.mul(cmat, cHier->world_transform);
-
-			std::vector<IComponentManager*> pTypes = componentDeletes[parent];
-			std::vector<IComponentManager*> cTypes = componentDeletes[child];
-			for (IComponentManager* man : pTypes) {
-				//Why doesn't vector have a contains method?
-				if (std::count(cTypes.begin(), cTypes.end(), man)) {
-					man->makeParent(parent, child);
+		template<typename Func>
+		void eachFilteredParallel(job::JobSystem& jobSystem, Func& func, uint32_t minPerJob, uint32_t changedType, uint32_t since) {
+			update();
+			job::ScopedScratch scratch{};
+			std::vector<Chunk*, job::ScratchAllocator<Chunk*>> chunks{ job::ScratchAllocator<Chunk*>(scratch) };
+			uint32_t capacity = CHUNK_SIZE;
+			for (Archetype* archetype : matched) {
+				for (Chunk* chunk : archetype->chunks) {
+					if (changedType == MAX_COMPONENT_TYPES || chunk->versions[changedType].load(std::memory_order_relaxed) > since) {
+						chunks.push_back(chunk);
+					}
+				}
+				if (!archetype->chunks.empty()) {
+					capacity = std::min(capacity, archetype->chunkCapacity);
 				}
 			}
+			jobSystem.parallel_for(0, static_cast<uint32_t>(chunks.size()), [&](uint32_t i) {
+				eachInChunk(func, chunks[i], std::index_sequence_for<Components...>{});
+			}, std::max((minPerJob + capacity - 1) / capacity, 1u));
 		}
-
-		Entity createEntity() {
-			Entity ent = NULL_ENTITY;
-			if (removedEntityIds.size() > 0) {
-				ent = removedEntityIds.back();
-				removedEntityIds.pop_back();
-			} else {
-				ent = currentEntityId++;
+	public:
+		Query(ComponentSystem& componentSystem) : system{ &componentSystem }, types{ componentSystem.componentType<std::remove_const_t<Components>>()... } {
+			for (uint32_t type : types) {
+				mask |= ComponentMask(1) << type;
 			}
-			HierarchyComponent hier{};
-			this->addComponent<HierarchyComponent>(ent, hier, true);
-			TransformComponent tran{};
-			this->addComponent<TransformComponent>(ent, tran, true);
 		}
 
-		template<typename T>
-		void runSystem(void (*func)(T&)) {
-			ComponentManager<T>* man = getComponentManager<T>();
-			for (T& t : man->components) {
-				func(t);
-			}
+		//func takes the components in the order they're listed, optionally with the entity in front: func(Entity, Components&...)
+		template<typename Func>
+		void each(Func&& func) {
+			eachFiltered(func, MAX_COMPONENT_TYPES, 0);
 		}
 
-		template<typename T>
-		struct RangeFuncArg {
-			std::vector<T>& components;
-			void (*func)(T&);
-			uint16_t min;
-			uint16_t max;
-		};
+		//Same as each, split across jobs a chunk at a time. Nothing can add or remove entities until it returns.
+		template<typename Func>
+		void eachParallel(job::JobSystem& jobSystem, Func&& func, uint32_t minPerJob = 16) {
+			eachFilteredParallel(jobSystem, func, minPerJob, MAX_COMPONENT_TYPES, 0);
+		}
 
-		template<typename T>
-		static void runFuncForRange(void* vparg) {
-			RangeFuncArg<T>* arg = reinterpret_cast<RangeFuncArg<T>>(vparg);
-			for (uint16_t i = arg->min; i < arg->max; i++) {
-				arg->func(arg->components[i]);
-			}
+		//Only visits chunks where Changed was written to after version since. The whole chunk is visited, so some entities will come through unchanged.
+		//Changed has to be one of the query's components. List it as const unless the func writes it, otherwise the query marks it changed again itself.
+		template<typename Changed, typename Func>
+		void eachChanged(uint32_t since, Func&& func) {
+			eachFiltered(func, system->componentType<std::remove_const_t<Changed>>(), since);
 		}
 
-		template<typename T>
-		void runSystemParallel(void (*func)(T&), job::JobSystem& jobSystem, uint16_t minPerJob = 16) {
-			ComponentManager<T>* man = getComponentManager<T>();
-			uint16_t count = std::min(man->size()/minPerJob + 1, jobSystem.thread_count());
-			uint16_t per = (man->size() + (count-1))/count;
-			job::JobDecl decls[count];
-			RangeFuncArg<T> args[count];
-			for (uint16_t i = 0; i < count; i++) {
-				uint16_t min = i * per;
-				uint16_t max = std::min(min + per, man->size());
-				args[i] = {man->components, func, min, max};
-				decls[i] = job::JobDecl(runFuncForRange<T>, reinterpret_cast<void*>(args[i]));
-			}
-			jobSystem.start_jobs_and_wait_for_counter(&decls, count);
+		template<typename Changed, typename Func>
+		void eachChangedParallel(job::JobSystem& jobSystem, uint32_t since, Func&& func, uint32_t minPerJob = 16) {
+			eachFilteredParallel(jobSystem, func, minPerJob, system->componentType<std::remove_const_t<Changed>>(), since);
 		}
 
-		void removeEntity(Entity ent);
+		uint32_t count() {
+			update();
+			uint32_t total = 0;
+			for (Archetype* archetype : matched) {
+				total += archetype->entityCount;
+			}
+			return total;
+		}
 	};
 }
\ No newline at end of file
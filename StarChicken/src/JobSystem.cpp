@@ -1,22 +1,47 @@
 #include <iostream>
 #include <stdint.h>
+#include <cstddef>
 #include <atomic>
 #include <thread>
+#include <algorithm>
 #include <signal.h>
+#include <cassert>
+#include <stdexcept>
+#include <chrono>
+#include <string>
+#include <cstring>
 #include "JobSystem.h"
 #include "Profiling.h"
 #ifdef _WIN32
+#define NOMINMAX
 #include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
 #elif __linux__
 #include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#ifdef JOB_ASAN
+#include <sanitizer/asan_interface.h>
 #endif
 
 //Yeah we're just going to unoptimize this whole class. Stupid? Probably, but also have no idea what I'm doing otherwise
 //Actually looks like it works now that I've actually fixed my code, so cool.
 //#pragma optimize("", off)
 
-//Don't use, I can't get lock free programming to work for the life of me. Lock free programming is cursed.
-//#define LOCK_FREE
+//The queues are lock free Chase-Lev deques now. Define this to go back to the old spin locked queues, mostly useful for comparing throughput.
+//#define SPIN_LOCKED_QUEUES
+
+//The context switch assembly hardcodes these offsets
+#if defined(CONTEXT_WIN64)
+static_assert(offsetof(Context, xmm6) == 0x50 && offsetof(Context, mxcsrControlWord) == 0xf0 && offsetof(Context, fiberData) == 0x118, "Context layout doesn't match ContextUtils.asm");
+#elif defined(CONTEXT_SYSV_X64)
+static_assert(offsetof(Context, r15) == 0x38 && offsetof(Context, mxcsrControlWord) == 0x40 && offsetof(Context, x87fpuControlWord) == 0x44, "Context layout doesn't match ContextUtils_sysv_x64.S");
+#elif defined(CONTEXT_AARCH64)
+static_assert(offsetof(Context, fp) == 96 && offsetof(Context, d8) == 104 && offsetof(Context, fpcr) == 168, "Context layout doesn't match ContextUtils_aarch64.S");
+#endif
 
 namespace job {
 
@@ -27,6 +52,8 @@ namespace job {
 		currentJob{ nullptr },
 		newJobsToAdd{ nullptr },
 		newJobsToAddCount{ 0 },
+		lockToRelease{ nullptr },
+		counterToRelease{ nullptr },
 		stealId{ UINT32_MAX },
 		threadId{ UINT32_MAX }
 	{}
@@ -35,12 +62,123 @@ namespace job {
 		return threadData->currentJob;
 	}
 
-	Job::Job(job::JobSystem* sys) {
+	static size_t page_size() {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	//ASan assumes a thread stays on one stack. Without these it checks job frames against the worker's stack and never cleans up
+	//a job stack it doesn't know about, so poison from frames an exception unwound stays behind and trips up the next call.
+	//Worker to job: asan_switch_to_job, switch, asan_back_on_worker. Job to worker: asan_switch_to_worker, switch, asan_back_in_job.
+#ifdef JOB_ASAN
+	static void asan_switch_to_job(JobThreadData& localData, Job& job) {
+		size_t guardSize = page_size();
+		__sanitizer_start_switch_fiber(&localData.asanFakeStack, job.data + guardSize, job.reservedSize - guardSize);
+	}
+
+	static void asan_back_on_worker(JobThreadData& localData) {
+		__sanitizer_finish_switch_fiber(localData.asanFakeStack, nullptr, nullptr);
+	}
+
+	//A job that has ended passes null for its fake stack so ASan frees it
+	static void asan_switch_to_worker(Job& job, bool ended) {
+		__sanitizer_start_switch_fiber(ended ? nullptr : &job.asanFakeStack, job.asanWorkerStack, job.asanWorkerStackSize);
+	}
+
+	static void asan_back_in_job(Job& job) {
+		__sanitizer_finish_switch_fiber(job.asanFakeStack, &job.asanWorkerStack, &job.asanWorkerStackSize);
+	}
+#else
+	static void asan_switch_to_job(JobThreadData&, Job&) {}
+	static void asan_back_on_worker(JobThreadData&) {}
+	static void asan_switch_to_worker(Job&, bool) {}
+	static void asan_back_in_job(Job&) {}
+#endif
+
+	static size_t committed_stack_bytes(Job& job) {
+		if (!job.data) {
+			return 0;
+		}
+#ifdef _WIN32
+		//The OS moves the TIB stack limit down as it commits pages, and that gets saved into the context whenever the job switches out
+		return reinterpret_cast<char*>(job.ctx.stackBase) - reinterpret_cast<char*>(job.ctx.stackLimit);
+#else
+		//Nothing tracks this on Linux, so count resident pages from the top of the stack down
+		size_t pageSize = page_size();
+		size_t pageCount = job.reservedSize / pageSize;
+		std::vector<unsigned char> resident(pageCount);
+		if (mincore(job.data, job.reservedSize, resident.data()) != 0) {
+			return 0;
+		}
+		size_t committed = 0;
+		for (size_t i = pageCount; i > 0 && (resident[i - 1] & 1); i--) {
+			committed += pageSize;
+		}
+		return committed;
+#endif
+	}
+
+	//Sets up a context that starts Job::run at the top of the job's stack
+	static void init_job_context(Job& job, Context& defaultCtx) {
+#ifdef JOB_ASAN
+		//Job::run never returns, it switches straight back to the worker, so the redzones of the last job's frames are still poisoned
+		size_t guardSize = page_size();
+		ASAN_UNPOISON_MEMORY_REGION(job.data + guardSize, job.reservedSize - guardSize);
+		job.asanFakeStack = nullptr;
+#endif
+#if defined(CONTEXT_WIN64) || defined(CONTEXT_SYSV_X64)
+		job.ctx.rip = (void*)job.run;
+		//Subtract from stack pointer to pretend we pushed a return address, otherwise the stack will be aligned wrong
+		job.ctx.rsp = (void*)(job.stackPointer - sizeof(uintptr_t));
+		job.ctx.rbp = nullptr;
+
+		job.ctx.x87fpuControlWord = defaultCtx.x87fpuControlWord;
+		job.ctx.mxcsrControlWord = defaultCtx.mxcsrControlWord;
+#elif defined(CONTEXT_AARCH64)
+		job.ctx.pc = (void*)job.run;
+		//No return address on the stack here, it's in the link register, so the stack pointer just has to be 16 byte aligned
+		job.ctx.sp = (void*)job.stackPointer;
+		//Null frame pointer ends the frame chain for debuggers and profilers
+		job.ctx.fp = nullptr;
+
+		job.ctx.fpcr = defaultCtx.fpcr;
+#endif
+	}
+
+	Job::Job(job::JobSystem* sys, JobStackClass stack) {
 		this->system = sys;
-		data = reinterpret_cast<char*>(malloc(JOB_STACK_SIZE));
-		//std::cout << "\t" << std::hex << reinterpret_cast<uintptr_t>(data) << std::endl;
+		stackClass = stack;
+		size_t pageSize = page_size();
+		size_t stackSize = JOB_STACK_SIZES[stack];
+		if (stackSize == 0) {
+			return;
+		}
+		//One extra page at the bottom that is never accessible, so an overflow faults instead of corrupting whatever is below
+		reservedSize = stackSize + pageSize;
+		char* stackTop = nullptr;
+		char* committedLimit = nullptr;
+#ifdef _WIN32
+		data = reinterpret_cast<char*>(VirtualAlloc(nullptr, reservedSize, MEM_RESERVE, PAGE_NOACCESS));
+		stackTop = data + reservedSize;
+		//Commit only the top page plus a guard page below it. Touching the guard page makes the OS commit the next one down, same as a thread stack.
+		//This only works because the context switch keeps the TIB stack base and limit up to date.
+		committedLimit = stackTop - pageSize;
+		VirtualAlloc(committedLimit, pageSize, MEM_COMMIT, PAGE_READWRITE);
+		VirtualAlloc(committedLimit - pageSize, pageSize, MEM_COMMIT, PAGE_READWRITE | PAGE_GUARD);
+#else
+		data = reinterpret_cast<char*>(mmap(nullptr, reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+		//Linux already commits pages on first touch, so all that's needed is making everything above the guard page accessible
+		mprotect(data + pageSize, stackSize, PROT_READ | PROT_WRITE);
+		stackTop = data + reservedSize;
+		committedLimit = data + pageSize;
+#endif
 		//Stacks grow down, so start at the top
-		stackPointer = data + JOB_STACK_SIZE;
+		stackPointer = stackTop;
 		//Align to 16 bytes
 		stackPointer = (char*)((uintptr_t)stackPointer & -16L);
 		//Red zone
@@ -48,27 +186,38 @@ namespace job {
 		//I'll leave it here anyway, just for some padding
 		stackPointer -= 128;
 
-		ctx.stackBase = stackPointer;
-		ctx.stackLimit = data;
+		ctx.stackBase = stackTop;
+		ctx.stackLimit = committedLimit;
 		ctx.deallocationStack = data;
 		ctx.guaranteedStackBytes = 0;
 		ctx.fiberData = 0;
 	}
 
 	Job::~Job() {
-		//std::cout << "\t" << std::hex << reinterpret_cast<uintptr_t>(data) << std::endl;
-		free(data);
+		if (!data) {
+			return;
+		}
+#ifdef _WIN32
+		VirtualFree(data, 0, MEM_RELEASE);
+#else
+		munmap(data, reservedSize);
+#endif
 	}
 
 	void Job::run(Job* job) {
-		job->currentTask->func(job->currentTask->arg);
-		if (job->currentTask->counter) {
-			job->currentTask->counter->decrement();
+		asan_back_in_job(*job);
+		//Same as the stackless path, the decl may not outlive func
+		JobDecl* task = job->currentTask;
+		JobCounter* counter = task->counter;
+		task->func(task->arg);
+		if (counter) {
+			counter->decrement();
 		}
 		job->currentTask = nullptr;
 		job->active = false;
 		job->state = ENDED;
 		job->system->activeJobCount.fetch_add(-1, std::memory_order_relaxed);
+		asan_switch_to_worker(*job, true);
 		/*Context ctx{};
 		save_registers(ctx);
 		int32_t tid = this_thread_id();
@@ -89,18 +238,46 @@ namespace job {
 		func = nullptr;
 		counter = nullptr;
 		arg = nullptr;
+		stackClass = JOB_STACK_LARGE;
+		priority = JOB_PRIORITY_NORMAL;
 	}
 
-	JobDecl::JobDecl(void (*f)(void*), void* argument) {
+	JobDecl::JobDecl(void (*f)(void*), void* argument, JobStackClass stack, JobPriority jobPriority) {
 		func = f;
 		counter = nullptr;
 		arg = argument;
+		stackClass = stack;
+		priority = jobPriority;
 	}
 
-	JobDecl::JobDecl(void (*f)(void)) {
+	JobDecl::JobDecl(void (*f)(void), JobStackClass stack, JobPriority jobPriority) {
 		func = reinterpret_cast<void (*)(void*)>(f);
 		counter = nullptr;
 		arg = nullptr;
+		stackClass = stack;
+		priority = jobPriority;
+	}
+
+
+
+	JobQueueBuffer::JobQueueBuffer(int64_t size, JobQueueBuffer* retired) {
+		this->size = size;
+		this->mask = size - 1;
+		this->retired = retired;
+		jobs = new std::atomic<Job*>[size];
+	}
+
+	JobQueueBuffer::~JobQueueBuffer() {
+		delete[] jobs;
+		delete retired;
+	}
+
+	JobQueueBuffer* JobQueueBuffer::grow(int64_t top, int64_t bottom) {
+		JobQueueBuffer* newBuffer = new JobQueueBuffer(size * 2, this);
+		for (int64_t i = top; i < bottom; i++) {
+			newBuffer->put(i, get(i));
+		}
+		return newBuffer;
 	}
 
 
@@ -109,13 +286,338 @@ namespace job {
 		threadId = tid;
 		this->id = id;
 		stealId = id;
-		jobs = reinterpret_cast<Job**>(malloc(sizeof(uintptr_t) * queueSize));
 		top.store(0, std::memory_order_relaxed);
 		bottom.store(0, std::memory_order_relaxed);
+		buffer.store(new JobQueueBuffer(queueSize, nullptr), std::memory_order_relaxed);
+		inboxCount.store(0, std::memory_order_relaxed);
 	}
 
 	JobQueue::~JobQueue() {
-		free(jobs);
+		delete buffer.load(std::memory_order_relaxed);
+	}
+
+	//Orderings follow "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013)
+	void JobQueue::push(Job* job) {
+#ifdef SPIN_LOCKED_QUEUES
+		SPIN_LOCK(queueLock);
+#endif
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		JobQueueBuffer* buf = buffer.load(std::memory_order_relaxed);
+		if (b - t > buf->size - 1) {
+			buf = buf->grow(t, b);
+			buffer.store(buf, std::memory_order_release);
+		}
+		buf->put(b, job);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	Job* JobQueue::pop() {
+		if (inboxCount.load(std::memory_order_relaxed) > 0) {
+			drain_inbox();
+		}
+#ifdef SPIN_LOCKED_QUEUES
+		SPIN_LOCK(queueLock);
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t >= b) {
+			return nullptr;
+		}
+		bottom.store(b - 1, std::memory_order_relaxed);
+		return buffer.load(std::memory_order_relaxed)->get(b - 1);
+#else
+		//Only the owner pushes, so if it's empty now it stays empty. Saves the fence when polling queues that are usually empty.
+		if (bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed)) {
+			return nullptr;
+		}
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		JobQueueBuffer* buf = buffer.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		Job* job = nullptr;
+		if (t <= b) {
+			job = buf->get(b);
+			if (t == b) {
+				//Last job in the queue, race any thieves for it
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					job = nullptr;
+				}
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+		} else {
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return job;
+#endif
+	}
+
+	Job* JobQueue::steal() {
+#ifdef SPIN_LOCKED_QUEUES
+		{
+			SPIN_LOCK(queueLock);
+			int64_t t = top.load(std::memory_order_relaxed);
+			int64_t b = bottom.load(std::memory_order_relaxed);
+			if (t < b) {
+				top.store(t + 1, std::memory_order_relaxed);
+				return buffer.load(std::memory_order_relaxed)->get(t);
+			}
+		}
+		return steal_from_inbox();
+#else
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+
+		Job* job = nullptr;
+		if (t < b) {
+			JobQueueBuffer* buf = buffer.load(std::memory_order_acquire);
+			job = buf->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				//Lost the race to the owner or another thief
+				job = nullptr;
+			}
+		}
+		if (!job) {
+			job = steal_from_inbox();
+		}
+		return job;
+#endif
+	}
+
+	uint32_t JobQueue::depth() {
+		int64_t count = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+		return static_cast<uint32_t>(std::max(count, int64_t(0))) + inboxCount.load(std::memory_order_relaxed);
+	}
+
+	Job* JobQueue::steal_from_inbox() {
+		//The owner might be parked, so thieves take jobs pushed from other threads as well
+		if (inboxCount.load(std::memory_order_acquire) == 0) {
+			return nullptr;
+		}
+		SPIN_LOCK(inboxLock);
+		if (inbox.empty()) {
+			return nullptr;
+		}
+		Job* job = inbox.front();
+		inbox.erase(inbox.begin());
+		inboxCount.store(static_cast<uint32_t>(inbox.size()), std::memory_order_relaxed);
+		return job;
+	}
+
+	void JobQueue::push_from_other_thread(Job* job) {
+		SPIN_LOCK(inboxLock);
+		inbox.push_back(job);
+		inboxCount.store(static_cast<uint32_t>(inbox.size()), std::memory_order_release);
+	}
+
+	void JobQueue::drain_inbox() {
+		std::vector<Job*> jobs;
+		{
+			SPIN_LOCK(inboxLock);
+			jobs.swap(inbox);
+			inboxCount.store(0, std::memory_order_relaxed);
+		}
+		for (Job* job : jobs) {
+			push(job);
+		}
+	}
+
+
+
+	DistributedRWLock::DistributedRWLock(uint32_t workerCount) {
+		slotCount = std::max(workerCount, 1u) + 1;
+		slots = new ReaderSlot[slotCount];
+	}
+
+	DistributedRWLock::DistributedRWLock(JobSystem& jobSystem) : DistributedRWLock(jobSystem.thread_count()) {
+	}
+
+	DistributedRWLock::~DistributedRWLock() {
+		delete[] slots;
+	}
+
+	DistributedRWLock::ReaderSlot& DistributedRWLock::local_slot() {
+		uint32_t slot = threadData ? std::min(static_cast<uint32_t>(threadData->threadId), slotCount - 1) : slotCount - 1;
+		return slots[slot];
+	}
+
+	void DistributedRWLock::lock_read() {
+		ReaderSlot& slot = local_slot();
+		SpinBackoff backoff{};
+		while (true) {
+			while (writer.load(std::memory_order_relaxed)) {
+				backoff.pause();
+			}
+			//Has to be seq_cst both ways, the writer sets its flag then reads our slot and we bump our slot then read its flag
+			slot.readers.fetch_add(1, std::memory_order_seq_cst);
+			if (!writer.load(std::memory_order_seq_cst)) {
+				break;
+			}
+			slot.readers.fetch_add(-1, std::memory_order_release);
+		}
+	}
+
+	void DistributedRWLock::unlock_read() {
+		local_slot().readers.fetch_add(-1, std::memory_order_release);
+	}
+
+	void DistributedRWLock::lock_write() {
+		SpinBackoff backoff{};
+		while (true) {
+			bool expected = false;
+			if (!writer.load(std::memory_order_relaxed) && writer.compare_exchange_strong(expected, true, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				break;
+			}
+			backoff.pause();
+		}
+		//No new readers can get in now, wait for the ones already in to leave
+		backoff = SpinBackoff{};
+		while (true) {
+			int32_t readers = 0;
+			for (uint32_t i = 0; i < slotCount; i++) {
+				readers += slots[i].readers.load(std::memory_order_seq_cst);
+			}
+			if (readers == 0) {
+				break;
+			}
+			backoff.pause();
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
+
+	void DistributedRWLock::unlock_write() {
+		writer.store(false, std::memory_order_release);
+	}
+
+	static SpinLock lockStatsLock{};
+	//Never freed, locks can still be using their stats while statics are being destroyed at exit
+	static std::vector<LockStats*>* allLockStats = new std::vector<LockStats*>();
+
+	static uint64_t lock_clock_nanoseconds() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	struct HeldLock {
+		LockStats* stats;
+		uint64_t since;
+	};
+	static const uint32_t MAX_HELD_LOCKS = 16;
+	static thread_local HeldLock heldLocks[MAX_HELD_LOCKS];
+	static thread_local uint32_t heldLockCount = 0;
+
+	static void record_max(std::atomic<uint64_t>& max, uint64_t value) {
+		uint64_t currentMax = max.load(std::memory_order_relaxed);
+		while (value > currentMax && !max.compare_exchange_weak(currentMax, value, std::memory_order_relaxed));
+	}
+
+	void LockStats::record_acquire(uint32_t spinCount) {
+		acquisitions.fetch_add(1, std::memory_order_relaxed);
+		if (spinCount > 0) {
+			contended.fetch_add(1, std::memory_order_relaxed);
+			spins.fetch_add(spinCount, std::memory_order_relaxed);
+		}
+		if (heldLockCount < MAX_HELD_LOCKS) {
+			heldLocks[heldLockCount++] = HeldLock{ this, lock_clock_nanoseconds() };
+		}
+	}
+
+	void LockStats::record_release(bool exclusive) {
+		uint64_t now = lock_clock_nanoseconds();
+		//Not found if this thread was already holding too many, or the holder moved to another thread in between. Either way that hold just isn't timed.
+		for (uint32_t i = heldLockCount; i > 0; i--) {
+			if (heldLocks[i - 1].stats == this) {
+				record_max(exclusive ? maxHoldNanoseconds : maxSharedHoldNanoseconds, now - heldLocks[i - 1].since);
+				heldLocks[i - 1] = heldLocks[--heldLockCount];
+				return;
+			}
+		}
+	}
+
+	LockStats* register_lock_stats(const char* name) {
+		SPIN_LOCK(lockStatsLock);
+		for (LockStats* stats : *allLockStats) {
+			if (strcmp(stats->name, name) == 0) {
+				return stats;
+			}
+		}
+		LockStats* stats = new LockStats();
+		stats->name = name;
+		allLockStats->push_back(stats);
+		return stats;
+	}
+
+	std::vector<LockStatsSnapshot> lock_stats() {
+		std::vector<LockStatsSnapshot> snapshots;
+		SPIN_LOCK(lockStatsLock);
+		for (LockStats* stats : *allLockStats) {
+			snapshots.push_back(LockStatsSnapshot{ stats->name, stats->acquisitions.load(std::memory_order_relaxed), stats->contended.load(std::memory_order_relaxed),
+				stats->spins.load(std::memory_order_relaxed), stats->maxHoldNanoseconds.load(std::memory_order_relaxed), stats->maxSharedHoldNanoseconds.load(std::memory_order_relaxed) });
+		}
+		return snapshots;
+	}
+
+	void dump_lock_stats() {
+		std::vector<LockStatsSnapshot> snapshots = lock_stats();
+		std::sort(snapshots.begin(), snapshots.end(), [](const LockStatsSnapshot& a, const LockStatsSnapshot& b) {
+			return a.spins > b.spins;
+		});
+		for (LockStatsSnapshot& stats : snapshots) {
+			std::cout << "Lock " << stats.name << ": " << stats.acquisitions << " acquisitions, " << stats.contended << " contended, " << stats.spins << " spins, "
+				<< stats.maxHoldNanoseconds / 1000 << "us max hold, " << stats.maxSharedHoldNanoseconds / 1000 << "us max shared hold" << std::endl;
+		}
+	}
+
+	uint32_t EventCount::prepare_wait() {
+		waiters.fetch_add(1, std::memory_order_seq_cst);
+		uint32_t key = epoch.load(std::memory_order_acquire);
+		//Pairs with the fence in notify. Either the notifier sees our waiter count or our final check for work sees its job.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return key;
+	}
+
+	void EventCount::cancel_wait() {
+		waiters.fetch_add(-1, std::memory_order_relaxed);
+	}
+
+	void EventCount::wait(uint32_t key) {
+		while (epoch.load(std::memory_order_acquire) == key) {
+#ifdef _WIN32
+			WaitOnAddress(&epoch, &key, sizeof(uint32_t), INFINITE);
+#elif __linux__
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#endif
+		}
+		waiters.fetch_add(-1, std::memory_order_relaxed);
+	}
+
+	void EventCount::notify(uint32_t count) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint32_t waiting = waiters.load(std::memory_order_relaxed);
+		if (waiting == 0 || count == 0) {
+			return;
+		}
+		epoch.fetch_add(1, std::memory_order_release);
+		count = std::min(count, waiting);
+#ifdef _WIN32
+		for (uint32_t i = 0; i < count; i++) {
+			WakeByAddressSingle(&epoch);
+		}
+#elif __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#endif
+	}
+
+	void EventCount::notify_all() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		epoch.fetch_add(1, std::memory_order_release);
+#ifdef _WIN32
+		WakeByAddressAll(&epoch);
+#elif __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#endif
 	}
 
 
@@ -126,39 +628,56 @@ namespace job {
 	}
 
 	void JobCounter::decrement() {
-		int32_t count = counter.fetch_add(-1, std::memory_order_relaxed);
+		int32_t count = counter.fetch_add(-1, std::memory_order_acq_rel);
 		if (count == 1) {
-			job->system->push_job(*job->system->queues[threadData->threadId], *job);
+			job->system->push_job(threadData ? threadData->threadId : 0, *job);
 		}
 	}
 
 
 
-	void JobSystem::init_job_system(uint32_t threadCount) {
-		for (int i = 0; i < queueSize; i++) {
-			jobPool[i] = new Job(this);
+	void JobSystem::init_job_system(uint32_t threadCount, bool pinWorkers) {
+		//Every job start and wait goes through one of these, so they're the first place to look when workers spend their time spinning
+		jobPoolLock.track_stats("Job pool");
+		counterPoolLock.track_stats("Counter pool");
+		frameLaneLock.track_stats("Frame lane");
+		for (uint8_t stack = 0; stack < JOB_STACK_CLASS_COUNT; stack++) {
+			for (uint32_t i = 0; i < INITIAL_JOB_POOL_SIZE; i++) {
+				Job* job = new Job(this, static_cast<JobStackClass>(stack));
+				allJobs.push_back(job);
+				jobPool[stack].push_back(job);
+			}
+		}
+		for (uint32_t i = 0; i < INITIAL_JOB_POOL_SIZE; i++) {
+			JobCounter* counter = new JobCounter(nullptr, 0);
+			allCounters.push_back(counter);
+			counterPool.push_back(counter);
 		}
-		jobPoolReadIdx.store(0, std::memory_order_relaxed);
-		jobPoolMaxReadIdx.store(queueSizeMask, std::memory_order_relaxed);
-		jobPoolWriteIdx.store(queueSizeMask, std::memory_order_relaxed);
 
 		threadpool.resize(threadCount);
-		queues.resize(threadCount);
+		for (uint32_t priority = 0; priority < JOB_PRIORITY_QUEUE_COUNT; priority++) {
+			queues[priority].resize(threadCount);
+		}
+		workerCounters = new WorkerCounters[threadCount];
+		build_victim_order(threadCount);
 		//queues.resize(threadpool.size());
 		finished.store(true, std::memory_order_relaxed);
 
 		for (uint32_t i = 0; i < threadCount; i++) {
 			threadpool[i] = std::thread(&JobSystem::threadFunc, this, i);
-			queues[i] = new JobQueue(threadpool[i].get_id(), i);
+			for (uint32_t priority = 0; priority < JOB_PRIORITY_QUEUE_COUNT; priority++) {
+				queues[priority][i] = new JobQueue(threadpool[i].get_id(), i);
+			}
+			if (pinWorkers) {
 			#ifdef _WIN32
-				SetThreadAffinityMask(threadpool[i].native_handle(), static_cast<DWORD_PTR>(1)<<i);
+				SetThreadAffinityMask(threadpool[i].native_handle(), static_cast<DWORD_PTR>(1) << workerCpus[i]);
 			#elif __linux__
-				cpu_set_t cputset;
+				cpu_set_t cpuset;
 				CPU_ZERO(&cpuset);
-				CPU_SET(i, &cpuset);
+				CPU_SET(workerCpus[i], &cpuset);
 				pthread_setaffinity_np(threadpool[i].native_handle(), sizeof(cpu_set_t), &cpuset);
 			#endif
-			
+			}
 		}
 	}
 
@@ -169,7 +688,8 @@ namespace job {
 
 	void JobSystem::end_job_system() {
 		finished.store(true, std::memory_order_relaxed);
-		for (int i = 0; i < threadpool.size(); i++) {
+		idleWorkers.notify_all();
+		for (uint32_t i = 0; i < threadpool.size(); i++) {
 			threadpool[i].join();
 		}
 
@@ -177,76 +697,148 @@ namespace job {
 	}
 
 	void JobSystem::cleanup() {
-		for (int i = 0; i < queueSize; i++) {
-			delete jobPool[i];
+		JobPoolStats stats = pool_stats();
+		for (uint8_t stack = 0; stack < JOB_STACK_CLASS_COUNT; stack++) {
+			if (JOB_STACK_SIZES[stack] == 0) {
+				std::cout << "Job pool stackless: " << stats.allocated[stack] << " allocated, " << stats.highWater[stack] << " high water" << std::endl;
+			} else {
+				std::cout << "Job pool " << JOB_STACK_SIZES[stack] / 1024 << "KB stacks: " << stats.allocated[stack] << " allocated, " << stats.highWater[stack] << " high water, " << stats.maxCommittedStack[stack] / 1024 << "KB max committed" << std::endl;
+			}
+			jobPool[stack].clear();
+		}
+		dump_lock_stats();
+		for (Job* job : allJobs) {
+			delete job;
+		}
+		allJobs.clear();
+		for (JobCounter* counter : allCounters) {
+			delete counter;
 		}
-		for (uint16_t i = 0; i < queues.size(); i++) {
-			delete queues[i];
+		allCounters.clear();
+		counterPool.clear();
+		for (uint32_t priority = 0; priority < JOB_PRIORITY_QUEUE_COUNT; priority++) {
+			for (uint16_t i = 0; i < queues[priority].size(); i++) {
+				delete queues[priority][i];
+			}
 		}
+		delete[] workerCounters;
+		workerCounters = nullptr;
+	}
+
+	//Counters only have one writer, so there's no need for a locked add
+	static void add_to_counter(std::atomic<uint64_t>& counter, uint64_t amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	static uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
 	}
 
 	void JobSystem::threadFunc(uint32_t idx) {
 		threadData = new JobThreadData{};
 		JobThreadData& localData = *threadData;
 		localData.threadId = idx;
-		localData.stealId = idx;
+		WorkerCounters& counters = workerCounters[idx];
 		while (finished.load(std::memory_order_relaxed)) {
 		}
 		std::atomic_thread_fence(std::memory_order_acquire);
-		uint32_t x87fpuControlWord = 0;
-		uint32_t mxcsrControlWord = 0;
-		{
-			Context ctx{};
-			save_registers(ctx);
-			x87fpuControlWord = ctx.x87fpuControlWord;
-			mxcsrControlWord = ctx.mxcsrControlWord;
-		}
-		uint8_t count = 0;
+		//New jobs start with this thread's floating point control state
+		Context defaultCtx{};
+		save_registers(defaultCtx);
+		uint32_t count = 0;
 		while (!finished.load(std::memory_order_relaxed)) {
 			Job* job = getJob(idx);
-			if (job) {
+			if (!job) {
+				if (++count <= spinBudget.load(std::memory_order_relaxed)) {
+					cpu_relax();
+					continue;
+				}
 				count = 0;
-				if (!job->currentTask) {
-					std::cout << "Failed, no current task in tf!" << std::endl;
+				uint32_t key = idleWorkers.prepare_wait();
+				//Last check after announcing we're about to sleep, anything pushed after this will change the key
+				job = getJob(idx);
+				if (!job) {
+					if (finished.load(std::memory_order_relaxed)) {
+						idleWorkers.cancel_wait();
+					} else {
+						std::chrono::steady_clock::time_point parkStart = std::chrono::steady_clock::now();
+						idleWorkers.wait(key);
+						add_to_counter(counters.parkedNanoseconds, nanoseconds_since(parkStart));
+					}
+					continue;
 				}
-				if (!job->active) {
-					job->active = true;
-					job->ctx.rip = (void*)job->run;
-					//Subtract from stack pointer to pretend we pushed a return address, otherwise the stack will be aligned wrong
-					job->ctx.rsp = (void*)(job->stackPointer-sizeof(uintptr_t));
-
-					job->ctx.x87fpuControlWord = x87fpuControlWord;
-					job->ctx.mxcsrControlWord = mxcsrControlWord;
+				idleWorkers.cancel_wait();
+			}
+			count = 0;
+			if (!job->currentTask) {
+				std::cout << "Failed, no current task in tf!" << std::endl;
+			}
+			if (job->stackClass == JOB_STACK_NONE) {
+				//Nothing to switch to, it just runs to completion right here. Not being in a job makes anything that would suspend fall back to spinning instead.
+				localData.currentJob = nullptr;
+				//The decl can be freed by the time func returns (a coroutine's resume decl lives in its frame), so take what's needed out of it first
+				JobDecl* task = job->currentTask;
+				JobCounter* counter = task->counter;
+				job->currentTask = nullptr;
+				std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+				task->func(task->arg);
+				add_to_counter(counters.busyNanoseconds, nanoseconds_since(runStart));
+				add_to_counter(counters.jobsExecuted, 1);
+				if (counter) {
+					counter->decrement();
 				}
-				localData.currentJob = job;
+				activeJobCount.fetch_add(-1, std::memory_order_relaxed);
+				release_job(job);
+				continue;
+			}
+			if (!job->active) {
+				job->active = true;
+				init_job_context(*job, defaultCtx);
+			}
+			localData.currentJob = job;
 
-				if (job->state == ACTIVE) {
-					std::cout << "Wrong state before: " << job->state << "\n";
-				}
+			if (job->state == ACTIVE) {
+				std::cout << "Wrong state before: " << job->state << "\n";
+			}
 
-				job->state = ACTIVE;
-				swap_registers_arg(localData.threadCtx, job->ctx, job);
-				if (job->state == ACTIVE) {
-					std::cout << "Wrong state after: " << job->state << "\n";
-				}
+			if (job->state == SUSPENDED) {
+				add_to_counter(counters.resumes, 1);
+			}
+			job->state = ACTIVE;
+			std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+			asan_switch_to_job(localData, *job);
+			swap_registers_arg(localData.threadCtx, job->ctx, job);
+			asan_back_on_worker(localData);
+			add_to_counter(counters.busyNanoseconds, nanoseconds_since(runStart));
+			if (job->state == ACTIVE) {
+				std::cout << "Wrong state after: " << job->state << "\n";
+			}
 
-				if (job->state == ENDED) {
-					job->system->release_job(job);
-				}
+			if (job->state == ENDED) {
+				add_to_counter(counters.jobsExecuted, 1);
+				job->system->release_job(job);
+			} else {
+				add_to_counter(counters.suspends, 1);
+			}
 
-				if (localData.newJobsToAddCount > 0) {
-					for (uint32_t i = 0; i < localData.newJobsToAddCount; i++) {
-						push_job(*queues[idx], *localData.newJobsToAdd[i]);
-					}
+			if (localData.newJobsToAddCount > 0) {
+				for (uint32_t i = 0; i < localData.newJobsToAddCount; i++) {
+					enqueue_job(idx, *localData.newJobsToAdd[i]);
 				}
-				localData.newJobsToAddCount = 0;
-				localData.newJobsToAdd = nullptr;
-
-				continue;
+				//This thread is about to pick one of them up itself
+				wake_workers(localData.newJobsToAddCount - 1);
+				note_queue_depth(idx);
 			}
-			if (++count > 16) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-				count = 0;
+			localData.newJobsToAddCount = 0;
+			localData.newJobsToAdd = nullptr;
+			if (localData.lockToRelease) {
+				localData.lockToRelease->unlock();
+				localData.lockToRelease = nullptr;
+			}
+			if (localData.counterToRelease) {
+				//If the jobs already finished this is the last count and the waiter goes straight back on the queue
+				localData.counterToRelease->decrement();
+				localData.counterToRelease = nullptr;
 			}
 		}
 		delete threadData;
@@ -254,185 +846,238 @@ namespace job {
 		std::cout << "Exited job thread " << idx << " successfully" << std::endl;
 	}
 
-	void JobSystem::push_job(JobQueue& queue, Job& job) {
-#ifndef LOCK_FREE
-		queue.queueLock.lock();
-		int64_t bottom = queue.bottom.fetch_add(1, std::memory_order_relaxed);
-		queue.jobs[bottom] = &job;
-		queue.queueLock.unlock();
-#else
-		int64_t bottom = queue.bottom.fetch_add(1, std::memory_order_relaxed);
-		queue.jobs[bottom & queueSizeMask] = &job;
-		//Make sure if something tries to read this job, it's in memory
-		std::atomic_thread_fence(std::memory_order_seq_cst);
-		queue.bottom.store(bottom + 1, std::memory_order_relaxed);
-#endif
+	void JobSystem::push_job(uint32_t index, Job& job) {
+		enqueue_job(index, job);
+		wake_workers(1);
+	}
+
+	void JobSystem::enqueue_job(uint32_t index, Job& job) {
+		JobPriority priority = job.currentTask->priority;
+		if (priority == JOB_PRIORITY_FRAME_CRITICAL) {
+			SPIN_LOCK(frameLaneLock);
+			frameLane.push_back(&job);
+			frameLaneCount.fetch_add(1, std::memory_order_release);
+			return;
+		}
+		JobQueue& queue = *queues[priority][index];
+		if (threadData && threadData->threadId == index) {
+			queue.push(&job);
+			note_queue_depth(index);
+		} else {
+			queue.push_from_other_thread(&job);
+		}
+	}
+
+	void JobSystem::wake_workers(uint32_t jobCount) {
+		idleWorkers.notify(jobCount);
 	}
 
 	Job* JobSystem::pop_job(JobQueue& queue) {
-#ifndef LOCK_FREE
-		Job* job = nullptr;
-		queue.queueLock.lock();
-		int64_t bottom = queue.bottom.load(std::memory_order_relaxed);
-		if (bottom > 0) {
-			queue.bottom.store(bottom - 1, std::memory_order_relaxed);
-			job = queue.jobs[(bottom - 1) & queueSizeMask];
+		return queue.pop();
+	}
+
+	Job* JobSystem::pop_frame_lane() {
+		if (frameLaneCount.load(std::memory_order_acquire) == 0) {
+			return nullptr;
+		}
+		SPIN_LOCK(frameLaneLock);
+		if (frameLane.empty()) {
+			return nullptr;
 		}
-		queue.queueLock.unlock();
+		Job* job = frameLane.front();
+		frameLane.pop_front();
+		frameLaneCount.fetch_add(-1, std::memory_order_relaxed);
 		return job;
-#else
-		int64_t bottom = queue.bottom.fetch_add(-1, std::memory_order_relaxed) - 1;
-		std::atomic_thread_fence(std::memory_order_seq_cst);
-		int64_t top = queue.top.load(std::memory_order_relaxed);
+	}
 
-		Job* job = nullptr;
-		if (top <= bottom) {
-			job = queue.jobs[bottom & queueSizeMask];
-			if (top == bottom) {
-				if (!queue.top.compare_exchange_strong(top, top + 1, std::memory_order_relaxed, std::memory_order_relaxed)) {
-					job = nullptr;
-				}
-				queue.bottom.store(top + 1, std::memory_order_relaxed);
+	void JobSystem::build_victim_order(uint32_t threadCount) {
+		topology = read_cpu_topology();
+		workerCpus.resize(threadCount);
+		for (uint32_t i = 0; i < threadCount; i++) {
+			workerCpus[i] = topology.cpus[i % topology.cpus.size()].id;
+		}
+		victimOrder.assign(threadCount, {});
+		for (uint32_t i = 0; i < threadCount; i++) {
+			const LogicalCpu& thief = topology.cpus[i % topology.cpus.size()];
+			for (uint32_t offset = 1; offset < threadCount; offset++) {
+				//Starting from the next worker up spreads thieves out over victims at the same distance
+				uint32_t victim = (i + offset) % threadCount;
+				victimOrder[i].push_back(StealVictim{ victim, topology.distance(thief, topology.cpus[victim % topology.cpus.size()]) });
 			}
-		} else {
-			queue.bottom.store(top, std::memory_order_relaxed);
-			job = nullptr;
+			std::stable_sort(victimOrder[i].begin(), victimOrder[i].end(), [](const StealVictim& a, const StealVictim& b) {
+				return a.distance < b.distance;
+			});
 		}
-		return job;
-#endif
 	}
 
-	Job* JobSystem::steal_job(JobQueue& queue, uint32_t& stealId) {
-		uint32_t queueSize = static_cast<uint32_t>(queues.size());
-		uint8_t tries = 0;
-		//Pick a new steal queue until we have a valid one or we ran out of other queues to steal from.
-		//A queue is invalid if it's the last one we stole from (tries == 0), or it's this thread's queue
-		while (tries == 0 || &queue == queues[stealId]) {
-			stealId = (stealId + 1) % queueSize;
-			++tries;
-			if (tries > queueSize) {
-				return nullptr;
+	Job* JobSystem::steal_job(uint32_t index, uint32_t priority, uint32_t& stealId) {
+		std::vector<StealVictim>& victims = victimOrder[index];
+		uint32_t victimCount = static_cast<uint32_t>(victims.size());
+		//Whoever we last stole from goes first since they probably have more, then everyone else closest first
+		for (uint32_t i = 0; i <= victimCount; i++) {
+			uint32_t position = i == 0 ? stealId : i - 1;
+			if (position >= victimCount || (i > 0 && position == stealId)) {
+				continue;
 			}
-		}
-		JobQueue& stealQueue = *queues[stealId];
-		
-#ifndef LOCK_FREE
-		Job* job = nullptr;
-		stealQueue.queueLock.lock();
-		int64_t bottom = stealQueue.bottom.load(std::memory_order_relaxed);
-		if (bottom > 0) {
-			stealQueue.bottom.store(bottom - 1, std::memory_order_relaxed);
-			job = stealQueue.jobs[(bottom - 1) & queueSizeMask];
-		}
-		stealQueue.queueLock.unlock();
-		return job;
-#else
-		int64_t top = stealQueue.top.load(std::memory_order_relaxed);
-		std::atomic_thread_fence(std::memory_order_seq_cst);
-		int64_t bottom = stealQueue.bottom.load(std::memory_order_acquire);
-		Job* job = nullptr;
-		if (top < bottom) {
-			job = stealQueue.jobs[top & queueSizeMask];
-			if (!stealQueue.top.compare_exchange_strong(top, top+1, std::memory_order_relaxed, std::memory_order_relaxed)) {
-				job = nullptr;
+			JobQueue& victim = *queues[priority][victims[position].worker];
+			//Most queues are empty most of the time, a couple of relaxed loads is a lot cheaper than the fence in steal
+			if (victim.depth() == 0) {
+				continue;
+			}
+			Job* job = victim.steal();
+			if (job) {
+				stealId = position;
+				add_to_counter(workerCounters[index].stealsByDistance[victims[position].distance], 1);
+				return job;
 			}
 		}
-		return job;
-#endif
+		return nullptr;
 	}
 
 
 	Job* JobSystem::getJob(uint32_t index) {
-		JobQueue& queue = *queues[index];
-		Job* job = pop_job(queue);
-		if (job && !job->currentTask) {
-			std::cout << "Failed, no current task in gj 1!" << std::endl;
-		}
-		if (!job) {
-			job = steal_job(queue, threadData->stealId);
+		Job* job = pop_frame_lane();
+		for (uint32_t priority = 0; !job && priority < JOB_PRIORITY_QUEUE_COUNT; priority++) {
+			job = pop_job(*queues[priority][index]);
 			if (job && !job->currentTask) {
-				std::cout << "Failed, no current task in gj 2!" << std::endl;
+				std::cout << "Failed, no current task in gj 1!" << std::endl;
+			}
+			if (!job) {
+				//Someone else's high priority job beats our own lower priority ones
+				job = steal_job(index, priority, threadData->stealId);
+				if (job && !job->currentTask) {
+					std::cout << "Failed, no current task in gj 2!" << std::endl;
+				}
+				add_to_counter(job ? workerCounters[index].stealsSucceeded : workerCounters[index].stealsFailed, 1);
 			}
 		}
 		return job;
 	}
 
-	Job* JobSystem::acquire_job() {
-#ifndef LOCK_FREE
+	void JobSystem::note_queue_depth(uint32_t index) {
+		uint64_t depth = 0;
+		for (uint32_t priority = 0; priority < JOB_PRIORITY_QUEUE_COUNT; priority++) {
+			depth += queues[priority][index]->depth();
+		}
+		std::atomic<uint64_t>& maxDepth = workerCounters[index].maxQueueDepth;
+		if (depth > maxDepth.load(std::memory_order_relaxed)) {
+			maxDepth.store(depth, std::memory_order_relaxed);
+		}
+	}
+
+	Job* JobSystem::acquire_job(JobStackClass stackClass) {
+		SPIN_LOCK(jobPoolLock);
 		Job* job = nullptr;
-		jobPoolLock.lock();
-		uint32_t read = jobPoolReadIdx.fetch_add(1, std::memory_order_relaxed);
-		job = jobPool[read];
-		jobPoolLock.unlock();
-		return job;
-#else
-		while (true) {
-			uint32_t read = jobPoolReadIdx.load(std::memory_order_relaxed);
-			//Make sure these reads are ordered correctly. There's a slight chance for read to be greater than maxRead otherwise.
-			std::atomic_thread_fence(std::memory_order_seq_cst);
-			uint32_t maxRead = jobPoolMaxReadIdx.load(std::memory_order_relaxed);
-			if (read == maxRead) {
-				continue;
-			}
-			if (jobPoolReadIdx.compare_exchange_weak(read, (read + 1) & queueSizeMask, std::memory_order_acquire, std::memory_order_relaxed)) {
-				return jobPool[read];
-			}
+		std::vector<Job*>& pool = jobPool[stackClass];
+		if (pool.empty()) {
+			job = new Job(this, stackClass);
+			allJobs.push_back(job);
+		} else {
+			job = pool.back();
+			pool.pop_back();
 		}
-#endif
+		uint32_t inUse = ++jobsInUse[stackClass];
+		jobsHighWater[stackClass] = std::max(jobsHighWater[stackClass], inUse);
+		return job;
 	}
 
 	void JobSystem::release_job(Job* job) {
-#ifndef LOCK_FREE
-		jobPoolLock.lock();
-		uint32_t read = jobPoolReadIdx.fetch_add(-1, std::memory_order_relaxed)-1;
-		jobPool[read] = job;
-		jobPoolLock.unlock();
-#else
-		while (true) {
-			uint32_t write = jobPoolWriteIdx.load(std::memory_order_relaxed);
-			uint32_t desired = (write + 1) & queueSizeMask;
-			if (jobPoolWriteIdx.compare_exchange_weak(write, desired, std::memory_order_relaxed, std::memory_order_relaxed)) {
-				jobPool[desired] = job;
-				std::atomic_thread_fence(std::memory_order_release);
-				while (!jobPoolMaxReadIdx.compare_exchange_weak(write, (write + 1) & queueSizeMask, std::memory_order_relaxed, std::memory_order_relaxed)) {
-				}
-				return;
+		SPIN_LOCK(jobPoolLock);
+		--jobsInUse[job->stackClass];
+		jobPool[job->stackClass].push_back(job);
+	}
+
+	JobCounter* JobSystem::acquire_counter(int32_t count) {
+		JobCounter* counter = nullptr;
+		{
+			SPIN_LOCK(counterPoolLock);
+			if (counterPool.empty()) {
+				counter = new JobCounter(nullptr, 0);
+				allCounters.push_back(counter);
+			} else {
+				counter = counterPool.back();
+				counterPool.pop_back();
 			}
 		}
-#endif
+		counter->job = nullptr;
+		counter->counter.store(count, std::memory_order_relaxed);
+		return counter;
 	}
 
-	
+	void JobSystem::release_counter(JobCounter* counter) {
+		SPIN_LOCK(counterPoolLock);
+		counterPool.push_back(counter);
+	}
 
-	void JobSystem::start_jobs_and_wait_for_counter(JobDecl* jobs, uint32_t jobCount) {
-		JobThreadData& localData = *threadData;
-		Job* job = localData.currentJob;
-		JobCounter count(job, jobCount);
+	const CpuTopology& JobSystem::cpu_topology() {
+		return topology;
+	}
+
+	JobPoolStats JobSystem::pool_stats() {
+		JobPoolStats stats{};
+		SPIN_LOCK(jobPoolLock);
+		for (uint8_t stack = 0; stack < JOB_STACK_CLASS_COUNT; stack++) {
+			stats.inUse[stack] = jobsInUse[stack];
+			stats.highWater[stack] = jobsHighWater[stack];
+		}
+		for (Job* job : allJobs) {
+			++stats.allocated[job->stackClass];
+			stats.maxCommittedStack[job->stackClass] = std::max(stats.maxCommittedStack[job->stackClass], committed_stack_bytes(*job));
+		}
+		return stats;
+	}
 
-		Job** jobArray = reinterpret_cast<Job**>(alloca(jobCount * sizeof(Job*)));
+	
 
+	void JobSystem::start_jobs_and_wait_for_counter(JobDecl* jobs, uint32_t jobCount) {
+		JobCounter count(threadData->currentJob, jobCount);
+		//Still alive when the worker pushes these after we've switched out, the scope doesn't end until this job resumes
+		ScopedScratch scratch;
+		Job** jobArray = scratch.alloc_array<Job*>(jobCount);
 		for (uint32_t i = 0; i < jobCount; i++) {
-			Job* newJob = acquire_job();
-			newJob->currentTask = &jobs[i];
 			jobs[i].counter = &count;
-			jobArray[i] = newJob;
-			activeJobCount.fetch_add(1, std::memory_order_relaxed);
+			jobArray[i] = acquire_job_for(jobs[i]);
+		}
+		suspend_and_start(jobArray, jobCount);
+	}
+
+	void JobSystem::start_jobs_and_suspend(JobDecl* const* jobs, uint32_t jobCount) {
+		ScopedScratch scratch;
+		Job** jobArray = scratch.alloc_array<Job*>(jobCount);
+		for (uint32_t i = 0; i < jobCount; i++) {
+			jobArray[i] = acquire_job_for(*jobs[i]);
 		}
+		suspend_and_start(jobArray, jobCount);
+	}
+
+	Job* JobSystem::acquire_job_for(JobDecl& decl) {
+		Job* newJob = acquire_job(decl.stackClass);
+		newJob->currentTask = &decl;
+		activeJobCount.fetch_add(1, std::memory_order_relaxed);
+		return newJob;
+	}
+
+	void JobSystem::suspend_and_start(Job** jobArray, uint32_t jobCount) {
+		JobThreadData& localData = *threadData;
+		Job* job = localData.currentJob;
 		localData.newJobsToAdd = jobArray;
 		localData.newJobsToAddCount = jobCount;
 		job->state = SUSPENDED;
+		asan_switch_to_worker(*job, false);
 		swap_registers(job->ctx, localData.threadCtx);
+		asan_back_in_job(*job);
 	}
 
 	void JobSystem::yield_job() {
 		JobThreadData& localData = *threadData;
 		Job* job = localData.currentJob;
-		//Spinning on a load store should be ok here since this lightweight lock is only held for a tiny amount of time
-		push_job(*queues[localData.threadId], *job);
+		//Only requeue once we've switched off this job, otherwise another thread could steal it before its context is saved
 		localData.newJobsToAdd = &job;
 		localData.newJobsToAddCount = 1;
 		job->state = SUSPENDED;
+		asan_switch_to_worker(*job, false);
 		swap_registers(job->ctx, localData.threadCtx);
+		asan_back_in_job(*job);
 	}
 
 	void JobSystem::start_job(JobDecl& decl) {
@@ -440,10 +1085,242 @@ namespace job {
 	}
 
 	void JobSystem::start_job(JobDecl& decl, uint32_t tid) {
-		Job* job = acquire_job();
+		Job* job = acquire_job(decl.stackClass);
 		job->currentTask = &decl;
-		push_job(*queues[tid], *job);
+		//Counted before it's pushed, otherwise it could finish first and make is_done true for a moment
+		activeJobCount.fetch_add(1, std::memory_order_relaxed);
+		push_job(tid, *job);
+	}
+
+	std::vector<WorkerStats> JobSystem::worker_stats() {
+		std::vector<WorkerStats> stats(threadpool.size());
+		for (uint32_t i = 0; i < stats.size(); i++) {
+			WorkerCounters& counters = workerCounters[i];
+			stats[i].jobsExecuted = counters.jobsExecuted.load(std::memory_order_relaxed);
+			stats[i].stealsSucceeded = counters.stealsSucceeded.load(std::memory_order_relaxed);
+			stats[i].stealsFailed = counters.stealsFailed.load(std::memory_order_relaxed);
+			stats[i].parkedNanoseconds = counters.parkedNanoseconds.load(std::memory_order_relaxed);
+			stats[i].busyNanoseconds = counters.busyNanoseconds.load(std::memory_order_relaxed);
+			stats[i].maxQueueDepth = counters.maxQueueDepth.load(std::memory_order_relaxed);
+			stats[i].suspends = counters.suspends.load(std::memory_order_relaxed);
+			stats[i].resumes = counters.resumes.load(std::memory_order_relaxed);
+			for (uint32_t distance = 0; distance < TOPOLOGY_DISTANCE_COUNT; distance++) {
+				stats[i].stealsByDistance[distance] = counters.stealsByDistance[distance].load(std::memory_order_relaxed);
+			}
+		}
+		return stats;
+	}
+
+	void JobSystem::emit_profile_counters() {
+#if PROFILING_ENABLE
+		std::vector<WorkerStats> stats = worker_stats();
+		for (uint32_t i = 0; i < stats.size(); i++) {
+			//Trace counters are per process, so the worker goes in the name to get a track each
+			std::string worker = "Worker " + std::to_string(i) + " ";
+			profiling::counter(worker + "jobs executed", stats[i].jobsExecuted);
+			profiling::counter(worker + "steals", stats[i].stealsSucceeded);
+			profiling::counter(worker + "failed steals", stats[i].stealsFailed);
+			profiling::counter(worker + "parked ms", stats[i].parkedNanoseconds / 1000000);
+			profiling::counter(worker + "busy ms", stats[i].busyNanoseconds / 1000000);
+			profiling::counter(worker + "max queue depth", stats[i].maxQueueDepth);
+			profiling::counter(worker + "suspends", stats[i].suspends);
+			profiling::counter(worker + "resumes", stats[i].resumes);
+			profiling::counter(worker + "shared cache steals", stats[i].stealsByDistance[TOPOLOGY_SAME_CORE] + stats[i].stealsByDistance[TOPOLOGY_SHARED_CACHE]);
+			profiling::counter(worker + "same node steals", stats[i].stealsByDistance[TOPOLOGY_SAME_NODE]);
+			profiling::counter(worker + "remote steals", stats[i].stealsByDistance[TOPOLOGY_REMOTE]);
+		}
+#endif
+	}
+
+	JobHandle JobSystem::start_jobs(JobDecl* jobs, uint32_t jobCount) {
+		//One extra count that only the waiter releases, so the counter can't hit zero and resume nobody before someone waits on it
+		JobCounter* counter = acquire_counter(static_cast<int32_t>(jobCount) + 1);
+		uint32_t tid = threadData ? threadData->threadId : 0;
+		for (uint32_t i = 0; i < jobCount; i++) {
+			jobs[i].counter = counter;
+			start_job(jobs[i], tid);
+		}
+		return JobHandle{ counter };
+	}
+
+	void JobSystem::wait_for(JobHandle& handle) {
+		JobCounter* counter = handle.counter;
+		if (!counter) {
+			return;
+		}
+		if (!is_complete(handle)) {
+			if (in_job()) {
+				JobThreadData& localData = *threadData;
+				Job* job = localData.currentJob;
+				counter->job = job;
+				localData.counterToRelease = counter;
+				job->state = SUSPENDED;
+				asan_switch_to_worker(*job, false);
+				swap_registers(job->ctx, localData.threadCtx);
+				asan_back_in_job(*job);
+			} else {
+				while (!is_complete(handle)) {
+					std::this_thread::yield();
+				}
+			}
+		}
+		release_handle(handle);
+	}
+
+	JobHandle JobSystem::make_handle(uint32_t pendingCount) {
+		return JobHandle{ acquire_counter(static_cast<int32_t>(pendingCount) + 1) };
+	}
+
+	void JobSystem::complete(const JobHandle& handle) {
+		handle.counter->decrement();
+	}
+
+	void JobSystem::start_when_complete(JobHandle& handle, JobDecl& resumeDecl) {
+		Job* job = acquire_job(resumeDecl.stackClass);
+		job->currentTask = &resumeDecl;
 		activeJobCount.fetch_add(1, std::memory_order_relaxed);
+		handle.counter->job = job;
+		//Same extra count wait_for drops, if everything already finished this pushes the job straight away
+		handle.counter->decrement();
+	}
+
+	void JobSystem::release_handle(JobHandle& handle) {
+		if (handle.counter) {
+			release_counter(handle.counter);
+			handle.counter = nullptr;
+		}
+	}
+
+	bool JobSystem::is_complete(const JobHandle& handle) {
+		//Only the waiter's extra count left, or it's already been released and the waiter resumed
+		return !handle.counter || handle.counter->counter.load(std::memory_order_acquire) <= 1;
+	}
+
+	TaskGraph::~TaskGraph() {
+		clear();
+	}
+
+	uint32_t TaskGraph::add_node(JobDecl decl) {
+		Node* node = new Node{};
+		node->graph = this;
+		node->decl = decl;
+		node->runDecl = JobDecl(run_node, node, decl.stackClass, decl.priority);
+		node->predecessorCount = 0;
+		nodes.push_back(node);
+		validated = false;
+		return static_cast<uint32_t>(nodes.size() - 1);
+	}
+
+	void TaskGraph::add_dependency(uint32_t before, uint32_t after) {
+		assert(before < nodes.size() && after < nodes.size() && before != after);
+		nodes[before]->successors.push_back(after);
+		nodes[after]->predecessorCount++;
+		validated = false;
+	}
+
+	void TaskGraph::clear() {
+		for (Node* node : nodes) {
+			delete node;
+		}
+		nodes.clear();
+		roots.clear();
+		validated = false;
+	}
+
+	void TaskGraph::validate() {
+		roots.clear();
+		//Kahn's algorithm, just to make sure every node is reachable from a root. A cycle would leave the waiting job suspended forever.
+		std::vector<uint32_t> remaining(nodes.size());
+		std::vector<uint32_t> ready;
+		for (uint32_t i = 0; i < nodes.size(); i++) {
+			remaining[i] = nodes[i]->predecessorCount;
+			if (remaining[i] == 0) {
+				roots.push_back(&nodes[i]->runDecl);
+				ready.push_back(i);
+			}
+		}
+		uint32_t visited = 0;
+		while (!ready.empty()) {
+			uint32_t idx = ready.back();
+			ready.pop_back();
+			visited++;
+			for (uint32_t successor : nodes[idx]->successors) {
+				if (--remaining[successor] == 0) {
+					ready.push_back(successor);
+				}
+			}
+		}
+		if (visited != nodes.size()) {
+			throw std::runtime_error("Task graph has a cycle!");
+		}
+		validated = true;
+	}
+
+	void TaskGraph::run(JobSystem& jobSystem) {
+		if (nodes.empty()) {
+			return;
+		}
+		if (!validated) {
+			validate();
+		}
+		system = &jobSystem;
+		JobCounter done(threadData->currentJob, static_cast<int32_t>(nodes.size()));
+		for (Node* node : nodes) {
+			node->remaining.store(node->predecessorCount, std::memory_order_relaxed);
+			node->runDecl.counter = &done;
+		}
+		jobSystem.start_jobs_and_suspend(roots.data(), static_cast<uint32_t>(roots.size()));
+	}
+
+	void TaskGraph::run_node(void* arg) {
+		Node* node = reinterpret_cast<Node*>(arg);
+		node->decl.func(node->decl.arg);
+		TaskGraph* graph = node->graph;
+		for (uint32_t successorIdx : node->successors) {
+			Node* successor = graph->nodes[successorIdx];
+			//The last predecessor to finish starts the successor, nothing has to suspend to wait for it
+			if (successor->remaining.fetch_add(-1, std::memory_order_acq_rel) == 1) {
+				graph->system->start_job(successor->runDecl);
+			}
+		}
+	}
+
+
+
+	bool JobSystem::in_job() {
+		return threadData && threadData->currentJob;
+	}
+
+	JobPriority JobSystem::current_priority() {
+		if (!in_job()) {
+			return JOB_PRIORITY_NORMAL;
+		}
+		return threadData->currentJob->currentTask->priority;
+	}
+
+	uint32_t JobSystem::grain_size(uint32_t count, uint32_t minGrain) {
+		//Around 8 chunks per worker
+		uint32_t chunks = std::max(static_cast<uint32_t>(threadpool.size()), 1u) * 8;
+		return std::max((count + chunks - 1) / chunks, std::max(minGrain, 1u));
+	}
+
+	void JobSystem::set_spin_budget(uint32_t failedAttempts) {
+		spinBudget.store(failedAttempts, std::memory_order_relaxed);
+	}
+
+	void JobSystem::suspend_job_and_unlock(SpinLock& waitListLock) {
+		JobThreadData& localData = *threadData;
+		Job* job = localData.currentJob;
+		localData.lockToRelease = &waitListLock;
+		job->state = SUSPENDED;
+		asan_switch_to_worker(*job, false);
+		swap_registers(job->ctx, localData.threadCtx);
+		asan_back_in_job(*job);
+	}
+
+	void JobSystem::resume_job(Job* job) {
+		//Goes on this thread's queue if we're a worker, otherwise through the first worker's inbox
+		push_job(threadData ? threadData->threadId : 0, *job);
 	}
 
 	uint16_t JobSystem::thread_count() {
@@ -453,6 +1330,305 @@ namespace job {
 	bool JobSystem::is_done() {
 		return activeJobCount.load(std::memory_order_relaxed) == 0;
 	}
+
+	void JobWaitList::push(Job* job) {
+		job->nextWaiter = nullptr;
+		if (tail) {
+			tail->nextWaiter = job;
+		} else {
+			head = job;
+		}
+		tail = job;
+	}
+
+	Job* JobWaitList::pop() {
+		Job* job = head;
+		if (job) {
+			head = job->nextWaiter;
+			if (!head) {
+				tail = nullptr;
+			}
+			job->nextWaiter = nullptr;
+		}
+		return job;
+	}
+
+	static bool can_suspend() {
+		return threadData && threadData->currentJob;
+	}
+
+	//Suspends the current job, which must already be on a wait list guarded by waitLock
+	static void suspend_current(SpinLock& waitLock) {
+		threadData->currentJob->system->suspend_job_and_unlock(waitLock);
+	}
+
+	static void resume(Job* job) {
+		job->system->resume_job(job);
+	}
+
+	//All the primitives use the same handshake. A waiter bumps waiterCount before its last try, and a releaser publishes the release before checking waiterCount.
+	//Both are seq_cst, so either the waiter's last try succeeds or the releaser sees it and goes through the wait list.
+
+	bool JobMutex::try_lock() {
+		return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+	}
+
+	void JobMutex::lock() {
+		for (uint32_t i = 0; i < JOB_LOCK_SPIN_COUNT; i++) {
+			if (try_lock()) {
+				return;
+			}
+			cpu_relax();
+		}
+		if (!can_suspend()) {
+			while (!try_lock()) {
+				std::this_thread::yield();
+			}
+			return;
+		}
+		waitLock.lock();
+		waiterCount.fetch_add(1, std::memory_order_seq_cst);
+		if (try_lock()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			waitLock.unlock();
+			return;
+		}
+		waiters.push(threadData->currentJob);
+		suspend_current(waitLock);
+		//The lock was taken on our behalf before we were resumed
+	}
+
+	void JobMutex::unlock() {
+		locked.store(false, std::memory_order_seq_cst);
+		if (waiterCount.load(std::memory_order_seq_cst) == 0) {
+			return;
+		}
+		SPIN_LOCK(waitLock);
+		//If this fails someone else got it first, and their unlock will hand it off instead
+		if (!waiters.empty() && try_lock()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			resume(waiters.pop());
+		}
+	}
+
+
+
+	bool JobRWLock::try_lock_read() {
+		if (writersWaiting.load(std::memory_order_seq_cst) > 0) {
+			return false;
+		}
+		int32_t current = state.load(std::memory_order_relaxed);
+		return current >= 0 && state.compare_exchange_strong(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	bool JobRWLock::try_lock_write() {
+		int32_t expected = 0;
+		return state.compare_exchange_strong(expected, -1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void JobRWLock::lock_read() {
+		for (uint32_t i = 0; i < JOB_LOCK_SPIN_COUNT; i++) {
+			if (try_lock_read()) {
+				return;
+			}
+			cpu_relax();
+		}
+		if (!can_suspend()) {
+			while (!try_lock_read()) {
+				std::this_thread::yield();
+			}
+			return;
+		}
+		waitLock.lock();
+		waiterCount.fetch_add(1, std::memory_order_seq_cst);
+		//Queue behind waiting writers instead of sneaking in ahead of them
+		if (writeWaiters.empty() && try_lock_read()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			waitLock.unlock();
+			return;
+		}
+		readWaiters.push(threadData->currentJob);
+		suspend_current(waitLock);
+	}
+
+	void JobRWLock::lock_write() {
+		if (try_lock_write()) {
+			return;
+		}
+		//Holds off new readers until this writer is in. Whoever lets it in, it or wake_waiters, takes the count back off.
+		writersWaiting.fetch_add(1, std::memory_order_seq_cst);
+		for (uint32_t i = 0; i < JOB_LOCK_SPIN_COUNT; i++) {
+			if (try_lock_write()) {
+				writersWaiting.fetch_add(-1, std::memory_order_seq_cst);
+				return;
+			}
+			cpu_relax();
+		}
+		if (!can_suspend()) {
+			while (!try_lock_write()) {
+				std::this_thread::yield();
+			}
+			writersWaiting.fetch_add(-1, std::memory_order_seq_cst);
+			return;
+		}
+		waitLock.lock();
+		waiterCount.fetch_add(1, std::memory_order_seq_cst);
+		if (try_lock_write()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			writersWaiting.fetch_add(-1, std::memory_order_seq_cst);
+			waitLock.unlock();
+			return;
+		}
+		writeWaiters.push(threadData->currentJob);
+		suspend_current(waitLock);
+	}
+
+	void JobRWLock::unlock_read() {
+		int32_t previous = state.fetch_add(-1, std::memory_order_seq_cst);
+		if (previous == 1 && waiterCount.load(std::memory_order_seq_cst) > 0) {
+			wake_waiters();
+		}
+	}
+
+	void JobRWLock::unlock_write() {
+		state.store(0, std::memory_order_seq_cst);
+		if (waiterCount.load(std::memory_order_seq_cst) > 0) {
+			wake_waiters();
+		}
+	}
+
+	void JobRWLock::wake_waiters() {
+		SPIN_LOCK(waitLock);
+		if (!writeWaiters.empty()) {
+			if (try_lock_write()) {
+				waiterCount.fetch_add(-1, std::memory_order_relaxed);
+				writersWaiting.fetch_add(-1, std::memory_order_seq_cst);
+				resume(writeWaiters.pop());
+			}
+			//Otherwise whoever holds it now will wake the writer when they're done
+			return;
+		}
+		while (!readWaiters.empty() && try_lock_read()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			resume(readWaiters.pop());
+		}
+	}
+
+
+
+	JobEvent::JobEvent(bool autoReset, bool initiallySet) {
+		this->autoReset = autoReset;
+		signaled.store(initiallySet, std::memory_order_relaxed);
+	}
+
+	bool JobEvent::try_consume() {
+		if (autoReset) {
+			bool expected = true;
+			return signaled.compare_exchange_strong(expected, false, std::memory_order_acquire, std::memory_order_relaxed);
+		}
+		return signaled.load(std::memory_order_acquire);
+	}
+
+	void JobEvent::wait() {
+		for (uint32_t i = 0; i < JOB_LOCK_SPIN_COUNT; i++) {
+			if (try_consume()) {
+				return;
+			}
+			cpu_relax();
+		}
+		if (!can_suspend()) {
+			while (!try_consume()) {
+				std::this_thread::yield();
+			}
+			return;
+		}
+		//Set always takes the wait lock, so checking under it is enough to not miss one
+		waitLock.lock();
+		if (try_consume()) {
+			waitLock.unlock();
+			return;
+		}
+		waiters.push(threadData->currentJob);
+		suspend_current(waitLock);
+	}
+
+	void JobEvent::set() {
+		SPIN_LOCK(waitLock);
+		if (autoReset) {
+			Job* waiter = waiters.pop();
+			if (waiter) {
+				//Handing the signal straight to a waiter consumes it
+				resume(waiter);
+			} else {
+				signaled.store(true, std::memory_order_release);
+			}
+		} else {
+			signaled.store(true, std::memory_order_release);
+			while (Job* waiter = waiters.pop()) {
+				resume(waiter);
+			}
+		}
+	}
+
+	void JobEvent::reset() {
+		signaled.store(false, std::memory_order_relaxed);
+	}
+
+	bool JobEvent::is_set() {
+		return signaled.load(std::memory_order_acquire);
+	}
+
+
+
+	JobSemaphore::JobSemaphore(int32_t initialCount) {
+		count.store(initialCount, std::memory_order_relaxed);
+	}
+
+	bool JobSemaphore::try_acquire() {
+		int32_t current = count.load(std::memory_order_relaxed);
+		while (current > 0) {
+			if (count.compare_exchange_weak(current, current - 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void JobSemaphore::acquire() {
+		for (uint32_t i = 0; i < JOB_LOCK_SPIN_COUNT; i++) {
+			if (try_acquire()) {
+				return;
+			}
+			cpu_relax();
+		}
+		if (!can_suspend()) {
+			while (!try_acquire()) {
+				std::this_thread::yield();
+			}
+			return;
+		}
+		waitLock.lock();
+		waiterCount.fetch_add(1, std::memory_order_seq_cst);
+		if (try_acquire()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			waitLock.unlock();
+			return;
+		}
+		waiters.push(threadData->currentJob);
+		suspend_current(waitLock);
+	}
+
+	void JobSemaphore::release(int32_t releaseCount) {
+		count.fetch_add(releaseCount, std::memory_order_seq_cst);
+		if (waiterCount.load(std::memory_order_seq_cst) == 0) {
+			return;
+		}
+		SPIN_LOCK(waitLock);
+		while (!waiters.empty() && try_acquire()) {
+			waiterCount.fetch_add(-1, std::memory_order_relaxed);
+			resume(waiters.pop());
+		}
+	}
 }
 
 //#pragma optimize("", on)
\ No newline at end of file
@@ -1,11 +1,23 @@
 #pragma once
 
+#if defined(_M_X64) || defined(__x86_64__)
 #include <emmintrin.h>
+#endif
 #include <vector>
 #include <atomic>
 #include <thread>
 #include <iostream>
-
+#include <algorithm>
+#include <type_traits>
+#include <deque>
+#include "ScratchAllocator.h"
+#include "CpuTopology.h"
+
+//The context layout has to match the assembly for the platform exactly.
+//Win64 is ContextUtils.asm, System V x86-64 is ContextUtils_sysv_x64.S and AArch64 is ContextUtils_aarch64.S.
+//Each only saves the registers its ABI says are callee saved, everything else is already saved by the caller of the switch.
+#if defined(_WIN64)
+#define CONTEXT_WIN64
 #pragma pack(push, 4)
 struct alignas(16) Context {
 	void* rip, * rsp;
@@ -18,6 +30,57 @@ struct alignas(16) Context {
 	void* fiberData;
 };
 #pragma pack(pop)
+#elif defined(__x86_64__)
+#define CONTEXT_SYSV_X64
+//No xmm registers are callee saved in System V, and there's no TIB, so this is a lot smaller than the Win64 one
+struct alignas(16) Context {
+	void* rip, * rsp;
+	void* rbx, * rbp, * r12, * r13, * r14, * r15;
+	uint32_t mxcsrControlWord, x87fpuControlWord;
+	//Not touched by the assembly, just kept so the job system can track stacks the same way on every platform
+	void* stackBase, * stackLimit, * deallocationStack;
+	uint32_t guaranteedStackBytes;
+	uint32_t padding;
+	void* fiberData;
+};
+#elif defined(__aarch64__)
+#define CONTEXT_AARCH64
+//x19-x29 and the low halves of v8-v15 are callee saved. The link register is where we resume, so it's stored as pc.
+struct alignas(16) Context {
+	void* pc, * sp;
+	void* x19, * x20, * x21, * x22, * x23, * x24, * x25, * x26, * x27, * x28, * fp;
+	uint64_t d8, d9, d10, d11, d12, d13, d14, d15;
+	uint64_t fpcr;
+	//Not touched by the assembly, just kept so the job system can track stacks the same way on every platform
+	void* stackBase, * stackLimit, * deallocationStack;
+	uint32_t guaranteedStackBytes;
+	uint32_t padding;
+	void* fiberData;
+};
+#else
+#error "No fiber context switch implementation for this platform"
+#endif
+
+//AddressSanitizer has to be told about every switch between stacks, see the asan_ functions in JobSystem.cpp
+#if defined(__SANITIZE_ADDRESS__)
+#define JOB_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define JOB_ASAN
+#endif
+#endif
+
+//Hint to the CPU that we're spinning
+inline void cpu_relax() {
+#if defined(_M_X64) || defined(__x86_64__)
+	_mm_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+//Most pauses a lock will spin for in one go before it starts yielding the thread
+const uint32_t SPIN_BACKOFF_LIMIT = 64;
 
 //#pragma optimize("", off)
 
@@ -35,53 +98,171 @@ namespace job {
 
 //Lock a regular full spin lock
 #define SPIN_LOCK(lock) job::RAIISpinLocker spin_locker##__LINE__(&lock);static_assert(true, "")
-//Read lock a reader writer spin lock
+//Read lock a reader writer spin lock, either an RWSpinLock or a DistributedRWLock
 #define RSPIN_LOCK(lock) job::RAIIRSpinLocker spin_locker##__LINE__(&lock);static_assert(true, "")
-//Write lock a reader writer spin lock
+//Write lock a reader writer spin lock, either an RWSpinLock or a DistributedRWLock
 #define WSPIN_LOCK(lock) job::RAIIWSpinLocker spin_locker##__LINE__(&lock);static_assert(true, "")
+//Lock a job mutex, suspending the current job if it's contended
+#define JOB_LOCK(lock) job::RAIIJobLocker job_locker##__LINE__(&lock);static_assert(true, "")
+//Read lock a job reader writer lock
+#define RJOB_LOCK(lock) job::RAIIRJobLocker job_locker##__LINE__(&lock);static_assert(true, "")
+//Write lock a job reader writer lock
+#define WJOB_LOCK(lock) job::RAIIWJobLocker job_locker##__LINE__(&lock);static_assert(true, "")
+
+	//Pauses between failed attempts at a lock, doubling each time until it gives up the time slice instead
+	struct SpinBackoff {
+		uint32_t pauses = 1;
+
+		void pause() {
+			if (pauses <= SPIN_BACKOFF_LIMIT) {
+				for (uint32_t i = 0; i < pauses; i++) {
+					cpu_relax();
+				}
+				pauses <<= 1;
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	};
+
+	//Contention numbers for one lock, only collected once the lock is given a name with track_stats
+	struct LockStats {
+		const char* name;
+		std::atomic<uint64_t> acquisitions{ 0 };
+		//Acquisitions that had to wait at all
+		std::atomic<uint64_t> contended{ 0 };
+		//Backoff rounds spent waiting
+		std::atomic<uint64_t> spins{ 0 };
+		//Longest single hold. Exclusive is the spin lock or a writer, shared is one reader of the reader writer lock.
+		std::atomic<uint64_t> maxHoldNanoseconds{ 0 };
+		std::atomic<uint64_t> maxSharedHoldNanoseconds{ 0 };
+
+		//Hold times are kept per holder on the holder's thread, so readers holding at once and locks sharing stats don't trip over each other
+		void record_acquire(uint32_t spinCount);
+		void record_release(bool exclusive);
+	};
+
+	struct LockStatsSnapshot {
+		const char* name;
+		uint64_t acquisitions;
+		uint64_t contended;
+		uint64_t spins;
+		uint64_t maxHoldNanoseconds;
+		uint64_t maxSharedHoldNanoseconds;
+	};
+
+	//Stats live until exit, since locks are often destroyed late or never.
+	//Locks registered under the same name, like the same member of every instance of a class, share one set of stats.
+	LockStats* register_lock_stats(const char* name);
+	std::vector<LockStatsSnapshot> lock_stats();
+	//Prints every tracked lock, most contended first
+	void dump_lock_stats();
 
 	class RWSpinLock {
 	private:
 		std::atomic<int32_t> lockCount;
+		//Writers waiting for the lock. When writers are preferred new readers hold off while this is non zero.
+		std::atomic<int32_t> waitingWriters;
+		bool preferWriters;
+		LockStats* stats = nullptr;
 	public:
-		RWSpinLock() {
+		RWSpinLock(bool preferWriters = false) : preferWriters{ preferWriters } {
 			lockCount = 0;
+			waitingWriters = 0;
+		}
+
+		void track_stats(const char* name) {
+			stats = register_lock_stats(name);
 		}
 
 		void lock_read() {
+			SpinBackoff backoff{};
+			uint32_t spinCount = 0;
 			while (true) {
 				int32_t lock = lockCount.load(std::memory_order_relaxed);
-				if (lock != -1 && lockCount.compare_exchange_strong(lock, lock + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+				if (lock != -1 && !(preferWriters && waitingWriters.load(std::memory_order_relaxed) > 0) &&
+					lockCount.compare_exchange_strong(lock, lock + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
 					break;
 				}
-				while (lockCount.load(std::memory_order_relaxed) == -1);
+				backoff.pause();
+				spinCount++;
+			}
+			if (stats) {
+				stats->record_acquire(spinCount);
 			}
 		}
 
 		void lock_write() {
+			SpinBackoff backoff{};
+			uint32_t spinCount = 0;
+			waitingWriters.fetch_add(1, std::memory_order_relaxed);
 			while (true) {
 				int32_t val = 0;
-				if (lockCount.compare_exchange_strong(val, -1, std::memory_order_acquire, std::memory_order_relaxed)) {
+				if (lockCount.load(std::memory_order_relaxed) == 0 && lockCount.compare_exchange_strong(val, -1, std::memory_order_acquire, std::memory_order_relaxed)) {
 					break;
 				}
-				while (lockCount.load(std::memory_order_relaxed) != 0);
+				backoff.pause();
+				spinCount++;
+			}
+			waitingWriters.fetch_add(-1, std::memory_order_relaxed);
+			if (stats) {
+				stats->record_acquire(spinCount);
 			}
 		}
 
 		void unlock_read() {
 			//Assumes you have already established a read lock
-			lockCount.fetch_add(-1, std::memory_order_relaxed);
+			if (stats) {
+				stats->record_release(false);
+			}
+			lockCount.fetch_add(-1, std::memory_order_release);
 		}
 
 		void unlock_write() {
 			//Assumes you have already established a write lock
+			if (stats) {
+				stats->record_release(true);
+			}
 			lockCount.store(0, std::memory_order_release);
 		}
 	};
 
+	class JobSystem;
+
+	//Reader writer lock for data that's read from lots of jobs at once and rarely written. Each worker counts its readers
+	//in its own cache line so readers never bounce a shared line around, writers pay for it by sweeping every slot.
+	//Writers always win, new readers back off as soon as one shows up.
+	class DistributedRWLock {
+	private:
+		struct alignas(64) ReaderSlot {
+			std::atomic<int32_t> readers{ 0 };
+		};
+		//One per worker plus a last one shared by every thread that isn't a worker, or is past the end
+		ReaderSlot* slots;
+		uint32_t slotCount;
+		alignas(64) std::atomic<bool> writer{ false };
+
+		ReaderSlot& local_slot();
+	public:
+		//workerCount has to match the job system whose workers will be reading, past it they all share the last slot
+		DistributedRWLock(uint32_t workerCount);
+		//Takes the worker count from the job system, so it has to be initialized already
+		DistributedRWLock(JobSystem& jobSystem);
+		DistributedRWLock(const DistributedRWLock&) = delete;
+		DistributedRWLock& operator=(const DistributedRWLock&) = delete;
+		~DistributedRWLock();
+
+		void lock_read();
+		void lock_write();
+		//A job that suspends while reading can resume on another worker and unlock from a different slot, which is fine since writers only look at the total
+		void unlock_read();
+		void unlock_write();
+	};
+
 	class SpinLock {
 	private:
 		std::atomic<bool> locked;
+		LockStats* stats = nullptr;
 	public:
 		SpinLock() {
 			locked.store(false, std::memory_order_relaxed);
@@ -89,25 +270,41 @@ namespace job {
 		~SpinLock() {
 		}
 
+		void track_stats(const char* name) {
+			stats = register_lock_stats(name);
+		}
+
 		void lock() {
+			SpinBackoff backoff{};
+			uint32_t spinCount = 0;
 			while (true) {
 				if (!locked.exchange(true, std::memory_order_acquire)) {
 					break;
 				}
-				while (locked.load(std::memory_order_relaxed));
+				while (locked.load(std::memory_order_relaxed)) {
+					backoff.pause();
+					spinCount++;
+				}
+			}
+			if (stats) {
+				stats->record_acquire(spinCount);
 			}
 		}
 
 		void unlock() {
+			if (stats) {
+				stats->record_release(true);
+			}
 			locked.store(false, std::memory_order_release);
 		}
 	};
 
+	template<typename Lock>
 	class RAIIRSpinLocker {
 	private:
-		RWSpinLock* lock;
+		Lock* lock;
 	public:
-		RAIIRSpinLocker(RWSpinLock* lock) {
+		RAIIRSpinLocker(Lock* lock) {
 			this->lock = lock;
 			lock->lock_read();
 		}
@@ -116,11 +313,12 @@ namespace job {
 		}
 	};
 
+	template<typename Lock>
 	class RAIIWSpinLocker {
 	private:
-		RWSpinLock* lock;
+		Lock* lock;
 	public:
-		RAIIWSpinLocker(RWSpinLock* lock) {
+		RAIIWSpinLocker(Lock* lock) {
 			this->lock = lock;
 			lock->lock_write();
 		}
@@ -142,21 +340,70 @@ namespace job {
 		}
 	};
 
-	const uint32_t JOB_STACK_SIZE = 128 * 1024;
+	//Lets idle workers sleep on a futex until new work shows up.
+	//A waiter calls prepare_wait, checks for work one last time, then waits on the returned key. Any notify in between changes the epoch, so the wakeup can't be missed.
+	class EventCount {
+	private:
+		std::atomic<uint32_t> epoch{ 0 };
+		std::atomic<uint32_t> waiters{ 0 };
+	public:
+		uint32_t prepare_wait();
+		void cancel_wait();
+		void wait(uint32_t key);
+		void notify(uint32_t count);
+		void notify_all();
+	};
+
+	//How many times a worker will fail to find a job before it parks
+	const uint32_t DEFAULT_SPIN_BUDGET = 64;
+
+	//Stacks are only reserved up front, pages get committed as the job actually touches them, so large stacks are cheap until they're used
+	enum JobStackClass : uint8_t {
+		//For leaf jobs that don't recurse or keep big arrays on the stack
+		JOB_STACK_SMALL,
+		JOB_STACK_LARGE,
+		//No stack at all, the job runs straight on the worker's own stack and can't suspend. Used to resume coroutines, which keep their state in their frame.
+		JOB_STACK_NONE,
+		JOB_STACK_CLASS_COUNT
+	};
+	const uint32_t JOB_STACK_SIZES[JOB_STACK_CLASS_COUNT] = { 32 * 1024, 512 * 1024, 0 };
+	//Workers look at every higher priority, their own queue and then other workers', before they'll touch a lower one
+	enum JobPriority : uint8_t {
+		JOB_PRIORITY_HIGH,
+		JOB_PRIORITY_NORMAL,
+		//Background work like texture decode or glyph generation that can wait a few frames
+		JOB_PRIORITY_LOW,
+		JOB_PRIORITY_QUEUE_COUNT,
+		//Work that has to be done this frame. These skip the per worker deques and go on one shared lane that idle workers drain before anything else.
+		JOB_PRIORITY_FRAME_CRITICAL = JOB_PRIORITY_QUEUE_COUNT
+	};
+	//Jobs created per stack class when the job system starts, the pool grows past this on demand
+	const uint32_t INITIAL_JOB_POOL_SIZE = 64;
 	//I like to keep sizes in powers of 2
 	const uint32_t queueSize = 1 << 8;
 	const uint32_t queueSizeMask = queueSize - 1;
 
 	struct JobDecl;
 	class Job;
+	class JobSystem;
+	struct JobCounter;
 
 	struct JobThreadData {
 		Context threadCtx;
 		Job* currentJob;
 		Job** newJobsToAdd;
 		uint32_t newJobsToAddCount;
+		//Released once the current job has been switched out, so whoever wakes it can't resume it before its context is saved
+		SpinLock* lockToRelease;
+		//Same idea for waiting on a handle, the waiter holds one extra count on the counter until it's switched out
+		JobCounter* counterToRelease;
+		ScratchThreadState scratch;
+		//Position in this worker's victim order of the last worker it stole from
 		uint32_t stealId;
 		uint32_t threadId;
+#ifdef JOB_ASAN
+		void* asanFakeStack = nullptr;
+#endif
 
 		JobThreadData();
 	};
@@ -171,29 +418,78 @@ namespace job {
 		JobSystem* system;
 		JobDecl* currentTask;
 		bool active = false;
+		JobStackClass stackClass;
+		//Base of the stack reservation, including the guard page
 		char* data = nullptr;
+		size_t reservedSize = 0;
 		char* stackPointer = nullptr;
 		uint32_t state = ENDED;
+		//Intrusive link for the wait lists of the job synchronization primitives
+		Job* nextWaiter = nullptr;
 		Context ctx{};
+#ifdef JOB_ASAN
+		void* asanFakeStack = nullptr;
+		//Stack of the worker that switched to this job last, which is where it switches back to
+		const void* asanWorkerStack = nullptr;
+		size_t asanWorkerStackSize = 0;
+#endif
 	public:
-		Job(job::JobSystem* sys);
+		Job(job::JobSystem* sys, JobStackClass stack);
 		~Job();
 
 		//This function handles running the job function and context switching back after the task ends
 		static void run(Job* job);
 	};
 
+	//Ring buffer backing a job queue. When a queue grows the old buffer is kept alive in the retired chain since a thief may still be reading from it.
+	struct JobQueueBuffer {
+		int64_t size;
+		int64_t mask;
+		std::atomic<Job*>* jobs;
+		JobQueueBuffer* retired;
+
+		JobQueueBuffer(int64_t size, JobQueueBuffer* retired);
+		~JobQueueBuffer();
+
+		Job* get(int64_t idx) {
+			return jobs[idx & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(int64_t idx, Job* job) {
+			jobs[idx & mask].store(job, std::memory_order_relaxed);
+		}
+
+		JobQueueBuffer* grow(int64_t top, int64_t bottom);
+	};
+
+	//Chase-Lev work stealing deque. Only the owning thread may push and pop, any thread may steal.
+	//Jobs pushed from other threads go through the inbox, which the owner moves into the deque the next time it pops.
 	struct JobQueue {
 		std::thread::id threadId;
 		uint32_t id;
-		Job** jobs;
-		std::atomic<int64_t> top;
-		std::atomic<int64_t> bottom;
+		//Top and bottom are on separate cache lines so thieves bumping top don't keep invalidating the owner's bottom
+		alignas(64) std::atomic<int64_t> top;
+		alignas(64) std::atomic<int64_t> bottom;
+		std::atomic<JobQueueBuffer*> buffer;
 		uint32_t stealId;
+		//Only used when the queues are built with SPIN_LOCKED_QUEUES
 		SpinLock queueLock{};
+		alignas(64) SpinLock inboxLock{};
+		std::atomic<uint32_t> inboxCount;
+		std::vector<Job*> inbox;
 
 		JobQueue(std::thread::id tid, uint32_t id);
 		~JobQueue();
+
+		void push(Job* job);
+		Job* pop();
+		Job* steal();
+		void push_from_other_thread(Job* job);
+		//Approximate when called from anything but the owner
+		uint32_t depth();
+	private:
+		void drain_inbox();
+		Job* steal_from_inbox();
 	};
 	struct JobCounter {
 		Job* job;
@@ -204,30 +500,124 @@ namespace job {
 		void decrement();
 	};
 
+	//Returned by start_jobs. The counter comes from a pool and goes back when the handle is waited on, so every handle has to be waited on exactly once.
+	struct JobHandle {
+		JobCounter* counter = nullptr;
+
+		bool valid() {
+			return counter != nullptr;
+		}
+	};
+
 	struct JobDecl {
 		JobCounter* counter;
 		void (*func)(void*);
 		void* arg;
+		JobStackClass stackClass;
+		JobPriority priority;
 
 		JobDecl();
 
-		JobDecl(void (*f)(void*), void* argument);
+		JobDecl(void (*f)(void*), void* argument, JobStackClass stack = JOB_STACK_LARGE, JobPriority jobPriority = JOB_PRIORITY_NORMAL);
+
+		JobDecl(void (*f)(void), JobStackClass stack = JOB_STACK_LARGE, JobPriority jobPriority = JOB_PRIORITY_NORMAL);
+	};
+
+	struct JobPoolStats {
+		//Jobs (and their stacks) that currently exist, free or not
+		uint32_t allocated[JOB_STACK_CLASS_COUNT];
+		uint32_t inUse[JOB_STACK_CLASS_COUNT];
+		//Most jobs that were ever in use at once, use this to size INITIAL_JOB_POOL_SIZE for production
+		uint32_t highWater[JOB_STACK_CLASS_COUNT];
+		//Deepest a stack has been committed, in bytes
+		size_t maxCommittedStack[JOB_STACK_CLASS_COUNT];
+	};
+
+	//Per worker counters. Only the owning worker writes them, so they're plain relaxed loads and stores, and each gets its own cache line.
+	struct alignas(64) WorkerCounters {
+		std::atomic<uint64_t> jobsExecuted{ 0 };
+		std::atomic<uint64_t> stealsSucceeded{ 0 };
+		std::atomic<uint64_t> stealsFailed{ 0 };
+		std::atomic<uint64_t> parkedNanoseconds{ 0 };
+		std::atomic<uint64_t> busyNanoseconds{ 0 };
+		std::atomic<uint64_t> maxQueueDepth{ 0 };
+		std::atomic<uint64_t> suspends{ 0 };
+		std::atomic<uint64_t> resumes{ 0 };
+		std::atomic<uint64_t> stealsByDistance[TOPOLOGY_DISTANCE_COUNT]{};
+	};
 
-		JobDecl(void (*f)(void));
+	//A copy of one worker's counters. Totals since init_job_system, diff two snapshots to get a rate.
+	struct WorkerStats {
+		uint64_t jobsExecuted;
+		uint64_t stealsSucceeded;
+		uint64_t stealsFailed;
+		//Time spent asleep on the idle event count vs running jobs. The rest is spinning and looking for work.
+		uint64_t parkedNanoseconds;
+		uint64_t busyNanoseconds;
+		uint64_t maxQueueDepth;
+		//Times a job switched out without finishing, and times a job that did was picked back up
+		uint64_t suspends;
+		uint64_t resumes;
+		//Successful steals by how far away the victim was
+		uint64_t stealsByDistance[TOPOLOGY_DISTANCE_COUNT];
+	};
+
+	//A reusable set of jobs with dependencies between them. Each job starts as soon as everything it depends on finishes, without any job suspending to wait in between.
+	//Build it once and run it every frame, a run only resets the counters.
+	class TaskGraph {
+	private:
+		struct Node {
+			TaskGraph* graph;
+			JobDecl decl;
+			//What actually gets scheduled, runs decl and then releases the successors
+			JobDecl runDecl;
+			std::vector<uint32_t> successors;
+			uint32_t predecessorCount;
+			std::atomic<int32_t> remaining;
+		};
+
+		JobSystem* system = nullptr;
+		std::vector<Node*> nodes;
+		std::vector<JobDecl*> roots;
+		bool validated = false;
+
+		void validate();
+		static void run_node(void* arg);
+	public:
+		TaskGraph() = default;
+		TaskGraph(const TaskGraph&) = delete;
+		TaskGraph& operator=(const TaskGraph&) = delete;
+		~TaskGraph();
+
+		//Returns the node index to use with add_dependency. The decl's counter is ignored, the graph manages its own.
+		uint32_t add_node(JobDecl decl);
+		//after won't start until before has finished
+		void add_dependency(uint32_t before, uint32_t after);
+		void clear();
+		//Runs every node and suspends the calling job until they're all done. Must be called from inside a job, and not while another run of the same graph is going.
+		void run(JobSystem& jobSystem);
 	};
 
 	class JobSystem {
 	private:
 		friend struct JobCounter;
 		friend class Job;
+		friend class TaskGraph;
 
 		SpinLock jobPoolLock{};
-		std::atomic<uint32_t> jobPoolReadIdx;
-		std::atomic<uint32_t> jobPoolMaxReadIdx;
-		std::atomic<uint32_t> jobPoolWriteIdx;
-		//The queue of empty available jobs, implemented as a ring buffer
-		Job* jobPool[queueSize];
-		std::vector<JobQueue*> queues;
+		//Free jobs for each stack class, used as a stack so recently used (and committed) stacks get reused first
+		std::vector<Job*> jobPool[JOB_STACK_CLASS_COUNT];
+		std::vector<Job*> allJobs;
+		uint32_t jobsInUse[JOB_STACK_CLASS_COUNT]{};
+		uint32_t jobsHighWater[JOB_STACK_CLASS_COUNT]{};
+		SpinLock counterPoolLock{};
+		std::vector<JobCounter*> counterPool;
+		std::vector<JobCounter*> allCounters;
+		//One deque per worker for each priority
+		std::vector<JobQueue*> queues[JOB_PRIORITY_QUEUE_COUNT];
+		SpinLock frameLaneLock{};
+		std::deque<Job*> frameLane;
+		std::atomic<uint32_t> frameLaneCount{ 0 };
 
 		//std::vector<JobQueue*> queues;
 		std::atomic<uint32_t> activeJobCount{ 0 };
@@ -235,27 +625,340 @@ namespace job {
 		std::vector<std::thread> threadpool;
 		std::atomic<bool> finished = false;
 
-		void push_job(JobQueue& queue, Job& job);
+		EventCount idleWorkers{};
+		std::atomic<uint32_t> spinBudget{ DEFAULT_SPIN_BUDGET };
+
+		WorkerCounters* workerCounters = nullptr;
+
+		struct StealVictim {
+			uint32_t worker;
+			TopologyDistance distance;
+		};
+		CpuTopology topology;
+		//The CPU each worker runs on (or would, if it isn't pinned)
+		std::vector<uint32_t> workerCpus;
+		//Every other worker, closest first
+		std::vector<std::vector<StealVictim>> victimOrder;
+
+		void push_job(uint32_t index, Job& job);
+		//Puts the job on the right queue for its priority without waking anyone
+		void enqueue_job(uint32_t index, Job& job);
+		void wake_workers(uint32_t jobCount);
 		Job* pop_job(JobQueue& queue);
-		Job* acquire_job();
+		Job* pop_frame_lane();
+		Job* acquire_job(JobStackClass stackClass);
 		void release_job(Job* job);
-		Job* steal_job(JobQueue& queue, uint32_t& stealId);
+		JobCounter* acquire_counter(int32_t count);
+		void release_counter(JobCounter* counter);
+		Job* steal_job(uint32_t index, uint32_t priority, uint32_t& stealId);
+		void build_victim_order(uint32_t threadCount);
 		Job* getJob(uint32_t index);
+		void note_queue_depth(uint32_t index);
 
 		void threadFunc(uint32_t idx);
 
 		void cleanup();
+
+		//Suspends the current job and starts the given jobs once it's switched out. The caller sets up whatever counter resumes it.
+		void start_jobs_and_suspend(JobDecl* const* jobs, uint32_t jobCount);
+		//The part after the jobs are acquired. jobArray is read after the switch, so it has to live in the caller's ScopedScratch.
+		void suspend_and_start(Job** jobArray, uint32_t jobCount);
+		Job* acquire_job_for(JobDecl& decl);
+
+		template<typename Func>
+		struct ParallelForArg {
+			JobSystem* system;
+			Func* func;
+			uint32_t begin;
+			uint32_t end;
+			uint32_t grain;
+			JobPriority priority;
+		};
+
+		//Splits the range in half until it's under the grain size, so thieves always take the biggest remaining piece of work
+		template<typename Func>
+		static void parallel_for_job(void* varg) {
+			ParallelForArg<Func>& arg = *reinterpret_cast<ParallelForArg<Func>*>(varg);
+			if (arg.end - arg.begin <= arg.grain) {
+				for (uint32_t i = arg.begin; i < arg.end; i++) {
+					(*arg.func)(i);
+				}
+				return;
+			}
+			uint32_t mid = arg.begin + (arg.end - arg.begin) / 2;
+			ParallelForArg<Func> halves[2]{ { arg.system, arg.func, arg.begin, mid, arg.grain, arg.priority }, { arg.system, arg.func, mid, arg.end, arg.grain, arg.priority } };
+			JobDecl decls[2]{ JobDecl(parallel_for_job<Func>, &halves[0], JOB_STACK_LARGE, arg.priority), JobDecl(parallel_for_job<Func>, &halves[1], JOB_STACK_LARGE, arg.priority) };
+			arg.system->start_jobs_and_wait_for_counter(decls, 2);
+		}
+
+		template<typename T, typename Map, typename Combine>
+		struct ParallelReduceArg {
+			JobSystem* system;
+			Map* map;
+			Combine* combine;
+			uint32_t begin;
+			uint32_t end;
+			uint32_t grain;
+			JobPriority priority;
+			T result;
+		};
+
+		template<typename T, typename Map, typename Combine>
+		static void parallel_reduce_job(void* varg) {
+			ParallelReduceArg<T, Map, Combine>& arg = *reinterpret_cast<ParallelReduceArg<T, Map, Combine>*>(varg);
+			if (arg.end - arg.begin <= arg.grain) {
+				for (uint32_t i = arg.begin; i < arg.end; i++) {
+					arg.result = (*arg.combine)(arg.result, (*arg.map)(i));
+				}
+				return;
+			}
+			uint32_t mid = arg.begin + (arg.end - arg.begin) / 2;
+			ParallelReduceArg<T, Map, Combine> halves[2]{
+				{ arg.system, arg.map, arg.combine, arg.begin, mid, arg.grain, arg.priority, arg.result },
+				{ arg.system, arg.map, arg.combine, mid, arg.end, arg.grain, arg.priority, arg.result } };
+			JobDecl decls[2]{ JobDecl(parallel_reduce_job<T, Map, Combine>, &halves[0], JOB_STACK_LARGE, arg.priority), JobDecl(parallel_reduce_job<T, Map, Combine>, &halves[1], JOB_STACK_LARGE, arg.priority) };
+			arg.system->start_jobs_and_wait_for_counter(decls, 2);
+			//Always combined left to right, so the result doesn't depend on which thread ran what
+			arg.result = (*arg.combine)(halves[0].result, halves[1].result);
+		}
+
+		//The parallel algorithms can only split work when called from inside a job, otherwise they just run on the calling thread
+		bool in_job();
+		//Pieces of a parallel algorithm run at the priority of the job that started it
+		JobPriority current_priority();
 	public:
+		//Most chunks the scan will split into. The chunk totals live on the stack, so this keeps that bounded.
+		static const uint32_t MAX_SCAN_CHUNKS = 64;
+
+		//Aims for several chunks per worker so stealing can even out uneven work, but never less than minGrain elements per chunk
+		uint32_t grain_size(uint32_t count, uint32_t minGrain);
+
+		//Calls func(i) for every i in [begin, end). func is taken by reference and never copied or heap allocated.
+		template<typename Func>
+		void parallel_for(uint32_t begin, uint32_t end, Func&& func, uint32_t minGrain = 1) {
+			if (end <= begin) {
+				return;
+			}
+			using FuncType = std::remove_reference_t<Func>;
+			ParallelForArg<FuncType> arg{ this, &func, begin, end, grain_size(end - begin, minGrain), current_priority() };
+			if (!in_job()) {
+				arg.grain = UINT32_MAX;
+			}
+			parallel_for_job<FuncType>(&arg);
+		}
+
+		//Returns identity combined with map(i) for every i in [begin, end). identity should be a real identity for combine, since every chunk starts from it.
+		template<typename T, typename Map, typename Combine>
+		T parallel_reduce(uint32_t begin, uint32_t end, T identity, Map&& map, Combine&& combine, uint32_t minGrain = 1) {
+			if (end <= begin) {
+				return identity;
+			}
+			using MapType = std::remove_reference_t<Map>;
+			using CombineType = std::remove_reference_t<Combine>;
+			ParallelReduceArg<T, MapType, CombineType> arg{ this, &map, &combine, begin, end, grain_size(end - begin, minGrain), current_priority(), identity };
+			if (!in_job()) {
+				arg.grain = UINT32_MAX;
+			}
+			parallel_reduce_job<T, MapType, CombineType>(&arg);
+			return arg.result;
+		}
+
+		//Inclusive scan. Calls output(i, value) where value is input(begin) combined up to input(i).
+		//Runs in two passes, first totaling each chunk, then rescanning each chunk starting from the total of the chunks before it.
+		template<typename T, typename Input, typename Combine, typename Output>
+		void parallel_scan(uint32_t begin, uint32_t end, T identity, Input&& input, Combine&& combine, Output&& output, uint32_t minGrain = 1) {
+			if (end <= begin) {
+				return;
+			}
+			uint32_t count = end - begin;
+			uint32_t chunkSize = std::max(grain_size(count, minGrain), (count + MAX_SCAN_CHUNKS - 1) / MAX_SCAN_CHUNKS);
+			uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+			T chunkTotals[MAX_SCAN_CHUNKS];
+			parallel_for(0, chunkCount, [&](uint32_t chunk) {
+				uint32_t chunkBegin = begin + chunk * chunkSize;
+				uint32_t chunkEnd = std::min(chunkBegin + chunkSize, end);
+				T total = identity;
+				for (uint32_t i = chunkBegin; i < chunkEnd; i++) {
+					total = combine(total, input(i));
+				}
+				chunkTotals[chunk] = total;
+			});
+			//Only MAX_SCAN_CHUNKS of these at most, not worth doing in parallel
+			T running = identity;
+			for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+				T total = chunkTotals[chunk];
+				chunkTotals[chunk] = running;
+				running = combine(running, total);
+			}
+			parallel_for(0, chunkCount, [&](uint32_t chunk) {
+				uint32_t chunkBegin = begin + chunk * chunkSize;
+				uint32_t chunkEnd = std::min(chunkBegin + chunkSize, end);
+				T value = chunkTotals[chunk];
+				for (uint32_t i = chunkBegin; i < chunkEnd; i++) {
+					value = combine(value, input(i));
+					output(i, value);
+				}
+			});
+		}
+
+
 		Job* thisjob();
-		void init_job_system(uint32_t threadCount);
+		//Pinning puts each worker on its own logical CPU. Without it the victim order still assumes that placement, it's just not enforced.
+		void init_job_system(uint32_t threadCount, bool pinWorkers = true);
 		void start_entry_point(JobDecl& decl);
 		void end_job_system();
 		void start_jobs_and_wait_for_counter(JobDecl* jobs, uint32_t jobCount);
 		void start_job(JobDecl& decl);
 		void start_job(JobDecl& decl, uint32_t tid);
+		//Starts the jobs without suspending, the caller keeps running and joins later with wait_for
+		JobHandle start_jobs(JobDecl* jobs, uint32_t jobCount);
+		//Suspends the current job until everything behind the handle has finished. Outside of a job it yields the thread instead.
+		void wait_for(JobHandle& handle);
+		bool is_complete(const JobHandle& handle);
+		//For work that finishes some other way than a job returning, like a coroutine or an I/O request. Call complete on it pendingCount times.
+		JobHandle make_handle(uint32_t pendingCount);
+		void complete(const JobHandle& handle);
+		//Starts resumeDecl as a new job once everything behind the handle is done, without suspending anything in the meantime.
+		//The handle still has to be released afterwards, resumeDecl is a good place to do that.
+		void start_when_complete(JobHandle& handle, JobDecl& resumeDecl);
+		void release_handle(JobHandle& handle);
 		void yield_job();
+		//Lower budgets save CPU when idle, higher budgets keep workers hot for latency sensitive frames
+		void set_spin_budget(uint32_t failedAttempts);
 		uint16_t thread_count();
 		bool is_done();
+		JobPoolStats pool_stats();
+		const CpuTopology& cpu_topology();
+		std::vector<WorkerStats> worker_stats();
+		//Records every worker's counters as profiler counter events on the calling thread. Call it once a frame.
+		void emit_profile_counters();
+
+		//Building blocks for things that need to put a job to sleep. The job is switched out first and then waitListLock is unlocked,
+		//so the lock should be held while the job adds itself to a wait list. Something else later calls resume_job on it.
+		void suspend_job_and_unlock(SpinLock& waitListLock);
+		void resume_job(Job* job);
+	};
+
+	//FIFO list of suspended jobs, linked through Job::nextWaiter
+	struct JobWaitList {
+		Job* head = nullptr;
+		Job* tail = nullptr;
+
+		void push(Job* job);
+		Job* pop();
+		bool empty() {
+			return head == nullptr;
+		}
+	};
+
+	//The primitives below spin briefly, then suspend the current job on contention and give the worker back to the scheduler.
+	//Outside of a job there's nothing to suspend, so they fall back to spinning.
+	const uint32_t JOB_LOCK_SPIN_COUNT = 64;
+
+	class JobMutex {
+	private:
+		std::atomic<bool> locked{ false };
+		std::atomic<uint32_t> waiterCount{ 0 };
+		SpinLock waitLock{};
+		JobWaitList waiters{};
+	public:
+		bool try_lock();
+		void lock();
+		void unlock();
+	};
+
+	//Readers and writers wait in separate lists. Writers are woken first, and new readers back off while any writer is waiting,
+	//so a steady stream of readers can't starve them. That also means taking a read lock twice from the same job can deadlock against a writer.
+	class JobRWLock {
+	private:
+		//-1 when write locked, otherwise the number of readers
+		std::atomic<int32_t> state{ 0 };
+		std::atomic<uint32_t> waiterCount{ 0 };
+		//Writers that are spinning or queued, counted from their first failed try until they get the lock
+		std::atomic<uint32_t> writersWaiting{ 0 };
+		SpinLock waitLock{};
+		JobWaitList readWaiters{};
+		JobWaitList writeWaiters{};
+
+		void wake_waiters();
+	public:
+		bool try_lock_read();
+		bool try_lock_write();
+		void lock_read();
+		void lock_write();
+		void unlock_read();
+		void unlock_write();
+	};
+
+	class JobEvent {
+	private:
+		std::atomic<bool> signaled;
+		//Auto reset events wake a single waiter per set and clear themselves, manual reset events stay set and wake everyone until reset
+		bool autoReset;
+		SpinLock waitLock{};
+		JobWaitList waiters{};
+
+		bool try_consume();
+	public:
+		JobEvent(bool autoReset, bool initiallySet = false);
+
+		void wait();
+		void set();
+		void reset();
+		bool is_set();
+	};
+
+	class JobSemaphore {
+	private:
+		std::atomic<int32_t> count;
+		std::atomic<uint32_t> waiterCount{ 0 };
+		SpinLock waitLock{};
+		JobWaitList waiters{};
+	public:
+		JobSemaphore(int32_t initialCount);
+
+		bool try_acquire();
+		void acquire();
+		void release(int32_t releaseCount = 1);
+	};
+
+	class RAIIJobLocker {
+	private:
+		JobMutex* lock;
+	public:
+		RAIIJobLocker(JobMutex* lock) {
+			this->lock = lock;
+			lock->lock();
+		}
+		~RAIIJobLocker() {
+			this->lock->unlock();
+		}
+	};
+
+	class RAIIRJobLocker {
+	private:
+		JobRWLock* lock;
+	public:
+		RAIIRJobLocker(JobRWLock* lock) {
+			this->lock = lock;
+			lock->lock_read();
+		}
+		~RAIIRJobLocker() {
+			this->lock->unlock_read();
+		}
+	};
+
+	class RAIIWJobLocker {
+	private:
+		JobRWLock* lock;
+	public:
+		RAIIWJobLocker(JobRWLock* lock) {
+			this->lock = lock;
+			lock->lock_write();
+		}
+		~RAIIWJobLocker() {
+			this->lock->unlock_write();
+		}
 	};
 
 }
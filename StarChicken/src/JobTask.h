@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "JobSystem.h"
+
+//Coroutines on top of the job system. A waiting Task is just its coroutine frame, it doesn't hold a fiber stack like a suspended job does,
+//so it's fine to have thousands of them in flight. Whenever one needs to get back onto a worker it goes through a JOB_STACK_NONE job that resumes it.
+//Task code runs on the worker's own stack rather than inside a job, so use co_await instead of the blocking waits in there.
+namespace job {
+	template<typename T>
+	class Task;
+
+	//Totals over every task frame allocated so far. A suspended task only holds on to its frame, where a suspended job holds a whole fiber stack.
+	struct TaskFrameStats {
+		uint64_t frames;
+		uint64_t bytes;
+	};
+
+	inline std::atomic<uint64_t> taskFramesAllocated{ 0 };
+	inline std::atomic<uint64_t> taskFrameBytes{ 0 };
+
+	inline TaskFrameStats task_frame_stats() {
+		return TaskFrameStats{ taskFramesAllocated.load(std::memory_order_relaxed), taskFrameBytes.load(std::memory_order_relaxed) };
+	}
+
+	inline void resume_coroutine(void* address) {
+		std::coroutine_handle<>::from_address(address).resume();
+	}
+
+	struct TaskPromiseBase {
+		//Whoever is co_awaiting this task, resumed right on this thread when the task finishes
+		std::coroutine_handle<> continuation{};
+		//Resumes this coroutine from a worker. Lives in the frame so getting rescheduled never allocates.
+		JobDecl resumeDecl{};
+
+		struct FinalAwaiter {
+			bool await_ready() noexcept {
+				return false;
+			}
+			template<typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+				std::coroutine_handle<> next = handle.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		static void* operator new(size_t size) {
+			taskFramesAllocated.fetch_add(1, std::memory_order_relaxed);
+			taskFrameBytes.fetch_add(size, std::memory_order_relaxed);
+			return ::operator new(size);
+		}
+		static void operator delete(void* frame) {
+			::operator delete(frame);
+		}
+
+		void init_resume_decl(std::coroutine_handle<> handle) {
+			resumeDecl = JobDecl(resume_coroutine, handle.address(), JOB_STACK_NONE);
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		FinalAwaiter final_suspend() noexcept {
+			return {};
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+
+	template<typename T>
+	struct TaskPromise : TaskPromiseBase {
+		std::optional<T> value;
+
+		void return_value(T result) {
+			value.emplace(std::move(result));
+		}
+	};
+
+	template<>
+	struct TaskPromise<void> : TaskPromiseBase {
+		void return_void() {}
+	};
+
+	//Lazy, nothing runs until it's co_awaited or handed to start_task. co_awaiting a task runs it right away on the same thread.
+	template<typename T = void>
+	class Task {
+	public:
+		struct promise_type : TaskPromise<T> {
+			Task get_return_object() {
+				std::coroutine_handle<promise_type> handle = std::coroutine_handle<promise_type>::from_promise(*this);
+				this->init_resume_decl(handle);
+				return Task{ handle };
+			}
+		};
+
+		Task() = default;
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		Task(Task&& other) noexcept : handle{ std::exchange(other.handle, nullptr) } {}
+		Task& operator=(Task&& other) noexcept {
+			if (this != &other) {
+				if (handle) {
+					handle.destroy();
+				}
+				handle = std::exchange(other.handle, nullptr);
+			}
+			return *this;
+		}
+		~Task() {
+			if (handle) {
+				handle.destroy();
+			}
+		}
+
+		bool done() {
+			return !handle || handle.done();
+		}
+
+		bool await_ready() {
+			return done();
+		}
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+		T await_resume() {
+			if constexpr (!std::is_void_v<T>) {
+				return std::move(*handle.promise().value);
+			}
+		}
+	private:
+		std::coroutine_handle<promise_type> handle{};
+
+		explicit Task(std::coroutine_handle<promise_type> coroutine) : handle{ coroutine } {}
+	};
+
+	//co_await schedule(system) moves the rest of the coroutine onto a worker
+	struct ScheduleAwaiter {
+		JobSystem* system;
+		JobPriority priority;
+
+		bool await_ready() {
+			return false;
+		}
+		template<typename Promise>
+		void await_suspend(std::coroutine_handle<Promise> handle) {
+			JobDecl& decl = handle.promise().resumeDecl;
+			decl.priority = priority;
+			system->start_job(decl, threadData ? threadData->threadId : 0);
+		}
+		void await_resume() {}
+	};
+
+	inline ScheduleAwaiter schedule(JobSystem& system, JobPriority priority = JOB_PRIORITY_NORMAL) {
+		return ScheduleAwaiter{ &system, priority };
+	}
+
+	//co_await when_complete(system, handle) picks back up on a worker once everything behind the handle is done, and releases the handle
+	struct JobHandleAwaiter {
+		JobSystem* system;
+		JobHandle* handle;
+
+		bool await_ready() {
+			return system->is_complete(*handle);
+		}
+		template<typename Promise>
+		void await_suspend(std::coroutine_handle<Promise> coroutine) {
+			system->start_when_complete(*handle, coroutine.promise().resumeDecl);
+		}
+		void await_resume() {
+			system->release_handle(*handle);
+		}
+	};
+
+	inline JobHandleAwaiter when_complete(JobSystem& system, JobHandle& handle) {
+		return JobHandleAwaiter{ &system, &handle };
+	}
+
+	//Owns itself and frees its frame when it finishes, only used by start_task
+	struct DetachedTask {
+		struct promise_type : TaskPromiseBase {
+			DetachedTask get_return_object() {
+				init_resume_decl(std::coroutine_handle<promise_type>::from_promise(*this));
+				return {};
+			}
+			std::suspend_never initial_suspend() noexcept {
+				return {};
+			}
+			std::suspend_never final_suspend() noexcept {
+				return {};
+			}
+			void return_void() {}
+		};
+	};
+
+	inline DetachedTask run_detached(JobSystem& system, Task<void> task, JobHandle handle, JobPriority priority) {
+		co_await schedule(system, priority);
+		co_await task;
+		system.complete(handle);
+	}
+
+	//Runs the task on a worker with nothing awaiting it. The handle can be waited on from a job with wait_for, or co_awaited with when_complete.
+	inline JobHandle start_task(JobSystem& system, Task<void> task, JobPriority priority = JOB_PRIORITY_NORMAL) {
+		JobHandle handle = system.make_handle(1);
+		run_detached(system, std::move(task), handle, priority);
+		return handle;
+	}
+}
\ No newline at end of file
@@ -50,6 +50,9 @@ namespace profiling {
 				//Google's tracing apparently fails to display a 0 thread id, so we'll just add 1.
 				out << ", \"tid\": " << (i + 1);
 				out << ", \"ts\": " << micro;
+				if (dat.type == 'C') {
+					out << ", \"args\": {\"value\": " << dat.value << "}";
+				}
 				out << "}";
 			}
 			data[i].clear();
@@ -60,6 +63,14 @@ namespace profiling {
 #endif
 	}
 
+	void counter([[maybe_unused]] const std::string& name, [[maybe_unused]] int64_t value) {
+#if PROFILING_ENABLE
+		int32_t tid = tidGetter();
+		if (tid != -1) {
+			data[tid].push_back({ std::chrono::high_resolution_clock::now(), 'C', name, value });
+		}
+#endif
+	}
 
 	void Profiler::begin() {
 #if PROFILING_ENABLE
@@ -20,6 +20,8 @@ namespace profiling {
 		std::chrono::high_resolution_clock::time_point time;
 		char type;
 		std::string name;
+		//Only used by counter events
+		int64_t value;
 	};
 
 	extern int32_t(*tidGetter)(void);
@@ -33,6 +35,9 @@ namespace profiling {
 
 	void dump_data();
 
+	//Records a value on a counter track, the trace viewer draws it as a graph over time
+	void counter(const std::string& name, int64_t value);
+
 	class Profiler {
 	private:
 		std::string m_name;
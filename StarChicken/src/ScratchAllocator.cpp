@@ -0,0 +1,132 @@
+#include <algorithm>
+#include "ScratchAllocator.h"
+#include "JobSystem.h"
+
+namespace job {
+	std::atomic<uint64_t> scratchFrame{ 0 };
+	thread_local ScratchThreadState fallbackScratch{};
+
+	LinearArena::~LinearArena() {
+		for (Block& block : blocks) {
+			delete[] block.data;
+		}
+	}
+
+	void* LinearArena::alloc(size_t size, size_t alignment) {
+		while (currentBlock < blocks.size()) {
+			Block& block = blocks[currentBlock];
+			uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+			size_t start = ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+			if (start + size <= block.size) {
+				offset = start + size;
+				peak = std::max(peak, previousBlocks + offset);
+				return block.data + start;
+			}
+			previousBlocks += block.size;
+			++currentBlock;
+			offset = 0;
+		}
+		size_t blockSize = std::max(SCRATCH_BLOCK_SIZE, size + alignment);
+		blocks.push_back(Block{ new char[blockSize], blockSize });
+		currentBlock = static_cast<uint32_t>(blocks.size() - 1);
+		return alloc(size, alignment);
+	}
+
+	void LinearArena::free_last(void* ptr, size_t size) {
+		if (currentBlock < blocks.size() && reinterpret_cast<char*>(ptr) + size == blocks[currentBlock].data + offset) {
+			offset -= size;
+		}
+	}
+
+	void LinearArena::reset() {
+		//Drops by an eighth each reset, so a one off spike is mostly gone after a couple dozen frames
+		recentPeak = std::max(peak, recentPeak - recentPeak / 8);
+		size_t keep = std::min(std::max(recentPeak, SCRATCH_BLOCK_SIZE), SCRATCH_RETAIN_LIMIT);
+		//A little slack so the block isn't reallocated every time use moves a bit
+		if (!blocks.empty() && (blocks.size() > 1 || blocks[0].size > keep * 2)) {
+			bool keepFirst = blocks[0].size == keep;
+			for (size_t i = keepFirst ? 1 : 0; i < blocks.size(); i++) {
+				delete[] blocks[i].data;
+			}
+			blocks.resize(1);
+			if (!keepFirst) {
+				blocks[0] = Block{ new char[keep], keep };
+			}
+		}
+		currentBlock = 0;
+		offset = 0;
+		previousBlocks = 0;
+		peak = 0;
+	}
+
+	size_t LinearArena::capacity() {
+		size_t total = 0;
+		for (Block& block : blocks) {
+			total += block.size;
+		}
+		return total;
+	}
+
+	ScratchThreadState::~ScratchThreadState() {
+		for (LinearArena* arena : freeScopeArenas) {
+			delete arena;
+		}
+	}
+
+	ScratchThreadState& scratch_state() {
+		return threadData ? threadData->scratch : fallbackScratch;
+	}
+
+	void advance_scratch_frame() {
+		scratchFrame.fetch_add(1, std::memory_order_release);
+	}
+
+	uint64_t current_scratch_frame() {
+		return scratchFrame.load(std::memory_order_acquire);
+	}
+
+	void* frame_alloc(size_t size, size_t alignment) {
+		ScratchThreadState& state = scratch_state();
+		uint64_t frame = current_scratch_frame();
+		uint32_t slot = static_cast<uint32_t>(frame % SCRATCH_FRAME_COUNT);
+		//The last frame to use this slot was at least SCRATCH_FRAME_COUNT frames ago, so it's safe to reuse
+		if (state.arenaFrames[slot] != frame) {
+			state.frameArenas[slot].reset();
+			state.arenaFrames[slot] = frame;
+		}
+		return state.frameArenas[slot].alloc(size, alignment);
+	}
+
+	void frame_free(void* ptr, size_t size) {
+		ScratchThreadState& state = scratch_state();
+		uint64_t frame = current_scratch_frame();
+		uint32_t slot = static_cast<uint32_t>(frame % SCRATCH_FRAME_COUNT);
+		if (state.arenaFrames[slot] == frame) {
+			state.frameArenas[slot].free_last(ptr, size);
+		}
+	}
+
+	ScopedScratch::ScopedScratch() {
+		std::vector<LinearArena*>& freeArenas = scratch_state().freeScopeArenas;
+		if (freeArenas.empty()) {
+			arena = new LinearArena();
+		} else {
+			arena = freeArenas.back();
+			freeArenas.pop_back();
+		}
+	}
+
+	ScopedScratch::~ScopedScratch() {
+		arena->reset();
+		//Goes back to whatever thread we ended up on, which might not be the one it came from
+		scratch_state().freeScopeArenas.push_back(arena);
+	}
+
+	void* ScopedScratch::alloc(size_t size, size_t alignment) {
+		return arena->alloc(size, alignment);
+	}
+
+	void ScopedScratch::free_last(void* ptr, size_t size) {
+		arena->free_last(ptr, size);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+namespace job {
+	//Frames before frame memory gets reused. Has to be at least NUM_FRAME_DATA so a frame still in flight never has its memory handed out again.
+	constexpr uint32_t SCRATCH_FRAME_COUNT = 2;
+	constexpr size_t SCRATCH_BLOCK_SIZE = 64 * 1024;
+	//Most an arena keeps through a reset. Whatever a bigger spike needed is freed again and allocated fresh the next time.
+	constexpr size_t SCRATCH_RETAIN_LIMIT = 4 * 1024 * 1024;
+
+	//Chain of blocks that only ever bumps forward. Nothing is freed on its own, the whole arena is reset at once.
+	class LinearArena {
+	private:
+		struct Block {
+			char* data;
+			size_t size;
+		};
+		std::vector<Block> blocks;
+		uint32_t currentBlock = 0;
+		size_t offset = 0;
+		//Size of the blocks before currentBlock, so the bytes used so far are this plus offset
+		size_t previousBlocks = 0;
+		//Most used since the last reset, and a slowly decaying max of that across resets
+		size_t peak = 0;
+		size_t recentPeak = 0;
+	public:
+		LinearArena() = default;
+		LinearArena(const LinearArena&) = delete;
+		LinearArena& operator=(const LinearArena&) = delete;
+		~LinearArena();
+
+		void* alloc(size_t size, size_t alignment);
+		//Only gives the memory back if it was the last thing allocated, so a vector growing in place doesn't waste its old storage
+		void free_last(void* ptr, size_t size);
+		//Keeps one block sized for recent use, so a chained arena is merged and doesn't have to chain next time.
+		//After a spike the block shrinks back down over a few resets instead of holding the peak forever, and it never goes past SCRATCH_RETAIN_LIMIT.
+		void reset();
+		size_t capacity();
+	};
+
+	struct ScratchThreadState {
+		LinearArena frameArenas[SCRATCH_FRAME_COUNT];
+		uint64_t arenaFrames[SCRATCH_FRAME_COUNT]{};
+		//Arenas for ScopedScratch that nobody has right now
+		std::vector<LinearArena*> freeScopeArenas;
+
+		ScratchThreadState() = default;
+		ScratchThreadState(const ScratchThreadState&) = delete;
+		ScratchThreadState& operator=(const ScratchThreadState&) = delete;
+		~ScratchThreadState();
+	};
+
+	//Job workers use the state in their JobThreadData, anything else gets a thread_local one
+	ScratchThreadState& scratch_state();
+
+	//Call once a frame from one place. Each thread resets its arena for the new frame lazily, the next time it allocates.
+	void advance_scratch_frame();
+	uint64_t current_scratch_frame();
+
+	//Memory that stays valid for SCRATCH_FRAME_COUNT frames, no need to free it.
+	void* frame_alloc(size_t size, size_t alignment = alignof(std::max_align_t));
+	void frame_free(void* ptr, size_t size);
+
+	template<typename T>
+	T* frame_alloc_array(size_t count) {
+		return reinterpret_cast<T*>(frame_alloc(count * sizeof(T), alignof(T)));
+	}
+
+	//Scratch memory that's all freed when the scope ends. The scope owns its arena outright instead of sharing the thread's,
+	//so the job can suspend and finish on another thread without stepping on whatever ran on the old one in the meantime.
+	class ScopedScratch {
+	private:
+		LinearArena* arena;
+	public:
+		ScopedScratch();
+		ScopedScratch(const ScopedScratch&) = delete;
+		ScopedScratch& operator=(const ScopedScratch&) = delete;
+		~ScopedScratch();
+
+		void* alloc(size_t size, size_t alignment = alignof(std::max_align_t));
+		void free_last(void* ptr, size_t size);
+
+		template<typename T>
+		T* alloc_array(size_t count) {
+			return reinterpret_cast<T*>(alloc(count * sizeof(T), alignof(T)));
+		}
+	};
+
+	//For STL containers that only need to live a frame or two, like std::vector<T, FrameAllocator<T>>
+	template<typename T>
+	class FrameAllocator {
+	public:
+		using value_type = T;
+
+		FrameAllocator() = default;
+		template<typename U>
+		FrameAllocator(const FrameAllocator<U>&) {}
+
+		T* allocate(size_t count) {
+			return frame_alloc_array<T>(count);
+		}
+		void deallocate(T* ptr, size_t count) {
+			frame_free(ptr, count * sizeof(T));
+		}
+
+		template<typename U>
+		bool operator==(const FrameAllocator<U>&) const {
+			return true;
+		}
+		template<typename U>
+		bool operator!=(const FrameAllocator<U>&) const {
+			return false;
+		}
+	};
+
+	//For STL containers that die with a ScopedScratch. The container has to be destroyed before the scope is.
+	template<typename T>
+	class ScratchAllocator {
+	public:
+		using value_type = T;
+		ScopedScratch* scope;
+
+		ScratchAllocator(ScopedScratch& scratch) : scope{ &scratch } {}
+		template<typename U>
+		ScratchAllocator(const ScratchAllocator<U>& other) : scope{ other.scope } {}
+
+		T* allocate(size_t count) {
+			return scope->alloc_array<T>(count);
+		}
+		void deallocate(T* ptr, size_t count) {
+			scope->free_last(ptr, count * sizeof(T));
+		}
+
+		template<typename U>
+		bool operator==(const ScratchAllocator<U>& other) const {
+			return scope == other.scope;
+		}
+		template<typename U>
+		bool operator!=(const ScratchAllocator<U>& other) const {
+			return scope != other.scope;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include <iostream>
+#include <algorithm>
+#include "SystemScheduler.h"
+#include "Profiling.h"
+
+namespace ecs {
+	static uint64_t nanoseconds_between(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	}
+
+	SystemScheduler::~SystemScheduler() {
+		clear();
+	}
+
+	uint32_t SystemScheduler::addSystem(const char* name, SystemAccess access, void (*func)(void*), void* arg) {
+		System* system = new System{};
+		system->name = name;
+		system->access = access;
+		system->func = func;
+		system->arg = arg;
+		system->scheduler = this;
+		systems.push_back(system);
+		dirty = true;
+		return static_cast<uint32_t>(systems.size() - 1);
+	}
+
+	void SystemScheduler::clear() {
+		graph.clear();
+		for (System* system : systems) {
+			delete system;
+		}
+		systems.clear();
+		dirty = true;
+	}
+
+	void SystemScheduler::build() {
+		graph.clear();
+		for (uint32_t i = 0; i < systems.size(); i++) {
+			System* system = systems[i];
+			system->dependencies.clear();
+			graph.add_node(job::JobDecl(run_system, system));
+			//Dependencies only ever point back at earlier systems, so the graph can't have a cycle and the order between conflicts is deterministic
+			for (uint32_t j = 0; j < i; j++) {
+				if (system->access.conflicts(systems[j]->access)) {
+					system->dependencies.push_back(j);
+					graph.add_dependency(j, i);
+				}
+			}
+		}
+		dirty = false;
+	}
+
+	void SystemScheduler::run_system(void* arg) {
+		System* system = reinterpret_cast<System*>(arg);
+		system->start = std::chrono::steady_clock::now();
+		{
+			SCOPE_PROF(system->name);
+			system->func(system->arg);
+		}
+		system->end = std::chrono::steady_clock::now();
+	}
+
+	void SystemScheduler::run(job::JobSystem& jobSystem) {
+		if (dirty) {
+			build();
+		}
+		graph.run(jobSystem);
+		measure();
+		profiling::counter("ECS critical path (us)", static_cast<int64_t>(criticalPath / 1000));
+		profiling::counter("ECS system work (us)", static_cast<int64_t>(totalWork / 1000));
+	}
+
+	void SystemScheduler::measure() {
+		criticalPath = 0;
+		totalWork = 0;
+		criticalPathEnd = 0;
+		//Systems were added in an order that's already topological, dependencies always come first
+		for (uint32_t i = 0; i < systems.size(); i++) {
+			System* system = systems[i];
+			uint64_t duration = nanoseconds_between(system->start, system->end);
+			totalWork += duration;
+			system->pathNanoseconds = duration;
+			system->pathPrevious = i;
+			for (uint32_t dependency : system->dependencies) {
+				if (systems[dependency]->pathNanoseconds + duration > system->pathNanoseconds) {
+					system->pathNanoseconds = systems[dependency]->pathNanoseconds + duration;
+					system->pathPrevious = dependency;
+				}
+			}
+			if (system->pathNanoseconds > criticalPath) {
+				criticalPath = system->pathNanoseconds;
+				criticalPathEnd = i;
+			}
+		}
+	}
+
+	uint64_t SystemScheduler::criticalPathNanoseconds() {
+		return criticalPath;
+	}
+
+	uint64_t SystemScheduler::totalWorkNanoseconds() {
+		return totalWork;
+	}
+
+	std::vector<const char*> SystemScheduler::criticalPathSystems() {
+		std::vector<const char*> path;
+		if (systems.empty()) {
+			return path;
+		}
+		uint32_t current = criticalPathEnd;
+		while (true) {
+			path.push_back(systems[current]->name);
+			if (systems[current]->pathPrevious == current) {
+				break;
+			}
+			current = systems[current]->pathPrevious;
+		}
+		std::reverse(path.begin(), path.end());
+		return path;
+	}
+
+	void SystemScheduler::printSchedule() {
+		if (dirty) {
+			build();
+		}
+		for (System* system : systems) {
+			std::cout << system->name << " (" << nanoseconds_between(system->start, system->end) / 1000 << "us)";
+			if (!system->dependencies.empty()) {
+				std::cout << " after";
+				for (uint32_t dependency : system->dependencies) {
+					std::cout << " " << systems[dependency]->name;
+				}
+			}
+			std::cout << std::endl;
+		}
+		std::cout << "Critical path " << criticalPath / 1000 << "us of " << totalWork / 1000 << "us total work" << std::endl;
+	}
+}
\ No newline at end of file
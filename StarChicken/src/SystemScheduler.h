@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include "EntityComponentSystem.h"
+
+namespace ecs {
+	//Which components a system reads and which it writes. Two systems conflict if either one writes something the other touches.
+	struct SystemAccess {
+		ComponentMask reads = 0;
+		ComponentMask writes = 0;
+
+		bool conflicts(const SystemAccess& other) const {
+			return (writes & (other.reads | other.writes)) || (reads & other.writes);
+		}
+	};
+
+	//Same convention as Query, const components are read and everything else is written
+	template<typename... Components>
+	SystemAccess access(ComponentSystem& componentSystem) {
+		SystemAccess result{};
+		bool readOnly[] = { std::is_const_v<Components>... };
+		uint32_t types[] = { componentSystem.componentType<std::remove_const_t<Components>>()... };
+		for (uint32_t i = 0; i < sizeof...(Components); i++) {
+			(readOnly[i] ? result.reads : result.writes) |= ComponentMask(1) << types[i];
+		}
+		return result;
+	}
+
+	//Runs every system once a frame, with systems that don't conflict running at the same time.
+	//A system only ever waits on systems added before it that it conflicts with, so the order between conflicting systems is always the order they were added in.
+	class SystemScheduler {
+	private:
+		struct System {
+			const char* name;
+			SystemAccess access;
+			void (*func)(void*);
+			void* arg;
+			std::vector<uint32_t> dependencies;
+			SystemScheduler* scheduler;
+			//When it last ran
+			std::chrono::steady_clock::time_point start;
+			std::chrono::steady_clock::time_point end;
+			//Longest chain of dependencies ending with this system, including itself
+			uint64_t pathNanoseconds;
+			//The dependency that chain came through, or the system itself if it started the chain
+			uint32_t pathPrevious;
+		};
+
+		std::vector<System*> systems;
+		job::TaskGraph graph;
+		bool dirty = true;
+		uint64_t criticalPath = 0;
+		uint64_t totalWork = 0;
+		uint32_t criticalPathEnd = 0;
+
+		void build();
+		void measure();
+		static void run_system(void* arg);
+	public:
+		SystemScheduler() = default;
+		SystemScheduler(const SystemScheduler&) = delete;
+		SystemScheduler& operator=(const SystemScheduler&) = delete;
+		~SystemScheduler();
+
+		uint32_t addSystem(const char* name, SystemAccess access, void (*func)(void*), void* arg = nullptr);
+		void clear();
+		//Runs every system and suspends the calling job until they're done, so it has to be called from a job.
+		//Each system shows up in the profiler trace on the worker that ran it, followed by counters for the frame's critical path and total work.
+		void run(job::JobSystem& jobSystem);
+
+		//From the last run. Work divided by critical path is roughly how many workers the frame could keep busy.
+		uint64_t criticalPathNanoseconds();
+		uint64_t totalWorkNanoseconds();
+		//Names along the last run's critical path, first to last
+		std::vector<const char*> criticalPathSystems();
+		//Prints each system with what it waits on and how long it took last run
+		void printSchedule();
+	};
+}
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "VertexFormats.h"
 #include "DeviceMemoryAllocator.h"
 #include "ShaderUniforms.h"
+#include "../ScratchAllocator.h"
 #define MAX_BOUND_DESCRIPTOR_SETS 4
 
 namespace vku {
@@ -51,12 +52,12 @@ namespace vku {
 		}
 		template<typename Vertex>
 		void put_vertex_data(Vertex* vertices, uint32_t vertCount) {
-			uint16_t* indices = reinterpret_cast<uint16_t*>(_malloca(vertCount * sizeof(uint16_t)));
+			job::ScopedScratch scratch;
+			uint16_t* indices = scratch.alloc_array<uint16_t>(vertCount);
 			for (uint32_t i = 0; i < vertCount; i++) {
 				indices[i] = i;
 			}
 			put_vertex_data(vertices, vertCount, indices, vertCount);
-			_freea(indices);
 		}
 	};
 }
\ No newline at end of file
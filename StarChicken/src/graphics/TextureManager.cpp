@@ -243,21 +243,35 @@ namespace vku {
 		newTextures.clear();
 	}
 
-	Texture* load_texture(std::wstring textureName, VkImageUsageFlags extraUsage) {
-		Texture* tex = new Texture();
-		util::FileMapping mapping = util::map_file(L"resources/textures/" + textureName);
+	static void create_from_file(Texture* tex, const std::wstring& textureName, const void* fileData, VkImageUsageFlags extraUsage) {
+		const uint32_t* data = reinterpret_cast<const uint32_t*>(fileData);
 		if (textureName.compare(textureName.length() - 5, 5, L".msdf") == 0) {
-			uint32_t* data = reinterpret_cast<uint32_t*>(mapping.mapping);
 			uint32_t width = data[0];
 			uint32_t height = data[1];
-			tex->create(transferCommandBuffer, width, height, 1, data + 2, TEXTURE_TYPE_NORMAL, extraUsage | VK_IMAGE_USAGE_SAMPLED_BIT);
+			tex->create(transferCommandBuffer, width, height, 1, const_cast<uint32_t*>(data + 2), TEXTURE_TYPE_NORMAL, extraUsage | VK_IMAGE_USAGE_SAMPLED_BIT);
 		} else {
-			uint32_t* data = reinterpret_cast<uint32_t*>(mapping.mapping);
 			uint32_t width = data[1];
 			uint32_t height = data[2];
-			tex->create(transferCommandBuffer, width, height, 1, data + 4, TEXTURE_TYPE_COMPRESSED, extraUsage | VK_IMAGE_USAGE_SAMPLED_BIT);
+			tex->create(transferCommandBuffer, width, height, 1, const_cast<uint32_t*>(data + 4), TEXTURE_TYPE_COMPRESSED, extraUsage | VK_IMAGE_USAGE_SAMPLED_BIT);
 		}
+	}
+
+	Texture* load_texture(std::wstring textureName, VkImageUsageFlags extraUsage) {
+		Texture* tex = new Texture();
+		util::FileMapping mapping = util::map_file(L"resources/textures/" + textureName);
+		create_from_file(tex, textureName, mapping.mapping, extraUsage);
 		util::unmap_file(mapping);
 		return tex;
 	}
+
+	Texture* load_texture(job::AsyncIO& io, std::wstring textureName, VkImageUsageFlags extraUsage) {
+		job::FileRead read{};
+		if (!io.read_file_and_wait(L"resources/textures/" + textureName, read)) {
+			return nullptr;
+		}
+		Texture* tex = new Texture();
+		create_from_file(tex, textureName, read.data, extraUsage);
+		job::free_file_data(read);
+		return tex;
+	}
 }
@@ -2,6 +2,7 @@
 
 #include "VkUtil.h"
 #include "DeviceMemoryAllocator.h"
+#include "../AsyncIO.h"
 
 namespace vku {
 
@@ -45,4 +46,6 @@ namespace vku {
 	};
 
 	Texture* load_texture(std::wstring textureName, VkImageUsageFlags extraUsage);
+	//Suspends the calling job while the file is read instead of blocking the worker. Returns null if the file couldn't be read.
+	Texture* load_texture(job::AsyncIO& io, std::wstring textureName, VkImageUsageFlags extraUsage);
 }
@@ -5,10 +5,12 @@
 #include "..\..\scene\Scene.h"
 #include "..\..\resources\FileDocument.h"
 #include "..\RenderPass.h"
+#include "..\..\ScratchAllocator.h"
 #include "..\..\Engine.h"
 #include "..\..\RenderSubsystem.h"
 
 namespace vku {
+	static_assert(job::SCRATCH_FRAME_COUNT >= NUM_FRAME_DATA, "Frame scratch memory would be reused while its frame is still in flight");
 
 	void GeometrySet::add_model(geom::Model& model) {
 		modelId[setModelCount] = model.get_model_id();
@@ -563,7 +565,7 @@ namespace vku {
 		//	return a->setId < b->setId;
 		//});
 		//Transfer geometry sets to gpu
-		std::vector<VkBufferCopy> copyRanges{};
+		std::vector<VkBufferCopy, job::FrameAllocator<VkBufferCopy>> copyRanges{};
 		uint32_t setStagingStart = dataStagingOffset;
 		if (geoSets.size() > 0) {
 			uint32_t newSize = calc_resize_half_grow(gpuGeometrySets->size(), currentGeoSetCount);
@@ -11,6 +11,7 @@ namespace scene {
 
 	void Scene::init() {
 		activeObject = nullptr;
+		entityComponentSystem = new ecs::ComponentSystem(engine::jobSystem);
 		renderer = new SceneRenderer(this);
 	}
 
@@ -20,6 +21,7 @@ namespace scene {
 			delete model;
 		}
 		delete renderer;
+		delete entityComponentSystem;
 	}
 
 	void Scene::framebuffer_resized(VkCommandBuffer cmdBuf, uint32_t newX, uint32_t newY) {
@@ -30,7 +30,8 @@ namespace scene {
 		geom::SelectableObject* activeObject;
 		std::vector<geom::SelectableObject*> selectedObjects{};
 
-		ecs::ComponentSystem entityComponentSystem;
+		//Made in init, once the job system it sizes its lock from is running
+		ecs::ComponentSystem* entityComponentSystem;
 
 		SceneRenderer* renderer;
 	public:
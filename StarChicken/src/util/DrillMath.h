@@ -3,6 +3,9 @@
 #include <math.h>
 #include <assert.h>
 #include <iostream>
+#if defined(_M_X64) || defined(__x86_64__)
+#include <xmmintrin.h>
+#endif
 
 #define DM_PI 3.1415926535
 #define DM_TWO_PI (DM_PI*2)
@@ -686,7 +689,7 @@ struct mat4 {
 
 	mat4<T>& mul(mat4<T>& other, mat4<T>& dest) {
 		T temp[16];
-		//TODO replace with AVX intrinsics
+		//mat4<float> on x86-64 uses the SSE version below
 		temp[0] = mat[0] * other.mat[0] + mat[4] * other.mat[1] + mat[8] * other.mat[2] + mat[12] * other.mat[3];
 		temp[1] = mat[1] * other.mat[0] + mat[5] * other.mat[1] + mat[9] * other.mat[2] + mat[13] * other.mat[3];
 		temp[2] = mat[2] * other.mat[0] + mat[6] * other.mat[1] + mat[10] * other.mat[2] + mat[14] * other.mat[3];
@@ -925,6 +928,32 @@ struct mat4 {
 	}
 };
 
+#if defined(_M_X64) || defined(__x86_64__)
+//Each column of the result is this matrix's columns weighted by one column of other, so it's four broadcasts and multiply adds per column.
+//Every column is worked out before anything is stored, so dest can be either input.
+template<>
+inline mat4<float>& mat4<float>::mul(mat4<float>& other, mat4<float>& dest) {
+	__m128 col0 = _mm_loadu_ps(&mat[0]);
+	__m128 col1 = _mm_loadu_ps(&mat[4]);
+	__m128 col2 = _mm_loadu_ps(&mat[8]);
+	__m128 col3 = _mm_loadu_ps(&mat[12]);
+	__m128 result[4];
+	for (uint32_t i = 0; i < 4; i++) {
+		const float* column = &other.mat[i * 4];
+		__m128 sum = _mm_mul_ps(col0, _mm_set1_ps(column[0]));
+		sum = _mm_add_ps(sum, _mm_mul_ps(col1, _mm_set1_ps(column[1])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(col2, _mm_set1_ps(column[2])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(col3, _mm_set1_ps(column[3])));
+		result[i] = sum;
+	}
+	_mm_storeu_ps(&dest.mat[0], result[0]);
+	_mm_storeu_ps(&dest.mat[4], result[1]);
+	_mm_storeu_ps(&dest.mat[8], result[2]);
+	_mm_storeu_ps(&dest.mat[12], result[3]);
+	return dest;
+}
+#endif
+
 using mat4f = mat4<float>;
 using mat4d = mat4<double>;
 
@@ -2,16 +2,39 @@
 #include <iostream>
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 namespace util {
-	FileMapping map_file(std::wstring name) {
+	FileMapping map_file(std::wstring name, bool copyOnWrite) {
 		FileMapping map{};
 #ifdef _WIN32
 		HANDLE hFile = CreateFile(name.c_str(), GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
-		HANDLE mapping = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, (name + L"_mapping").c_str());
-		LPVOID fileMap = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
-		map = { hFile, mapping, fileMap };
+		HANDLE mapping = CreateFileMapping(hFile, 0, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, (name + L"_mapping").c_str());
+		LPVOID fileMap = MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+		LARGE_INTEGER size{};
+		GetFileSizeEx(hFile, &size);
+		map = { hFile, mapping, fileMap, static_cast<size_t>(size.QuadPart) };
+#else
+		int fd = open(std::filesystem::path(name).string().c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info{};
+		if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			return map;
+		}
+		void* fileMap = mmap(nullptr, info.st_size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+		if (fileMap == MAP_FAILED) {
+			close(fd);
+			return map;
+		}
+		map = { reinterpret_cast<void*>(static_cast<intptr_t>(fd)), nullptr, fileMap, static_cast<size_t>(info.st_size) };
 #endif
 		return map;
 	}
@@ -21,6 +44,11 @@ namespace util {
 		UnmapViewOfFile(mapping.mapping);
 		CloseHandle(mapping.mappingHandle);
 		CloseHandle(mapping.fileHandle);
+#else
+		if (mapping.mapping) {
+			munmap(mapping.mapping, mapping.size);
+			close(static_cast<int>(reinterpret_cast<intptr_t>(mapping.fileHandle)));
+		}
 #endif
 	}
 
@@ -35,6 +63,19 @@ namespace util {
 		uint32_t returnCode = _pclose(program);
 		std::cout << result << std::endl;
 		return returnCode;
+#else
+		FILE* program = popen(prog, "r");
+		if (!program) {
+			return -1;
+		}
+		std::string result;
+		char buffer[256];
+		while (fgets(buffer, 256, program) != NULL) {
+			result += buffer;
+		}
+		int32_t returnCode = pclose(program);
+		std::cout << result << std::endl;
+		return returnCode;
 #endif
 	}
 }
\ No newline at end of file
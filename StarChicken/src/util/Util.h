@@ -2,15 +2,19 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstring>
 
 namespace util {
 	struct FileMapping {
 		void* fileHandle;
 		void* mappingHandle;
 		void* mapping;
+		size_t size;
 	};
 
-	FileMapping map_file(std::wstring name);
+	//mapping is null if the file couldn't be mapped. With copyOnWrite the view can be written to, and writes stay private to this process.
+	FileMapping map_file(std::wstring name, bool copyOnWrite = false);
 
 	void unmap_file(FileMapping& mapping);
 
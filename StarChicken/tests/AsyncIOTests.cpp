@@ -0,0 +1,155 @@
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include "Test.h"
+#include "AsyncIO.h"
+#include "util/Util.h"
+
+using namespace job;
+
+//Contents depend on both the file and the position, so a read landing at the wrong offset or in the wrong file shows up
+static char file_byte(uint32_t file, uint64_t i) {
+	return static_cast<char>((i * 31 + file * 7 + (i >> 12)) & 0xFF);
+}
+
+static std::wstring io_test_path(uint32_t file) {
+	return (std::filesystem::temp_directory_path() / ("starchicken_io_" + std::to_string(file) + ".bin")).wstring();
+}
+
+static std::vector<std::wstring> write_io_test_files(uint32_t count, uint64_t size) {
+	std::vector<std::wstring> paths;
+	std::vector<char> contents;
+	for (uint32_t f = 0; f < count; f++) {
+		//Mix in an empty file and some odd sizes
+		uint64_t fileSize = f == 0 ? 0 : size + f * 4099;
+		contents.resize(fileSize);
+		for (uint64_t i = 0; i < fileSize; i++) {
+			contents[i] = file_byte(f, i);
+		}
+		paths.push_back(io_test_path(f));
+		std::ofstream file(std::filesystem::path(paths.back()), std::ios::binary | std::ios::trunc);
+		file.write(contents.data(), contents.size());
+	}
+	return paths;
+}
+
+static bool read_matches(FileRead& read, uint32_t file, uint64_t size) {
+	uint64_t expectedSize = file == 0 ? 0 : size + file * 4099;
+	if (!read.ok || read.size != expectedSize) {
+		return false;
+	}
+	for (uint64_t i = 0; i < read.size; i++) {
+		if (read.data[i] != file_byte(file, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//More files than the ring is deep, so some of the io_uring run spills over to the fallback threads as well
+static void check_reads(AsyncIO& io) {
+	JobSystem& js = test::job_system();
+	const uint32_t count = 40;
+	const uint64_t size = 256 * 1024;
+	std::vector<std::wstring> paths = write_io_test_files(count, size);
+	std::vector<FileRead> reads(count);
+	std::vector<JobHandle> handles;
+	for (uint32_t f = 0; f < count; f++) {
+		handles.push_back(io.read_file(paths[f], reads[f]));
+	}
+	std::atomic<uint32_t> wrong{ 0 };
+	for (uint32_t f = 0; f < count; f++) {
+		js.wait_for(handles[f]);
+		wrong += !read_matches(reads[f], f, size);
+		free_file_data(reads[f]);
+	}
+	CHECK(wrong.load() == 0);
+
+	FileRead missing;
+	CHECK(!io.read_file_and_wait(io_test_path(count + 1000), missing));
+	CHECK(missing.data == nullptr);
+
+	//Waiting from a job suspends it, so a few jobs at once all get their own file back
+	js.parallel_for(1, 9, [&](uint32_t f) {
+		FileRead read;
+		if (!io.read_file_and_wait(paths[f], read) || !read_matches(read, f, size)) {
+			wrong++;
+		}
+		free_file_data(read);
+	});
+	CHECK(wrong.load() == 0);
+	for (std::wstring& path : paths) {
+		std::filesystem::remove(std::filesystem::path(path));
+	}
+}
+
+TEST(async_reads_through_io_uring) {
+	AsyncIO io;
+	io.init(test::job_system(), 16);
+	if (!io.using_io_uring()) {
+		//Sandboxes and old kernels often block io_uring, the fallback test still covers reading
+		test::report("io_uring unavailable, skipped", 0, "");
+		return;
+	}
+	check_reads(io);
+	io.shutdown();
+	CHECK(!io.using_io_uring());
+}
+
+TEST(async_reads_through_fallback_threads) {
+	AsyncIO io;
+	io.init(test::job_system(), 0);
+	CHECK(!io.using_io_uring());
+	check_reads(io);
+}
+
+TEST(async_loader_vs_blocking_reads) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	JobSystem& js = test::job_system();
+	//Roughly what a level load pulls in, dozens of meshes and textures
+	const uint32_t count = 48;
+	const uint64_t size = 2 * 1024 * 1024;
+	std::vector<std::wstring> paths = write_io_test_files(count, size);
+
+	//How load_texture reads without an AsyncIO, one file after another on the calling worker
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t blockingBytes = 0;
+	for (uint32_t f = 0; f < count; f++) {
+		util::FileMapping mapping = util::map_file(paths[f]);
+		if (mapping.mapping) {
+			char* copy = new char[mapping.size];
+			memcpy(copy, mapping.mapping, mapping.size);
+			blockingBytes += mapping.size;
+			delete[] copy;
+			util::unmap_file(mapping);
+		}
+	}
+	test::report("48 files blocking map_file", test::milliseconds_since(start), "ms");
+
+	//Same files through the ring, then through the fallback threads alone
+	for (uint32_t queueDepth : { 64u, 0u }) {
+		AsyncIO io;
+		io.init(js, queueDepth);
+		start = std::chrono::steady_clock::now();
+		std::vector<FileRead> reads(count);
+		std::vector<JobHandle> handles;
+		for (uint32_t f = 0; f < count; f++) {
+			handles.push_back(io.read_file(paths[f], reads[f]));
+		}
+		uint64_t asyncBytes = 0;
+		for (uint32_t f = 0; f < count; f++) {
+			js.wait_for(handles[f]);
+			asyncBytes += reads[f].size;
+			free_file_data(reads[f]);
+		}
+		double asyncTime = test::milliseconds_since(start);
+		CHECK(asyncBytes == blockingBytes);
+		test::report(io.using_io_uring() ? "48 files AsyncIO io_uring" : "48 files AsyncIO fallback threads", asyncTime, "ms");
+		io.shutdown();
+	}
+	for (std::wstring& path : paths) {
+		std::filesystem::remove(std::filesystem::path(path));
+	}
+}
\ No newline at end of file
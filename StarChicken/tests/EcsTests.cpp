@@ -0,0 +1,398 @@
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <typeindex>
+#include <unordered_map>
+#include "Test.h"
+#include "EntityComponentSystem.h"
+#include "EntityCommandBuffer.h"
+
+using namespace ecs;
+
+struct Health {
+	int32_t value;
+};
+
+struct Velocity {
+	vec3f value;
+};
+
+TEST(ecs_add_remove_get_components) {
+	ComponentSystem cs{ test::job_system() };
+	const uint32_t count = 2000;
+	std::vector<Entity> ents;
+	for (uint32_t i = 0; i < count; i++) {
+		Entity e = cs.createEntity();
+		ents.push_back(e);
+		Health health{ static_cast<int32_t>(i) };
+		cs.addComponent(e, health);
+		if (i % 2 == 0) {
+			Velocity velocity{ vec3f(static_cast<float>(i), 0, 0) };
+			cs.addComponent(e, velocity);
+		}
+	}
+	CHECK(cs.entityCount() == count);
+	CHECK(Query<const Health>(cs).count() == count);
+	CHECK((Query<const Health, const Velocity>(cs).count() == count / 2));
+
+	//Moving between archetypes swaps the last row into the hole, every other entity's components have to follow
+	for (uint32_t i = 0; i < count; i += 4) {
+		cs.removeComponent<Velocity>(ents[i]);
+	}
+	for (uint32_t i = 1; i < count; i += 3) {
+		cs.removeEntity(ents[i]);
+	}
+	uint32_t wrong = 0;
+	uint32_t alive = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		bool removed = i % 3 == 1;
+		if (cs.isAlive(ents[i]) == removed) {
+			wrong++;
+			continue;
+		}
+		if (removed) {
+			continue;
+		}
+		alive++;
+		Health* health = cs.getComponent<Health>(ents[i]);
+		Velocity* velocity = cs.getComponent<Velocity>(ents[i]);
+		bool hasVelocity = i % 2 == 0 && i % 4 != 0;
+		if (!health || health->value != static_cast<int32_t>(i) || (velocity != nullptr) != hasVelocity || (velocity && velocity->value.x != static_cast<float>(i))) {
+			wrong++;
+		}
+	}
+	CHECK(wrong == 0);
+	CHECK(cs.entityCount() == alive);
+
+	uint32_t visited = 0;
+	int64_t sum = 0;
+	Query<const Health>(cs).each([&](Entity e, const Health& health) {
+		visited++;
+		sum += health.value;
+		CHECK(cs.getComponent<const Health>(e) == &health);
+	});
+	int64_t expected = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		expected += i % 3 == 1 ? 0 : i;
+	}
+	CHECK(visited == alive);
+	CHECK(sum == expected);
+}
+
+//What propagateTransforms should have produced, worked out one entity at a time from its parent
+static uint32_t count_wrong_world_transforms(ComponentSystem& cs, std::vector<Entity>& ents) {
+	uint32_t wrong = 0;
+	for (Entity e : ents) {
+		if (!cs.isAlive(e)) {
+			continue;
+		}
+		HierarchyComponent* hier = cs.getComponent<HierarchyComponent>(e);
+		mat4f local = cs.getComponent<TransformComponent>(e)->toMatrix();
+		mat4f expected = local;
+		if (hier->parent != NULL_ENTITY) {
+			cs.getComponent<HierarchyComponent>(hier->parent)->world_transform.mul(local, expected);
+		}
+		for (uint32_t i = 0; i < 16; i++) {
+			if (std::fabs(expected.mat[i] - hier->world_transform.mat[i]) > 1e-3f * (1.0f + std::fabs(expected.mat[i]))) {
+				wrong++;
+				break;
+			}
+		}
+	}
+	return wrong;
+}
+
+TEST(propagate_transforms_100k_nodes) {
+	job::JobSystem& js = test::job_system();
+	ComponentSystem cs{ test::job_system() };
+	std::mt19937 random(2);
+	const uint32_t count = 100000;
+	std::vector<Entity> ents;
+	ents.reserve(count);
+	for (uint32_t i = 0; i < count; i++) {
+		Entity e = cs.createEntity();
+		ents.push_back(e);
+		TransformComponent* transform = cs.getComponent<TransformComponent>(e);
+		transform->scale = vec3f(1, 1, 1);
+		transform->rotation.components[3] = 1;
+		transform->position = vec3f((random() % 10) * 0.1f, 0, 0);
+		cs.markTransformDirty(e);
+		//Eight children per node
+		if (i > 0) {
+			cs.makeParent(ents[(i - 1) / 8], e);
+		}
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	cs.propagateTransforms(js);
+	double fullTime = test::milliseconds_since(start);
+	CHECK(count_wrong_world_transforms(cs, ents) == 0);
+
+	//Scattered edits, removals and reparenting, then only the dirty subtrees get redone
+	for (uint32_t i = 0; i < 1000; i++) {
+		Entity e = ents[random() % count];
+		cs.getComponent<TransformComponent>(e)->position.y = static_cast<float>(random() % 5);
+		cs.markTransformDirty(e);
+	}
+	for (uint32_t i = 0; i < 200; i++) {
+		Entity e = ents[random() % count];
+		if (cs.isAlive(e)) {
+			cs.removeEntity(e);
+		}
+	}
+	for (uint32_t i = 0; i < 200; i++) {
+		Entity parent = ents[random() % count];
+		Entity child = ents[random() % count];
+		if (parent != child && cs.isAlive(parent) && cs.isAlive(child)) {
+			try {
+				cs.makeParent(parent, child);
+			} catch (std::runtime_error&) {
+				//Would have made a cycle
+			}
+		}
+	}
+	start = std::chrono::steady_clock::now();
+	cs.propagateTransforms(js);
+	double partialTime = test::milliseconds_since(start);
+	CHECK(count_wrong_world_transforms(cs, ents) == 0);
+	if (test::benchmarks_enabled()) {
+		test::report("propagate 100k nodes", fullTime, "ms");
+		test::report("propagate ~1k dirty subtrees", partialTime, "ms");
+	}
+}
+
+TEST(stale_handles_rejected_after_reuse) {
+	ComponentSystem cs{ test::job_system() };
+	Entity first = cs.createEntity();
+	Health health{ 1 };
+	cs.addComponent(first, health);
+	std::vector<Entity> stale;
+	Entity current = first;
+	//Same slot every time, only the generation moves on
+	for (uint32_t i = 0; i < 2000; i++) {
+		cs.removeEntity(current);
+		stale.push_back(current);
+		current = cs.createEntity();
+		CHECK(entity_index(current) == entity_index(first));
+		CHECK(entity_generation(current) == i + 1);
+	}
+	Health other{ 2 };
+	cs.addComponent(current, other);
+	uint32_t matched = 0;
+	for (Entity e : stale) {
+		matched += cs.isAlive(e) || cs.getComponent<Health>(e) != nullptr;
+	}
+	CHECK(matched == 0);
+	CHECK(cs.isAlive(current));
+	CHECK(cs.getComponent<Health>(current)->value == 2);
+	//Going through destroyEntities with a stale handle leaves the new owner alone
+	cs.destroyEntities(std::span<const Entity>(stale));
+	CHECK(cs.isAlive(current));
+}
+
+TEST(bulk_spawn_100k) {
+	ComponentSystem cs{ test::job_system() };
+	Archetype* archetype = cs.archetypeOf<Health, Velocity>();
+	const uint32_t count = 100000;
+	std::vector<Entity> ents(count);
+	//The first round has to allocate every chunk, the second one reuses the chunks and slots the first one freed
+	double times[2]{};
+	for (uint32_t round = 0; round < 2; round++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		cs.createEntities(count, archetype, ents.data());
+		times[round] = test::milliseconds_since(start);
+		CHECK(cs.entityCount() == count);
+		uint32_t wrong = 0;
+		for (Entity e : ents) {
+			Health* health = cs.getComponent<Health>(e);
+			wrong += !health || health->value != 0 || !cs.hasComponent<Velocity>(e);
+		}
+		CHECK(wrong == 0);
+		cs.destroyEntities(std::span<const Entity>(ents));
+		CHECK(cs.entityCount() == 0);
+		CHECK(!cs.isAlive(ents[0]));
+	}
+	if (test::benchmarks_enabled()) {
+		test::report("createEntities 100k cold", times[0], "ms");
+		test::report("createEntities 100k warm", times[1], "ms");
+	}
+}
+
+TEST(iterate_1m_transform_hierarchy) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	job::JobSystem& js = test::job_system();
+	ComponentSystem cs{ js };
+	const uint32_t count = 1000000;
+	std::vector<Entity> ents(count);
+	//Just the transform and hierarchy every entity gets
+	cs.createEntities(count, cs.archetypeOf<>(), ents.data());
+	Query<TransformComponent, const HierarchyComponent> query{ cs };
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint32_t roots = 0;
+	query.each([&](TransformComponent& transform, const HierarchyComponent& hier) {
+		transform.position.x += 1.0f;
+		roots += hier.parent == NULL_ENTITY;
+	});
+	double serialTime = test::milliseconds_since(start);
+	CHECK(roots == count);
+
+	start = std::chrono::steady_clock::now();
+	query.eachParallel(js, [](TransformComponent& transform, const HierarchyComponent&) {
+		transform.position.y += 1.0f;
+	}, 4096);
+	double parallelTime = test::milliseconds_since(start);
+
+	//What every lookup cost before archetypes, going through the entity handle each time
+	start = std::chrono::steady_clock::now();
+	for (Entity e : ents) {
+		cs.getComponent<TransformComponent>(e)->position.z += 1.0f;
+	}
+	double lookupTime = test::milliseconds_since(start);
+
+	uint32_t wrong = 0;
+	for (Entity e : ents) {
+		TransformComponent* transform = cs.getComponent<TransformComponent>(e);
+		wrong += transform->position.x != 1.0f || transform->position.y != 1.0f || transform->position.z != 1.0f;
+	}
+	CHECK(wrong == 0);
+	test::report("iterate 1M transform+hierarchy", serialTime, "ms");
+	test::report("iterate 1M transform+hierarchy in parallel", parallelTime, "ms");
+	test::report("getComponent 1M transforms by handle", lookupTime, "ms");
+}
+
+//The lookup getComponent used to start with, hashing the type to find its storage. The dense id lookup still runs after it,
+//so the gap between the two timings is what the hashing cost on every call.
+template<typename T>
+static T* get_component_through_map(ComponentSystem& cs, Entity e, std::unordered_map<std::type_index, uint32_t>& typeIds) {
+	if (typeIds.find(std::type_index(typeid(std::remove_const_t<T>))) == typeIds.end()) {
+		return nullptr;
+	}
+	return cs.getComponent<T>(e);
+}
+
+TEST(get_component_dense_ids_vs_type_map) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	ComponentSystem cs{ test::job_system() };
+	const uint32_t count = 100000;
+	std::vector<Entity> ents(count);
+	//Mixed workload, a third of the lookups miss because the entity doesn't have the component
+	cs.createEntities(count / 3, cs.archetypeOf<Health>(), ents.data());
+	cs.createEntities(count / 3, cs.archetypeOf<Velocity>(), ents.data() + count / 3);
+	cs.createEntities(count - count / 3 * 2, cs.archetypeOf<Health, Velocity>(), ents.data() + count / 3 * 2);
+	std::shuffle(ents.begin(), ents.end(), std::mt19937(7));
+	std::unordered_map<std::type_index, uint32_t> typeIds{
+		{ std::type_index(typeid(Health)), cs.componentType<Health>() },
+		{ std::type_index(typeid(Velocity)), cs.componentType<Velocity>() },
+		{ std::type_index(typeid(TransformComponent)), cs.componentType<TransformComponent>() },
+		{ std::type_index(typeid(HierarchyComponent)), cs.componentType<HierarchyComponent>() } };
+
+	const uint32_t rounds = 10;
+	uint64_t found[2]{};
+	double times[2]{};
+	for (uint32_t mode = 0; mode < 2; mode++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint32_t round = 0; round < rounds; round++) {
+			for (Entity e : ents) {
+				if (mode == 0) {
+					found[mode] += cs.getComponent<const Health>(e) != nullptr;
+					found[mode] += cs.getComponent<const Velocity>(e) != nullptr;
+					found[mode] += cs.getComponent<const TransformComponent>(e) != nullptr;
+				} else {
+					found[mode] += get_component_through_map<const Health>(cs, e, typeIds) != nullptr;
+					found[mode] += get_component_through_map<const Velocity>(cs, e, typeIds) != nullptr;
+					found[mode] += get_component_through_map<const TransformComponent>(cs, e, typeIds) != nullptr;
+				}
+			}
+		}
+		times[mode] = test::milliseconds_since(start);
+	}
+	CHECK(found[0] == found[1]);
+	CHECK(found[0] == static_cast<uint64_t>(rounds) * (count + count - count / 3 + count - count / 3));
+	double lookups = static_cast<double>(rounds) * count * 3;
+	test::report("getComponent dense type ids", times[0] * 1000000.0 / lookups, "ns");
+	test::report("getComponent behind a type_index map", times[1] * 1000000.0 / lookups, "ns");
+}
+
+TEST(each_changed_skips_untouched_chunks) {
+	ComponentSystem cs{ test::job_system() };
+	Archetype* archetype = cs.archetypeOf<Health>();
+	const uint32_t capacity = archetype->chunkCapacity;
+	const uint32_t chunkCount = 10;
+	std::vector<Entity> ents(capacity * chunkCount);
+	cs.createEntities(static_cast<uint32_t>(ents.size()), archetype, ents.data());
+	CHECK(archetype->chunks.size() == chunkCount);
+	//Filled in order, so entity i is in chunk i / capacity
+	for (uint32_t i = 0; i < ents.size(); i++) {
+		cs.getComponent<Health>(ents[i])->value = static_cast<int32_t>(i);
+	}
+	Query<const Health> query{ cs };
+	auto changed_chunks = [&](uint32_t since) {
+		std::vector<uint32_t> visits(chunkCount);
+		query.eachChanged<Health>(since, [&](const Health& health) {
+			visits[health.value / capacity]++;
+		});
+		return visits;
+	};
+
+	uint32_t since = cs.advanceVersion();
+	//Reads, through getComponent or a const query, don't count as writes
+	int64_t total = 0;
+	for (Entity e : ents) {
+		total += cs.getComponent<const Health>(e)->value;
+	}
+	query.each([&](const Health& health) {
+		total += health.value;
+	});
+	CHECK(cs.hasComponent<Health>(ents[0]));
+	CHECK(total > 0);
+	std::vector<uint32_t> visits = changed_chunks(since);
+	CHECK(std::count(visits.begin(), visits.end(), 0u) == chunkCount);
+
+	//One write in each of two chunks brings back just those two, whole
+	cs.getComponent<Health>(ents[2 * capacity + 5])->value += 0;
+	cs.getComponent<Health>(ents[7 * capacity])->value += 0;
+	visits = changed_chunks(since);
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+		CHECK(visits[chunk] == (chunk == 2 || chunk == 7 ? capacity : 0));
+	}
+
+	//Those writes are before the next version, so they don't show up again
+	since = cs.advanceVersion();
+	visits = changed_chunks(since);
+	CHECK(std::count(visits.begin(), visits.end(), 0u) == chunkCount);
+}
+
+TEST(command_buffer_creates_reuse_free_slots) {
+	job::JobSystem& js = test::job_system();
+	ComponentSystem cs{ test::job_system() };
+	EntityCommandBuffer commands(cs, js);
+	const uint32_t perRound = 1000;
+	std::vector<Entity> ents(perRound);
+	uint32_t highestIndex = 0;
+	for (uint32_t round = 0; round < 200; round++) {
+		js.parallel_for(0, perRound, [&](uint32_t i) {
+			ents[i] = commands.createEntity();
+			commands.addComponent(ents[i], Health{ static_cast<int32_t>(i) });
+		}, 16);
+		commands.playback();
+		CHECK(cs.entityCount() == perRound);
+		uint32_t wrong = 0;
+		for (uint32_t i = 0; i < perRound; i++) {
+			Health* health = cs.getComponent<Health>(ents[i]);
+			wrong += !health || health->value != static_cast<int32_t>(i);
+			highestIndex = std::max(highestIndex, entity_index(ents[i]));
+		}
+		CHECK(wrong == 0);
+		for (uint32_t i = 0; i < perRound; i++) {
+			commands.destroyEntity(ents[i]);
+		}
+		commands.playback();
+		CHECK(cs.entityCount() == 0);
+	}
+	//Every round after the first should have run entirely on the first round's slots
+	CHECK(highestIndex <= perRound);
+}
\ No newline at end of file
@@ -0,0 +1,821 @@
+#include <atomic>
+#include <thread>
+#include <numeric>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include "Test.h"
+
+using namespace job;
+
+//The deque never looks at the jobs it holds, so any distinct non null pointers will do
+static Job* fake_job(uint32_t i) {
+	return reinterpret_cast<Job*>(static_cast<uintptr_t>(i + 1) * 8);
+}
+
+static uint32_t fake_job_index(Job* job) {
+	return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(job) / 8 - 1);
+}
+
+TEST(deque_push_pop_steal_exactly_once) {
+	const uint32_t count = 500000;
+	const uint32_t thiefCount = 4;
+	std::vector<std::atomic<uint8_t>> seen(count);
+	std::atomic<uint32_t> taken{ 0 };
+	std::atomic<bool> done{ false };
+	JobQueue queue(std::this_thread::get_id(), 0);
+	std::vector<std::thread> thieves;
+	for (uint32_t t = 0; t < thiefCount; t++) {
+		thieves.emplace_back([&]() {
+			while (!done.load(std::memory_order_relaxed)) {
+				if (Job* job = queue.steal()) {
+					seen[fake_job_index(job)].fetch_add(1, std::memory_order_relaxed);
+					taken.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		});
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	//Bursts bigger than the starting ring so it has to grow while thieves are reading it
+	for (uint32_t i = 0; i < count; i++) {
+		queue.push(fake_job(i));
+		if (i % 3 == 0 || (i / 1000) % 2 == 1) {
+			if (Job* job = queue.pop()) {
+				seen[fake_job_index(job)].fetch_add(1, std::memory_order_relaxed);
+				taken.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+	while (Job* job = queue.pop()) {
+		seen[fake_job_index(job)].fetch_add(1, std::memory_order_relaxed);
+		taken.fetch_add(1, std::memory_order_relaxed);
+	}
+	while (taken.load() < count) {
+		std::this_thread::yield();
+	}
+	double elapsed = test::milliseconds_since(start);
+	done.store(true);
+	for (std::thread& thief : thieves) {
+		thief.join();
+	}
+	uint32_t wrong = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		wrong += seen[i].load() != 1;
+	}
+	CHECK(wrong == 0);
+	CHECK(taken.load() == count);
+	if (test::benchmarks_enabled()) {
+		test::report("deque push + pop/steal with 4 thieves", count / elapsed, "jobs/ms");
+	}
+}
+
+#ifdef SPIN_LOCKED_QUEUES
+static const char* QUEUE_KIND = "spin locked";
+#else
+static const char* QUEUE_KIND = "Chase-Lev";
+#endif
+
+//Built twice, once as is and once with SPIN_LOCKED_QUEUES, so the two runs give the comparison
+TEST(deque_throughput_by_worker_count) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	const uint32_t count = 1000000;
+	const uint32_t burst = 64;
+	for (uint32_t workers = 1; workers <= 64; workers *= 2) {
+		std::atomic<uint32_t> taken{ 0 };
+		std::atomic<bool> done{ false };
+		JobQueue queue(std::this_thread::get_id(), 0);
+		std::vector<std::thread> thieves;
+		for (uint32_t t = 1; t < workers; t++) {
+			thieves.emplace_back([&]() {
+				while (!done.load(std::memory_order_relaxed)) {
+					if (queue.steal()) {
+						taken.fetch_add(1, std::memory_order_relaxed);
+					} else {
+						std::this_thread::yield();
+					}
+				}
+			});
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		//The owner pushes a burst like a job fanning out, then works through it while the others steal
+		for (uint32_t i = 0; i < count; i += burst) {
+			for (uint32_t j = 0; j < burst; j++) {
+				queue.push(fake_job(i + j));
+			}
+			while (queue.pop()) {
+				taken.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		while (taken.load() < count) {
+			std::this_thread::yield();
+		}
+		double elapsed = test::milliseconds_since(start);
+		done.store(true);
+		for (std::thread& thief : thieves) {
+			thief.join();
+		}
+		CHECK(taken.load() == count);
+		std::string name = std::string(QUEUE_KIND) + " deque, " + std::to_string(workers) + " workers";
+		test::report(name.c_str(), elapsed * 1000000.0 / count, "ns/job");
+	}
+}
+
+TEST(idle_workers_park_and_wake) {
+	JobSystem& js = test::job_system();
+	auto parked = [&]() {
+		uint64_t total = 0;
+		for (WorkerStats& stats : js.worker_stats()) {
+			total += stats.parkedNanoseconds;
+		}
+		return total;
+	};
+	uint64_t before = parked();
+	//Nothing else is queued, so every other worker runs out of spins and parks
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	std::atomic<uint32_t> ran{ 0 };
+	std::vector<JobDecl> decls(1000, JobDecl([](void* arg) {
+		reinterpret_cast<std::atomic<uint32_t>*>(arg)->fetch_add(1);
+	}, &ran, JOB_STACK_SMALL));
+	js.start_jobs_and_wait_for_counter(decls.data(), static_cast<uint32_t>(decls.size()));
+	CHECK(ran.load() == 1000);
+	//Workers only add up their parked time once they wake up
+	CHECK(parked() > before);
+}
+
+TEST(parallel_for_reduce_scan_match_serial) {
+	JobSystem& js = test::job_system();
+	const uint32_t count = 1000000;
+	std::vector<uint32_t> values(count);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	js.parallel_for(0, count, [&](uint32_t i) {
+		values[i] = (i * 2654435761u) >> 16;
+	}, 1024);
+	double forTime = test::milliseconds_since(start);
+	uint32_t unset = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		unset += values[i] != (i * 2654435761u) >> 16;
+	}
+	CHECK(unset == 0);
+
+	start = std::chrono::steady_clock::now();
+	uint64_t sum = js.parallel_reduce(0, count, uint64_t(0), [&](uint32_t i) {
+		return uint64_t(values[i]);
+	}, [](uint64_t a, uint64_t b) {
+		return a + b;
+	}, 1024);
+	double reduceTime = test::milliseconds_since(start);
+	start = std::chrono::steady_clock::now();
+	uint64_t serialSum = std::accumulate(values.begin(), values.end(), uint64_t(0));
+	double serialTime = test::milliseconds_since(start);
+	CHECK(sum == serialSum);
+
+	std::vector<uint64_t> prefix(count);
+	js.parallel_scan(0, count, uint64_t(0), [&](uint32_t i) {
+		return uint64_t(values[i]);
+	}, [](uint64_t a, uint64_t b) {
+		return a + b;
+	}, [&](uint32_t i, uint64_t value) {
+		prefix[i] = value;
+	}, 1024);
+	uint64_t running = 0;
+	uint32_t wrong = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		running += values[i];
+		wrong += prefix[i] != running;
+	}
+	CHECK(wrong == 0);
+	if (test::benchmarks_enabled()) {
+		test::report("parallel_for 1M", forTime, "ms");
+		test::report("parallel_reduce 1M", reduceTime, "ms");
+		test::report("serial reduce 1M", serialTime, "ms");
+	}
+}
+
+struct FiberCheck {
+	uint32_t seed;
+	bool ok;
+};
+
+//Callee saved registers (including the float ones) have to survive every switch out and back in
+static void fiber_check_job(void* arg) {
+	FiberCheck* check = reinterpret_cast<FiberCheck*>(arg);
+	double a = check->seed * 0.5;
+	double b = check->seed * 0.25;
+	uint64_t c = check->seed * 7ull;
+	for (uint32_t i = 0; i < 20; i++) {
+		test::job_system().yield_job();
+		a += 1.0;
+		b *= 1.0;
+		c += 3;
+	}
+	check->ok = a == check->seed * 0.5 + 20.0 && b == check->seed * 0.25 && c == check->seed * 7ull + 60;
+}
+
+TEST(fibers_keep_state_across_switches) {
+	JobSystem& js = test::job_system();
+	const uint32_t count = 200;
+	std::vector<FiberCheck> checks(count);
+	std::vector<JobDecl> decls;
+	for (uint32_t i = 0; i < count; i++) {
+		checks[i] = FiberCheck{ i, false };
+		decls.push_back(JobDecl(fiber_check_job, &checks[i], i % 2 ? JOB_STACK_SMALL : JOB_STACK_LARGE));
+	}
+	js.start_jobs_and_wait_for_counter(decls.data(), count);
+	uint32_t broken = 0;
+	for (FiberCheck& check : checks) {
+		broken += !check.ok;
+	}
+	CHECK(broken == 0);
+
+	if (test::benchmarks_enabled()) {
+		const uint32_t yields = 100000;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < yields; i++) {
+			js.yield_job();
+		}
+		//Each yield switches out to the worker and back in
+		test::report("fiber switch", test::milliseconds_since(start) * 1000000.0 / (yields * 2.0), "ns");
+	}
+}
+
+TEST(linear_arena_gives_back_spikes) {
+	LinearArena arena;
+	arena.alloc(1000, 16);
+	arena.reset();
+	CHECK(arena.capacity() == SCRATCH_BLOCK_SIZE);
+
+	//A spike chains blocks, the reset merges them into one that fits it
+	for (uint32_t i = 0; i < 64; i++) {
+		arena.alloc(SCRATCH_BLOCK_SIZE / 2, 16);
+	}
+	arena.reset();
+	CHECK(arena.capacity() >= 32 * SCRATCH_BLOCK_SIZE);
+	CHECK(arena.capacity() <= SCRATCH_RETAIN_LIMIT);
+	arena.alloc(32 * SCRATCH_BLOCK_SIZE, 16);
+	arena.reset();
+
+	//Past the limit it only keeps the limit
+	for (uint32_t i = 0; i < 200; i++) {
+		arena.alloc(SCRATCH_BLOCK_SIZE, 16);
+	}
+	arena.reset();
+	CHECK(arena.capacity() == SCRATCH_RETAIN_LIMIT);
+
+	//And once use drops off again, so does the arena
+	for (uint32_t i = 0; i < 64; i++) {
+		arena.alloc(1000, 16);
+		arena.reset();
+	}
+	CHECK(arena.capacity() <= 2 * SCRATCH_BLOCK_SIZE);
+}
+
+struct OrderedJob {
+	std::atomic<uint32_t>* next;
+	uint32_t order;
+};
+
+static void record_order_job(void* arg) {
+	OrderedJob* job = reinterpret_cast<OrderedJob*>(arg);
+	job->order = job->next->fetch_add(1);
+}
+
+static void hold_worker_job(void* arg) {
+	std::atomic<int32_t>* gate = reinterpret_cast<std::atomic<int32_t>*>(arg);
+	gate->fetch_add(1);
+	while (gate->load() > 0) {
+		std::this_thread::yield();
+	}
+}
+
+TEST(priority_jobs_run_ahead_of_queued_low_work) {
+	JobSystem& js = test::job_system();
+	uint32_t others = js.thread_count() - 1;
+	//Park every other worker in a job of its own, so everything below queues up on this worker before anything can run
+	std::atomic<int32_t> gate{ 0 };
+	std::vector<JobDecl> holds(others, JobDecl(hold_worker_job, &gate, JOB_STACK_NONE));
+	JobHandle holdHandle = js.start_jobs(holds.data(), others);
+	while (gate.load() < static_cast<int32_t>(others)) {
+		std::this_thread::yield();
+	}
+
+	const uint32_t lowCount = 200;
+	std::atomic<uint32_t> next{ 0 };
+	std::vector<OrderedJob> lows(lowCount * 2, OrderedJob{ &next, 0 });
+	OrderedJob high{ &next, 0 };
+	OrderedJob critical{ &next, 0 };
+	std::vector<JobDecl> lowDecls;
+	for (OrderedJob& low : lows) {
+		lowDecls.push_back(JobDecl(record_order_job, &low, JOB_STACK_NONE, JOB_PRIORITY_LOW));
+	}
+	JobDecl highDecl(record_order_job, &high, JOB_STACK_NONE, JOB_PRIORITY_HIGH);
+	JobDecl criticalDecl(record_order_job, &critical, JOB_STACK_NONE, JOB_PRIORITY_FRAME_CRITICAL);
+	//Low work on both sides, so neither the owner popping newest first nor thieves taking oldest first would find the high job early on their own
+	JobHandle handles[4]{ js.start_jobs(lowDecls.data(), lowCount), js.start_jobs(&highDecl, 1), js.start_jobs(&criticalDecl, 1),
+		js.start_jobs(lowDecls.data() + lowCount, lowCount) };
+	gate.store(-1);
+	for (JobHandle& handle : handles) {
+		js.wait_for(handle);
+	}
+	js.wait_for(holdHandle);
+	//A worker that was already between jobs could start a low one at the same moment, but no more than one per worker
+	CHECK(critical.order < js.thread_count());
+	CHECK(high.order < js.thread_count() + 1);
+	CHECK(next.load() == lowCount * 2 + 2);
+}
+
+static void spin_job(void* arg) {
+	double microseconds = *reinterpret_cast<double*>(arg);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (test::milliseconds_since(start) * 1000.0 < microseconds) {
+	}
+}
+
+struct ProbeJob {
+	std::chrono::steady_clock::time_point started;
+};
+
+static void probe_job(void* arg) {
+	reinterpret_cast<ProbeJob*>(arg)->started = std::chrono::steady_clock::now();
+}
+
+TEST(priority_latency_under_background_load) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	JobSystem& js = test::job_system();
+	const uint32_t rounds = 20;
+	const uint32_t backgroundCount = 400;
+	double backgroundMicroseconds = 20.0;
+	std::vector<JobDecl> background(backgroundCount, JobDecl(spin_job, &backgroundMicroseconds, JOB_STACK_NONE, JOB_PRIORITY_LOW));
+	const JobPriority priorities[]{ JOB_PRIORITY_FRAME_CRITICAL, JOB_PRIORITY_HIGH, JOB_PRIORITY_NORMAL, JOB_PRIORITY_LOW };
+	const char* names[]{ "frame critical", "high", "normal", "low" };
+	for (uint32_t p = 0; p < 4; p++) {
+		double total = 0;
+		double worst = 0;
+		for (uint32_t round = 0; round < rounds; round++) {
+			ProbeJob probe{};
+			JobDecl probeDecl(probe_job, &probe, JOB_STACK_NONE, priorities[p]);
+			//Queued in the middle of the background work, like in priority_jobs_run_ahead_of_queued_low_work
+			JobHandle firstHalf = js.start_jobs(background.data(), backgroundCount / 2);
+			std::chrono::steady_clock::time_point pushed = std::chrono::steady_clock::now();
+			JobHandle probeHandle = js.start_jobs(&probeDecl, 1);
+			JobHandle secondHalf = js.start_jobs(background.data() + backgroundCount / 2, backgroundCount / 2);
+			js.wait_for(probeHandle);
+			js.wait_for(firstHalf);
+			js.wait_for(secondHalf);
+			double latency = std::chrono::duration<double, std::micro>(probe.started - pushed).count();
+			total += latency;
+			worst = std::max(worst, latency);
+		}
+		test::report((std::string(names[p]) + " job start latency behind 400 low jobs, mean").c_str(), total / rounds, "us");
+		test::report((std::string(names[p]) + " job start latency behind 400 low jobs, worst").c_str(), worst, "us");
+	}
+}
+
+struct LockedCounters {
+	uint64_t first = 0;
+	uint64_t second = 0;
+};
+
+template<typename Lock>
+static void check_rw_lock(Lock& lock, const char* name) {
+	JobSystem& js = test::job_system();
+	LockedCounters counters{};
+	std::atomic<uint32_t> torn{ 0 };
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	js.parallel_for(0, 256, [&](uint32_t i) {
+		for (uint32_t n = 0; n < 200; n++) {
+			if ((i + n) % 8 == 0) {
+				WSPIN_LOCK(lock);
+				counters.first++;
+				counters.second++;
+			} else {
+				RSPIN_LOCK(lock);
+				if (counters.first != counters.second) {
+					torn.fetch_add(1);
+				}
+			}
+		}
+	});
+	double elapsed = test::milliseconds_since(start);
+	CHECK(torn.load() == 0);
+	CHECK(counters.first == 256 * 200 / 8);
+	CHECK(counters.second == counters.first);
+	if (test::benchmarks_enabled()) {
+		test::report(name, elapsed, "ms");
+	}
+}
+
+TEST(locks_exclude_writers) {
+	JobSystem& js = test::job_system();
+	SpinLock spinLock{};
+	JobMutex mutex{};
+	uint64_t spinCount = 0;
+	uint64_t mutexCount = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	js.parallel_for(0, 64, [&](uint32_t) {
+		for (uint32_t n = 0; n < 1000; n++) {
+			SPIN_LOCK(spinLock);
+			spinCount++;
+		}
+	});
+	double spinTime = test::milliseconds_since(start);
+	start = std::chrono::steady_clock::now();
+	js.parallel_for(0, 64, [&](uint32_t) {
+		for (uint32_t n = 0; n < 1000; n++) {
+			JOB_LOCK(mutex);
+			mutexCount++;
+		}
+	});
+	double mutexTime = test::milliseconds_since(start);
+	CHECK(spinCount == 64000);
+	CHECK(mutexCount == 64000);
+	if (test::benchmarks_enabled()) {
+		test::report("SpinLock 64x1000 contended", spinTime, "ms");
+		test::report("JobMutex 64x1000 contended", mutexTime, "ms");
+	}
+
+	RWSpinLock rwLock{};
+	check_rw_lock(rwLock, "RWSpinLock 1 in 8 writes");
+	RWSpinLock writerFirst{ true };
+	check_rw_lock(writerFirst, "RWSpinLock preferring writers");
+	DistributedRWLock distributed{ js };
+	check_rw_lock(distributed, "DistributedRWLock 1 in 8 writes");
+	JobRWLock jobLock{};
+	check_rw_lock(jobLock, "JobRWLock 1 in 8 writes");
+}
+
+static LockStatsSnapshot find_lock_stats(const char* name) {
+	for (LockStatsSnapshot& stats : lock_stats()) {
+		if (strcmp(stats.name, name) == 0) {
+			return stats;
+		}
+	}
+	return LockStatsSnapshot{ name, 0, 0, 0, 0, 0 };
+}
+
+TEST(lock_stats_time_exclusive_and_shared_holds) {
+	RWSpinLock rwLock{ true };
+	rwLock.track_stats("test RWSpinLock");
+	rwLock.lock_read();
+	//A second reader on the same thread gets its own start time
+	rwLock.lock_read();
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	rwLock.unlock_read();
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	rwLock.unlock_read();
+	rwLock.lock_write();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	rwLock.unlock_write();
+	LockStatsSnapshot rwStats = find_lock_stats("test RWSpinLock");
+	CHECK(rwStats.acquisitions == 3);
+	CHECK(rwStats.contended == 0);
+	CHECK(rwStats.maxSharedHoldNanoseconds >= 4000000);
+	CHECK(rwStats.maxHoldNanoseconds >= 1000000);
+	CHECK(rwStats.maxHoldNanoseconds < rwStats.maxSharedHoldNanoseconds);
+
+	//Two locks under one name come back as one entry
+	SpinLock first{};
+	SpinLock second{};
+	first.track_stats("test SpinLock pair");
+	second.track_stats("test SpinLock pair");
+	first.lock();
+	first.unlock();
+	second.lock();
+	second.unlock();
+	CHECK(find_lock_stats("test SpinLock pair").acquisitions == 2);
+	CHECK(find_lock_stats("test SpinLock pair").maxSharedHoldNanoseconds == 0);
+
+	//The job system tracks its own locks, and this test is running in a job it had to take from the pool
+	CHECK(find_lock_stats("Job pool").acquisitions > 0);
+}
+
+struct WriterCheck {
+	JobRWLock* lock;
+	std::atomic<bool> writerIn{ false };
+	bool readerSawWriter = false;
+};
+
+static void rw_writer_job(void* arg) {
+	WriterCheck* check = reinterpret_cast<WriterCheck*>(arg);
+	check->lock->lock_write();
+	check->writerIn.store(true);
+	check->lock->unlock_write();
+}
+
+static void rw_reader_job(void* arg) {
+	WriterCheck* check = reinterpret_cast<WriterCheck*>(arg);
+	check->lock->lock_read();
+	check->readerSawWriter = check->writerIn.load();
+	check->lock->unlock_read();
+}
+
+TEST(job_rw_lock_lets_waiting_writer_in_first) {
+	JobSystem& js = test::job_system();
+	JobRWLock lock{};
+	WriterCheck check{ &lock };
+	lock.lock_read();
+	JobDecl writer(rw_writer_job, &check, JOB_STACK_SMALL);
+	JobHandle writerHandle = js.start_jobs(&writer, 1);
+	//Once the writer is waiting, new readers have to queue up behind it even though the lock is only read locked
+	bool blocked = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (!blocked && test::milliseconds_since(start) < 2000) {
+		if (lock.try_lock_read()) {
+			lock.unlock_read();
+			js.yield_job();
+		} else {
+			blocked = true;
+		}
+	}
+	CHECK(blocked);
+	JobDecl reader(rw_reader_job, &check, JOB_STACK_SMALL);
+	JobHandle readerHandle = js.start_jobs(&reader, 1);
+	lock.unlock_read();
+	js.wait_for(writerHandle);
+	js.wait_for(readerHandle);
+	CHECK(check.writerIn.load());
+	CHECK(check.readerSawWriter);
+	CHECK(lock.try_lock_read());
+	lock.unlock_read();
+}
+
+struct EventCheck {
+	JobEvent* event;
+	std::atomic<uint32_t> woken{ 0 };
+};
+
+static void event_waiter_job(void* arg) {
+	EventCheck* check = reinterpret_cast<EventCheck*>(arg);
+	check->event->wait();
+	check->woken.fetch_add(1);
+}
+
+TEST(job_event_wakes_waiters) {
+	JobSystem& js = test::job_system();
+	const uint32_t count = 32;
+
+	//Manual reset lets every waiter through and stays set
+	JobEvent gate{ false };
+	EventCheck gateCheck{ &gate };
+	std::vector<JobDecl> decls(count, JobDecl(event_waiter_job, &gateCheck, JOB_STACK_SMALL));
+	JobHandle handle = js.start_jobs(decls.data(), count);
+	for (uint32_t y = 0; y < 100; y++) {
+		js.yield_job();
+	}
+	CHECK(gateCheck.woken.load() == 0);
+	gate.set();
+	js.wait_for(handle);
+	CHECK(gateCheck.woken.load() == count);
+	CHECK(gate.is_set());
+	gate.reset();
+	CHECK(!gate.is_set());
+
+	//Auto reset hands each set to exactly one waiter
+	JobEvent handoff{ true };
+	EventCheck handoffCheck{ &handoff };
+	decls.assign(count, JobDecl(event_waiter_job, &handoffCheck, JOB_STACK_SMALL));
+	handle = js.start_jobs(decls.data(), count);
+	bool oneAtATime = true;
+	for (uint32_t n = 0; n < count; n++) {
+		handoff.set();
+		while (handoffCheck.woken.load() < n + 1) {
+			js.yield_job();
+		}
+		//Give a second waiter the chance to sneak through on the same set
+		for (uint32_t y = 0; y < 10; y++) {
+			js.yield_job();
+		}
+		oneAtATime = oneAtATime && handoffCheck.woken.load() == n + 1;
+	}
+	js.wait_for(handle);
+	CHECK(handoffCheck.woken.load() == count);
+	CHECK(oneAtATime);
+	CHECK(!handoff.is_set());
+
+	JobEvent preset{ true, true };
+	preset.wait();
+	CHECK(!preset.is_set());
+}
+
+TEST(job_semaphore_limits_holders) {
+	JobSystem& js = test::job_system();
+	const int32_t slots = 3;
+	JobSemaphore semaphore{ slots };
+	std::atomic<int32_t> holders{ 0 };
+	std::atomic<int32_t> mostHolders{ 0 };
+	std::atomic<uint32_t> acquired{ 0 };
+	js.parallel_for(0, 64, [&](uint32_t) {
+		for (uint32_t n = 0; n < 50; n++) {
+			semaphore.acquire();
+			int32_t now = holders.fetch_add(1) + 1;
+			int32_t most = mostHolders.load();
+			while (now > most && !mostHolders.compare_exchange_weak(most, now)) {
+			}
+			acquired.fetch_add(1);
+			js.yield_job();
+			holders.fetch_add(-1);
+			semaphore.release();
+		}
+	});
+	CHECK(acquired.load() == 64 * 50);
+	CHECK(mostHolders.load() <= slots);
+	//Every slot came back
+	for (int32_t i = 0; i < slots; i++) {
+		CHECK(semaphore.try_acquire());
+	}
+	CHECK(!semaphore.try_acquire());
+	semaphore.release(slots);
+}
+
+struct GraphNodeCheck {
+	std::atomic<uint32_t>* clock;
+	uint32_t ranAt;
+	uint32_t runs;
+};
+
+static void graph_node_job(void* arg) {
+	GraphNodeCheck* check = reinterpret_cast<GraphNodeCheck*>(arg);
+	//Give anything that isn't actually waiting on this node the chance to overtake it
+	test::job_system().yield_job();
+	check->ranAt = check->clock->fetch_add(1);
+	check->runs++;
+}
+
+TEST(task_graph_runs_nodes_after_dependencies) {
+	JobSystem& js = test::job_system();
+	std::atomic<uint32_t> clock{ 0 };
+	GraphNodeCheck checks[9];
+	for (GraphNodeCheck& check : checks) {
+		check = { &clock, 0, 0 };
+	}
+	//0 fans out to 1-4, which fan in to 5, then 6. 7 is a second root with nothing to wait for.
+	TaskGraph graph;
+	for (uint32_t i = 0; i < 8; i++) {
+		CHECK(graph.add_node(JobDecl(graph_node_job, &checks[i], JOB_STACK_SMALL)) == i);
+	}
+	for (uint32_t i = 1; i <= 4; i++) {
+		graph.add_dependency(0, i);
+		graph.add_dependency(i, 5);
+	}
+	graph.add_dependency(5, 6);
+
+	//The same graph runs again with nothing rebuilt, and picks up a node added between runs
+	for (uint32_t run = 1; run <= 4; run++) {
+		if (run == 4) {
+			graph.add_node(JobDecl(graph_node_job, &checks[8], JOB_STACK_SMALL));
+			graph.add_dependency(6, 8);
+		}
+		clock.store(0);
+		graph.run(js);
+		uint32_t nodeCount = run == 4 ? 9 : 8;
+		CHECK(clock.load() == nodeCount);
+		for (uint32_t i = 0; i < nodeCount; i++) {
+			CHECK(checks[i].runs == (i == 8 ? 1 : run));
+		}
+		for (uint32_t i = 1; i <= 4; i++) {
+			CHECK(checks[0].ranAt < checks[i].ranAt);
+			CHECK(checks[i].ranAt < checks[5].ranAt);
+		}
+		CHECK(checks[5].ranAt < checks[6].ranAt);
+		if (run == 4) {
+			CHECK(checks[6].ranAt < checks[8].ranAt);
+		}
+	}
+
+	//A cycle is caught before anything gets scheduled
+	TaskGraph cyclic;
+	uint32_t a = cyclic.add_node(JobDecl(graph_node_job, &checks[0], JOB_STACK_SMALL));
+	uint32_t b = cyclic.add_node(JobDecl(graph_node_job, &checks[1], JOB_STACK_SMALL));
+	cyclic.add_node(JobDecl(graph_node_job, &checks[2], JOB_STACK_SMALL));
+	cyclic.add_dependency(a, b);
+	cyclic.add_dependency(b, a);
+	bool threw = false;
+	try {
+		cyclic.run(js);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	CHECK(threw);
+	CHECK(checks[2].runs == 4);
+}
+
+static void count_after_yield_job(void* arg) {
+	test::job_system().yield_job();
+	reinterpret_cast<std::atomic<uint32_t>*>(arg)->fetch_add(1);
+}
+
+TEST(job_handles_wait_from_jobs_threads_and_after_completion) {
+	JobSystem& js = test::job_system();
+	const uint32_t count = 64;
+	std::atomic<uint32_t> ran{ 0 };
+	std::vector<JobDecl> decls(count, JobDecl(count_after_yield_job, &ran, JOB_STACK_SMALL));
+
+	//From a job, the waiter suspends until the last job finishes
+	JobHandle handle = js.start_jobs(decls.data(), count);
+	js.wait_for(handle);
+	CHECK(ran.load() == count);
+	CHECK(!handle.valid());
+	//Waiting on a handle that's already been released does nothing
+	js.wait_for(handle);
+	CHECK(js.is_complete(handle));
+
+	//Already finished before anyone waits, so wait_for just hands the counter back
+	ran.store(0);
+	handle = js.start_jobs(decls.data(), count);
+	while (!js.is_complete(handle)) {
+		js.yield_job();
+	}
+	CHECK(ran.load() == count);
+	js.wait_for(handle);
+	CHECK(!handle.valid());
+	JobHandle none = js.start_jobs(nullptr, 0);
+	CHECK(js.is_complete(none));
+	js.wait_for(none);
+	JobHandle manual = js.make_handle(2);
+	CHECK(!js.is_complete(manual));
+	js.complete(manual);
+	js.complete(manual);
+	CHECK(js.is_complete(manual));
+	js.wait_for(manual);
+
+	//From a thread that isn't a worker, it can't suspend so it yields the thread until the jobs are done
+	ran.store(0);
+	handle = js.start_jobs(decls.data(), count);
+	std::atomic<bool> threadDone{ false };
+	uint32_t ranWhenThreadWoke = 0;
+	std::thread waiter([&]() {
+		js.wait_for(handle);
+		ranWhenThreadWoke = ran.load();
+		threadDone.store(true);
+	});
+	while (!threadDone.load()) {
+		js.yield_job();
+	}
+	waiter.join();
+	CHECK(ranWhenThreadWoke == count);
+	CHECK(!handle.valid());
+
+	//Same for a handle that jobs complete by hand
+	manual = js.make_handle(count);
+	threadDone.store(false);
+	std::thread manualWaiter([&]() {
+		js.wait_for(manual);
+		threadDone.store(true);
+	});
+	js.parallel_for(0, count, [&](uint32_t) {
+		js.complete(manual);
+	});
+	while (!threadDone.load()) {
+		js.yield_job();
+	}
+	manualWaiter.join();
+	CHECK(!manual.valid());
+}
+
+//Plain threads standing in for workers. They get a worker id like a real worker would, since that's how the distributed lock picks a reader slot.
+template<typename Lock>
+static double time_readers(Lock& lock, uint32_t readerCount, uint32_t readsPerReader) {
+	std::atomic<uint32_t> ready{ 0 };
+	std::vector<std::thread> readers;
+	for (uint32_t r = 0; r < readerCount; r++) {
+		readers.emplace_back([&, r]() {
+			threadData = new JobThreadData{};
+			threadData->threadId = r;
+			ready.fetch_add(1);
+			while (ready.load() < readerCount) {
+				std::this_thread::yield();
+			}
+			for (uint32_t n = 0; n < readsPerReader; n++) {
+				RSPIN_LOCK(lock);
+			}
+			delete threadData;
+			threadData = nullptr;
+		});
+	}
+	while (ready.load() < readerCount) {
+		std::this_thread::yield();
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (std::thread& reader : readers) {
+		reader.join();
+	}
+	return test::milliseconds_since(start) * 1000000.0 / (static_cast<double>(readerCount) * readsPerReader);
+}
+
+TEST(read_lock_scaling_by_reader_count) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	const uint32_t readsPerReader = 200000;
+	for (uint32_t readers = 2; readers <= 64; readers *= 2) {
+		RWSpinLock shared{};
+		DistributedRWLock distributed{ readers };
+		double sharedTime = time_readers(shared, readers, readsPerReader);
+		double distributedTime = time_readers(distributed, readers, readsPerReader);
+		test::report(("RWSpinLock read, " + std::to_string(readers) + " readers").c_str(), sharedTime, "ns");
+		test::report(("DistributedRWLock read, " + std::to_string(readers) + " readers").c_str(), distributedTime, "ns");
+	}
+}
\ No newline at end of file
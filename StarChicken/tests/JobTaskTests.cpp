@@ -0,0 +1,111 @@
+#include <atomic>
+#include "Test.h"
+#include "JobTask.h"
+
+using namespace job;
+
+static std::atomic<int64_t> leafTotal{ 0 };
+static std::atomic<int64_t> parentTotal{ 0 };
+
+static void add_to_leaf_total(void* arg) {
+	leafTotal.fetch_add(static_cast<int64_t>(reinterpret_cast<intptr_t>(arg)), std::memory_order_relaxed);
+}
+
+static Task<int64_t> child_task(int64_t i) {
+	JobDecl decls[2]{ JobDecl(add_to_leaf_total, reinterpret_cast<void*>(static_cast<intptr_t>(i)), JOB_STACK_SMALL), JobDecl(add_to_leaf_total, reinterpret_cast<void*>(static_cast<intptr_t>(1)), JOB_STACK_SMALL) };
+	JobSystem& js = test::job_system();
+	JobHandle handle = js.start_jobs(decls, 2);
+	co_await when_complete(js, handle);
+	co_return i * 2;
+}
+
+static Task<void> parent_task(int64_t i) {
+	co_await schedule(test::job_system(), JOB_PRIORITY_LOW);
+	int64_t first = co_await child_task(i);
+	int64_t second = co_await child_task(i + 1);
+	parentTotal.fetch_add(first + second, std::memory_order_relaxed);
+}
+
+//Detached tasks free their frame from inside the resume decl's func, which is the path that used to read the decl after it was gone. Run under ASan to catch that.
+TEST(detached_tasks_with_nested_awaits) {
+	const int64_t count = 5000;
+	JobSystem& js = test::job_system();
+	leafTotal = 0;
+	parentTotal = 0;
+	std::vector<JobHandle> handles;
+	handles.reserve(count);
+	for (int64_t i = 0; i < count; i++) {
+		handles.push_back(start_task(js, parent_task(i)));
+	}
+	for (JobHandle& handle : handles) {
+		js.wait_for(handle);
+	}
+	int64_t expectedParent = 0;
+	int64_t expectedLeaf = 0;
+	for (int64_t i = 0; i < count; i++) {
+		expectedParent += 2 * i + 2 * (i + 1);
+		expectedLeaf += i + (i + 1) + 2;
+	}
+	CHECK(parentTotal.load() == expectedParent);
+	CHECK(leafTotal.load() == expectedLeaf);
+}
+
+static Task<int64_t> trivial_task(int64_t i) {
+	co_return i;
+}
+
+//Each schedule puts the task back on a worker through a stackless job, the coroutine version of a fiber yield
+static Task<void> reschedule_loop(uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		co_await schedule(test::job_system());
+	}
+}
+
+static Task<void> await_trivial_loop(uint32_t count, int64_t& total) {
+	for (uint32_t i = 0; i < count; i++) {
+		total += co_await trivial_task(i);
+		//Unoptimized builds don't turn the symmetric transfer back into the parent into a tail call, so every await that finishes
+		//right away leaves a frame on the worker's stack. Going back through the scheduler now and then starts it over.
+		if (i % 256 == 255) {
+			co_await schedule(test::job_system());
+		}
+	}
+}
+
+//Timed next to the fiber switch in fibers_keep_state_across_switches
+TEST(task_resume_cost_and_frame_size) {
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	JobSystem& js = test::job_system();
+	const uint32_t count = 100000;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	JobHandle handle = start_task(js, reschedule_loop(count));
+	js.wait_for(handle);
+	test::report("task resume via schedule", test::milliseconds_since(start) * 1000000.0 / count, "ns");
+
+	int64_t total = 0;
+	start = std::chrono::steady_clock::now();
+	handle = start_task(js, await_trivial_loop(count, total));
+	js.wait_for(handle);
+	double awaitTime = test::milliseconds_since(start);
+	CHECK(total == static_cast<int64_t>(count) * (count - 1) / 2);
+	//Creating, running and freeing a child task, resumed straight through without going back to a worker (plus 1/256 of a schedule)
+	test::report("co_await child task", awaitTime * 1000000.0 / count, "ns");
+
+	//Tasks are lazy, so the frame is allocated by the call and nothing else runs before the task is dropped
+	TaskFrameStats before = task_frame_stats();
+	{
+		Task<int64_t> task = trivial_task(0);
+	}
+	TaskFrameStats after = task_frame_stats();
+	CHECK(after.frames == before.frames + 1);
+	test::report("trivial_task frame", static_cast<double>(after.bytes - before.bytes), "bytes");
+	before = after;
+	{
+		Task<void> task = reschedule_loop(0);
+	}
+	after = task_frame_stats();
+	test::report("reschedule_loop frame", static_cast<double>(after.bytes - before.bytes), "bytes");
+}
\ No newline at end of file
@@ -0,0 +1,254 @@
+#include <cmath>
+#include <fstream>
+#include <filesystem>
+#include "Test.h"
+#include "EntityComponentSystem.h"
+
+using namespace ecs;
+
+struct SnapshotVelocity {
+	float x;
+	float y;
+	float z;
+};
+
+struct SnapshotTag {
+	uint32_t id;
+};
+
+static std::wstring snapshot_path(const wchar_t* name) {
+	return (std::filesystem::temp_directory_path() / name).wstring();
+}
+
+static void set_local_transform(ComponentSystem& cs, Entity e, vec3f position) {
+	TransformComponent* transform = cs.getComponent<TransformComponent>(e);
+	transform->position = position;
+	transform->rotation.components[3] = 1;
+	transform->scale = vec3f(1, 1, 1);
+}
+
+//Loads into a fresh system, which should refuse the file and stay empty
+static bool snapshot_rejected(const std::wstring& path) {
+	ComponentSystem cs{ test::job_system() };
+	cs.componentType<SnapshotVelocity>();
+	cs.componentType<SnapshotTag>();
+	bool threw = false;
+	try {
+		cs.loadSnapshot(path);
+	} catch (std::runtime_error&) {
+		threw = true;
+	}
+	return threw && cs.entityCount() == 0;
+}
+
+TEST(snapshot_round_trip) {
+	job::JobSystem& js = test::job_system();
+	const uint32_t count = 5000;
+	const uint32_t treeSize = 500;
+	std::vector<Entity> ents(count);
+	std::wstring path = snapshot_path(L"starchicken_round_trip.snap");
+	{
+		ComponentSystem cs{ js };
+		cs.createEntities(count / 2, cs.archetypeOf<SnapshotVelocity>(), ents.data());
+		cs.createEntities(count / 2, cs.archetypeOf<SnapshotVelocity, SnapshotTag>(), ents.data() + count / 2);
+		CHECK(cs.archetypeOf<SnapshotVelocity>()->chunks.size() > 1);
+		for (uint32_t i = 0; i < count; i++) {
+			cs.getComponent<SnapshotVelocity>(ents[i])->x = static_cast<float>(i);
+			if (i >= count / 2) {
+				cs.getComponent<SnapshotTag>(ents[i])->id = i;
+			}
+			set_local_transform(cs, ents[i], vec3f(i * 0.01f, 0, 0));
+		}
+		for (uint32_t i = 1; i < treeSize; i++) {
+			cs.makeParent(ents[(i - 1) / 4], ents[i]);
+		}
+		cs.propagateTransforms(js);
+		//Left pending on purpose, the loaded system has to pick these up
+		for (uint32_t i = 0; i < treeSize; i += 50) {
+			cs.getComponent<TransformComponent>(ents[i])->position.y = 1;
+			cs.markTransformDirty(ents[i]);
+		}
+		//Leaves free slots in the entity table
+		cs.destroyEntities(std::span<const Entity>(ents.data() + 1000, 100));
+		cs.saveSnapshot(path);
+	}
+	{
+		ComponentSystem loaded{ js };
+		//Registered in a different order than when it was saved, types are matched up by name
+		loaded.componentType<SnapshotTag>();
+		loaded.componentType<SnapshotVelocity>();
+		loaded.loadSnapshot(path);
+		CHECK(loaded.entityCount() == count - 100);
+		uint32_t wrong = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			bool removed = i >= 1000 && i < 1100;
+			if (loaded.isAlive(ents[i]) == removed) {
+				wrong++;
+				continue;
+			}
+			if (removed) {
+				continue;
+			}
+			SnapshotVelocity* velocity = loaded.getComponent<SnapshotVelocity>(ents[i]);
+			SnapshotTag* tag = loaded.getComponent<SnapshotTag>(ents[i]);
+			if (!velocity || velocity->x != static_cast<float>(i) || (tag != nullptr) != (i >= count / 2) || (tag && tag->id != i)) {
+				wrong++;
+			}
+		}
+		CHECK(wrong == 0);
+
+		uint32_t badLinks = 0;
+		for (uint32_t i = 1; i < treeSize; i++) {
+			badLinks += loaded.getComponent<const HierarchyComponent>(ents[i])->parent != ents[(i - 1) / 4];
+		}
+		CHECK(badLinks == 0);
+		CHECK(loaded.getComponent<const HierarchyComponent>(ents[0])->dirty);
+		loaded.propagateTransforms(js);
+		uint32_t badTransforms = 0;
+		for (uint32_t i = 0; i < treeSize; i++) {
+			const HierarchyComponent* hier = loaded.getComponent<const HierarchyComponent>(ents[i]);
+			mat4f expected = loaded.getComponent<TransformComponent>(ents[i])->toMatrix();
+			if (hier->parent != NULL_ENTITY) {
+				mat4f local = expected;
+				loaded.getComponent<HierarchyComponent>(hier->parent)->world_transform.mul(local, expected);
+			}
+			for (uint32_t m = 0; m < 16; m++) {
+				if (std::fabs(expected.mat[m] - hier->world_transform.mat[m]) > 1e-4f * (1.0f + std::fabs(expected.mat[m]))) {
+					badTransforms++;
+					break;
+				}
+			}
+		}
+		CHECK(badTransforms == 0);
+
+		//The free list came along, so a new entity lands in one of the removed slots with a newer generation
+		Entity reused = loaded.createEntity();
+		CHECK(entity_index(reused) >= entity_index(ents[1000]) && entity_index(reused) <= entity_index(ents[1099]));
+		CHECK(!loaded.isAlive(ents[1000 + (entity_index(reused) - entity_index(ents[1000]))]));
+		//Structural changes still work on chunks that live in the mapping
+		loaded.destroyEntities(std::span<const Entity>(ents.data() + count / 2, 1000));
+		CHECK(loaded.entityCount() == count - 100 + 1 - 1000);
+	}
+	std::filesystem::remove(std::filesystem::path(path));
+}
+
+TEST(snapshot_rejects_bad_files) {
+	std::wstring path = snapshot_path(L"starchicken_valid.snap");
+	std::wstring badPath = snapshot_path(L"starchicken_bad.snap");
+	{
+		ComponentSystem cs{ test::job_system() };
+		std::vector<Entity> ents(3000);
+		cs.createEntities(3000, cs.archetypeOf<SnapshotVelocity, SnapshotTag>(), ents.data());
+		cs.saveSnapshot(path);
+	}
+	std::vector<char> bytes;
+	{
+		std::ifstream file(std::filesystem::path(path), std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	auto write_bad = [&](size_t size, size_t patchOffset, uint32_t patch) {
+		std::vector<char> copy(bytes.begin(), bytes.begin() + size);
+		if (patchOffset + sizeof(patch) <= copy.size()) {
+			memcpy(copy.data() + patchOffset, &patch, sizeof(patch));
+		}
+		std::ofstream file(std::filesystem::path(badPath), std::ios::binary | std::ios::trunc);
+		file.write(copy.data(), copy.size());
+	};
+	uint32_t version = 0;
+	memcpy(&version, bytes.data() + sizeof(uint32_t), sizeof(version));
+
+	//Missing the end of the last chunk
+	write_bad(bytes.size() - 100, bytes.size(), 0);
+	CHECK(snapshot_rejected(badPath));
+	//Not even a whole header
+	write_bad(10, bytes.size(), 0);
+	CHECK(snapshot_rejected(badPath));
+	//Written by another version of the format
+	write_bad(bytes.size(), sizeof(uint32_t), version + 1);
+	CHECK(snapshot_rejected(badPath));
+	write_bad(bytes.size(), sizeof(uint32_t), version - 1);
+	CHECK(snapshot_rejected(badPath));
+	//Entity count that would run the tables into the chunks (header is magic, version, then 6 other counts before entitySlots)
+	write_bad(bytes.size(), sizeof(uint32_t) * 8, 0x0FFFFFFF);
+	CHECK(snapshot_rejected(badPath));
+
+	//Where the tables start, from the header's counts: 12 uint32 fields then namesSize and chunksOffset
+	auto header_field = [&](size_t index) {
+		uint32_t value = 0;
+		memcpy(&value, bytes.data() + index * sizeof(uint32_t), sizeof(value));
+		return value;
+	};
+	uint64_t namesSize = 0;
+	memcpy(&namesSize, bytes.data() + sizeof(uint32_t) * 12, sizeof(namesSize));
+	uint32_t chunkCount = header_field(7);
+	//A type record is 4 uint32, an archetype record is mask, capacity, entity count, first chunk, chunk count, then an offset per type
+	size_t archetypeOffset = 64 + header_field(5) * sizeof(uint32_t) * 4 + namesSize;
+	size_t archetypeSize = sizeof(uint64_t) + sizeof(uint32_t) * (4 + MAX_COMPONENT_TYPES);
+	//An entity record is chunk, row, generation. Slot 0 is never handed out, so slot 1 is the first entity.
+	size_t entityOffset = archetypeOffset + header_field(6) * archetypeSize + header_field(10) * sizeof(Entity) + sizeof(uint32_t) * 3;
+	//Chunk range running past the end of the file's chunks
+	write_bad(bytes.size(), archetypeOffset + sizeof(uint64_t) + sizeof(uint32_t) * 3, 0xFFFFFFFF);
+	CHECK(snapshot_rejected(badPath));
+	//Mask bit for a type that isn't in the saved types table
+	write_bad(bytes.size(), archetypeOffset + sizeof(uint32_t), 0x80000000);
+	CHECK(snapshot_rejected(badPath));
+	//Entity pointing past the last chunk, then past the last row of its chunk
+	write_bad(bytes.size(), entityOffset, chunkCount);
+	CHECK(snapshot_rejected(badPath));
+	write_bad(bytes.size(), entityOffset + sizeof(uint32_t), 0xFFFFF);
+	CHECK(snapshot_rejected(badPath));
+	std::filesystem::remove(std::filesystem::path(badPath));
+
+	//A system that has had entities, even ones since destroyed, would keep their stale slots
+	{
+		ComponentSystem used{ test::job_system() };
+		used.componentType<SnapshotVelocity>();
+		used.componentType<SnapshotTag>();
+		used.removeEntity(used.createEntity());
+		bool threw = false;
+		try {
+			used.loadSnapshot(path);
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		CHECK(threw && used.entityCount() == 0);
+	}
+
+	//The untouched file still loads
+	ComponentSystem cs{ test::job_system() };
+	cs.componentType<SnapshotVelocity>();
+	cs.componentType<SnapshotTag>();
+	cs.loadSnapshot(path);
+	CHECK(cs.entityCount() == 3000);
+}
+
+TEST(snapshot_load_1m_entities) {
+	//Only a timing, the round trip test covers correctness
+	if (!test::benchmarks_enabled()) {
+		return;
+	}
+	const uint32_t count = 1000000;
+	std::wstring path = snapshot_path(L"starchicken_1m.snap");
+	double saveTime = 0;
+	{
+		ComponentSystem cs{ test::job_system() };
+		std::vector<Entity> ents(count);
+		cs.createEntities(count / 2, cs.archetypeOf<SnapshotVelocity>(), ents.data());
+		cs.createEntities(count / 2, cs.archetypeOf<SnapshotVelocity, SnapshotTag>(), ents.data() + count / 2);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		cs.saveSnapshot(path);
+		saveTime = test::milliseconds_since(start);
+	}
+	{
+		ComponentSystem loaded{ test::job_system() };
+		loaded.componentType<SnapshotVelocity>();
+		loaded.componentType<SnapshotTag>();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		loaded.loadSnapshot(path);
+		double loadTime = test::milliseconds_since(start);
+		CHECK(loaded.entityCount() == count);
+		test::report("save 1M entities", saveTime, "ms");
+		test::report("load 1M entities", loadTime, "ms");
+	}
+	std::filesystem::remove(std::filesystem::path(path));
+}
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <atomic>
+#include <chrono>
+#include "Test.h"
+#include "SystemScheduler.h"
+
+using namespace ecs;
+
+struct SchedulerHealth {
+	int32_t value;
+};
+
+struct SchedulerVelocity {
+	vec3f value;
+};
+
+static const uint32_t NO_PARTNER = ~0u;
+
+struct SchedulerCheck {
+	std::atomic<uint32_t> clock{ 0 };
+	std::atomic<bool> started[4]{};
+};
+
+struct SystemRun {
+	SchedulerCheck* check;
+	uint32_t id;
+	//Another system this one should overlap with. It waits a while for the partner to start, which only happens if the two can run at once.
+	uint32_t partner;
+	uint32_t enter;
+	uint32_t leave;
+	bool sawPartner;
+};
+
+static void record_system_run(void* arg) {
+	SystemRun* run = reinterpret_cast<SystemRun*>(arg);
+	job::JobSystem& js = test::job_system();
+	run->enter = run->check->clock.fetch_add(1);
+	run->check->started[run->id].store(true);
+	if (run->partner != NO_PARTNER) {
+		auto start = std::chrono::steady_clock::now();
+		while (!run->check->started[run->partner].load() && test::milliseconds_since(start) < 2000.0) {
+			js.yield_job();
+		}
+		run->sawPartner = run->check->started[run->partner].load();
+	}
+	//Leave room for anything that shouldn't be running yet to sneak in
+	for (uint32_t y = 0; y < 20; y++) {
+		js.yield_job();
+	}
+	run->leave = run->check->clock.fetch_add(1);
+}
+
+TEST(system_access_conflicts) {
+	ComponentSystem cs{ test::job_system() };
+	SystemAccess readHealth = access<const SchedulerHealth>(cs);
+	SystemAccess writeHealth = access<SchedulerHealth>(cs);
+	SystemAccess writeVelocity = access<SchedulerVelocity>(cs);
+	CHECK(!readHealth.conflicts(readHealth));
+	CHECK(readHealth.conflicts(writeHealth));
+	CHECK(writeHealth.conflicts(readHealth));
+	CHECK(writeHealth.conflicts(writeHealth));
+	CHECK(!writeHealth.conflicts(writeVelocity));
+	CHECK(!writeVelocity.conflicts(readHealth));
+}
+
+TEST(system_scheduler_serializes_only_conflicts) {
+	ComponentSystem cs{ test::job_system() };
+	SchedulerCheck check;
+	enum { WRITE_HEALTH, WRITE_VELOCITY, READ_HEALTH, READ_BOTH };
+	SystemRun runs[4] = {
+		{ &check, WRITE_HEALTH, WRITE_VELOCITY },
+		{ &check, WRITE_VELOCITY, WRITE_HEALTH },
+		{ &check, READ_HEALTH, READ_BOTH },
+		{ &check, READ_BOTH, READ_HEALTH },
+	};
+	SystemScheduler scheduler;
+	scheduler.addSystem("write health", access<SchedulerHealth>(cs), record_system_run, &runs[WRITE_HEALTH]);
+	scheduler.addSystem("write velocity", access<SchedulerVelocity>(cs), record_system_run, &runs[WRITE_VELOCITY]);
+	scheduler.addSystem("read health", access<const SchedulerHealth>(cs), record_system_run, &runs[READ_HEALTH]);
+	scheduler.addSystem("read both", access<const SchedulerHealth, const SchedulerVelocity>(cs), record_system_run, &runs[READ_BOTH]);
+
+	for (uint32_t frame = 0; frame < 3; frame++) {
+		check.clock.store(0);
+		for (uint32_t i = 0; i < 4; i++) {
+			check.started[i].store(false);
+			runs[i].sawPartner = false;
+		}
+		scheduler.run(test::job_system());
+		CHECK(check.clock.load() == 8);
+		//Readers only start once the writers they conflict with have finished
+		CHECK(runs[WRITE_HEALTH].leave < runs[READ_HEALTH].enter);
+		CHECK(runs[WRITE_HEALTH].leave < runs[READ_BOTH].enter);
+		CHECK(runs[WRITE_VELOCITY].leave < runs[READ_BOTH].enter);
+		//Writers to different components, and readers of the same one, run side by side
+		CHECK(runs[WRITE_HEALTH].sawPartner);
+		CHECK(runs[WRITE_VELOCITY].sawPartner);
+		CHECK(runs[READ_HEALTH].sawPartner);
+		CHECK(runs[READ_BOTH].sawPartner);
+	}
+	//Each frame has one writer and one reader on its longest chain
+	CHECK(scheduler.criticalPathSystems().size() == 2);
+	CHECK(scheduler.totalWorkNanoseconds() >= scheduler.criticalPathNanoseconds());
+}
\ No newline at end of file
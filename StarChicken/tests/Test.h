@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include "JobSystem.h"
+
+//Just enough of a test runner for the parts of the engine that don't need a window or a GPU.
+//Every test runs inside a job on one shared job system, so they can use wait_for and friends like engine code does.
+namespace test {
+	struct TestCase {
+		const char* name;
+		void (*func)();
+	};
+
+	std::vector<TestCase>& registry();
+	bool register_test(const char* name, void (*func)());
+	void fail(const char* file, int line, const char* expression);
+	job::JobSystem& job_system();
+	//Timings are only measured and printed when run with --bench, the checks run either way
+	bool benchmarks_enabled();
+	void report(const char* name, double value, const char* unit);
+
+	inline double milliseconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+#define TEST(name) static void name(); static bool name##_registered = test::register_test(#name, name); static void name()
+#define CHECK(expression) do { if (!(expression)) { test::fail(__FILE__, __LINE__, #expression); } } while (0)
\ No newline at end of file
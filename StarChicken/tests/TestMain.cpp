@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+#include "Test.h"
+
+namespace test {
+	static job::JobSystem jobSystem;
+	static bool benchmarks = false;
+	static uint32_t failures = 0;
+	static uint32_t failedTests = 0;
+	static std::vector<const char*> filters;
+
+	std::vector<TestCase>& registry() {
+		static std::vector<TestCase> tests;
+		return tests;
+	}
+
+	bool register_test(const char* name, void (*func)()) {
+		registry().push_back(TestCase{ name, func });
+		return true;
+	}
+
+	void fail(const char* file, int line, const char* expression) {
+		failures++;
+		printf("    %s:%d: CHECK(%s) failed\n", file, line, expression);
+	}
+
+	job::JobSystem& job_system() {
+		return jobSystem;
+	}
+
+	bool benchmarks_enabled() {
+		return benchmarks;
+	}
+
+	void report(const char* name, double value, const char* unit) {
+		printf("    %s: %.3f %s\n", name, value, unit);
+	}
+
+	static bool selected(const char* name) {
+		if (filters.empty()) {
+			return true;
+		}
+		for (const char* filter : filters) {
+			if (strstr(name, filter)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void run_all() {
+		for (TestCase& test : registry()) {
+			if (!selected(test.name)) {
+				continue;
+			}
+			uint32_t failuresBefore = failures;
+			printf("[ RUN  ] %s\n", test.name);
+			fflush(stdout);
+			test.func();
+			bool passed = failures == failuresBefore;
+			failedTests += passed ? 0 : 1;
+			printf("[ %s ] %s\n", passed ? " OK " : "FAIL", test.name);
+			fflush(stdout);
+		}
+	}
+}
+
+//StarChickenTests [--bench] [name filters...]
+int main(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--bench") == 0) {
+			test::benchmarks = true;
+		} else {
+			test::filters.push_back(argv[i]);
+		}
+	}
+	//At least a few workers even on small machines, otherwise the concurrency tests don't test much
+	uint32_t threadCount = std::max(std::thread::hardware_concurrency(), 4u);
+	test::jobSystem.init_job_system(threadCount, false);
+	job::JobDecl entry{ test::run_all };
+	test::jobSystem.start_entry_point(entry);
+	while (!test::jobSystem.is_done()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	test::jobSystem.end_job_system();
+	printf("%u failed test(s), %u failed check(s)\n", test::failedTests, test::failures);
+	return test::failedTests == 0 ? 0 : 1;
+}
\ No newline at end of file